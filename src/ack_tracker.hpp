@@ -0,0 +1,89 @@
+#pragma once
+
+#include <map>
+#include <cstdint>
+
+#include <amqpcpp.h>
+
+// Tracks deliveries processed out of order and settles them in order.
+//
+// The longest contiguous prefix of processed deliveries is acked with a single
+// 'multiple' ack, failed ones are rejected individually, so acks never cover 
+// a delivery which is still being processed. 'multiple' covers every delivery 
+// of the channel - use a dedicated channel. Not thread-safe.
+
+class AckTracker
+{
+public:
+
+	// Delivery is being processed
+	void add(uint64_t deliveryTag)
+	{
+		_deliveries.emplace(deliveryTag, State::PROCESSING);
+	}
+
+	// Delivery is processed. Unknown tags (e.g. of a previous channel) are ignored.
+	void complete(uint64_t deliveryTag, bool success)
+	{
+		auto it = _deliveries.find(deliveryTag);
+
+		if(it != _deliveries.end()){
+			it->second = success ? State::DONE : State::FAILED;
+		}
+	}
+
+	/**
+	 *  Ack and reject the processed prefix of deliveries
+	 *  @param  channel         Channel of the deliveries
+	 *  @param  reject_flags    Flags of reject (e.g. AMQP::requeue)
+	 *  @return                 Number of settled deliveries
+	 */
+	size_t settle(AMQP::Channel &channel, int reject_flags = 0)
+	{
+		size_t res = 0;
+		uint64_t ack_upto = 0;
+		auto it = _deliveries.begin();
+
+		while(it != _deliveries.end() && it->second != State::PROCESSING){
+
+			if(it->second == State::DONE){
+				ack_upto = it->first;
+			}
+			else{
+				// 'multiple' ack must not cover the rejected one
+				if(ack_upto){
+					channel.ack(ack_upto, AMQP::multiple);
+					ack_upto = 0;
+				}
+
+				channel.reject(it->first, reject_flags);
+			}
+
+			it = _deliveries.erase(it);
+			++res;
+		}
+
+		if(ack_upto){
+			channel.ack(ack_upto, AMQP::multiple);
+		}
+
+		return res;
+	}
+
+	// Forget all deliveries, e.g. when channel is recreated
+	void clear() { _deliveries.clear(); }
+
+	// Not yet settled deliveries
+	size_t size() const { return _deliveries.size(); }
+
+private:
+
+	enum class State : uint8_t
+	{
+		PROCESSING,
+		DONE,
+		FAILED
+	};
+
+	std::map<uint64_t, State> _deliveries;
+};
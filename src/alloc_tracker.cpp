@@ -0,0 +1,560 @@
+#include "alloc_tracker.hpp"
+
+#ifdef ALLOC_TRACKER
+
+#include <new>
+#include <atomic>
+#include <mutex>
+#include <map>
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+
+#include <dlfcn.h>
+#include <cxxabi.h>
+
+
+namespace
+{
+	// Counters are written by the owning thread only (relaxed load + store,
+	// no locked instructions) and read by snapshot() from any thread
+	struct Counter
+	{
+		std::atomic<uint64_t> value{0};
+
+		void add(uint64_t n)
+		{
+			value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+		}
+
+		uint64_t get() const
+		{
+			return value.load(std::memory_order_relaxed);
+		}
+	};
+
+	struct SubsystemCounters
+	{
+		Counter allocations;
+		Counter bytes;
+		Counter frees;
+		Counter freed_bytes;
+	};
+
+	// Open addressing table of call sites
+	struct SiteCounters
+	{
+		std::atomic<uintptr_t> address{0};
+		Counter allocations;
+		Counter bytes;
+	};
+
+	constexpr size_t site_slots = 1024;
+	constexpr size_t site_probes = 8;
+
+	struct ThreadData
+	{
+		SubsystemCounters subsystems[AllocTracker::max_subsystems];
+		SiteCounters sites[site_slots];
+		Counter untracked_sites;
+		Counter allocations;
+		Counter bytes;
+		ThreadData *next = nullptr;
+	};
+
+	// Shared by all the threads
+	struct ConnectionCounters
+	{
+		std::atomic<uint64_t> allocations{0};
+		std::atomic<int64_t> live{0};
+		std::atomic<int64_t> peak{0};
+	};
+
+	struct Header
+	{
+		uint64_t size;
+		uint16_t subsystem;
+		uint16_t connection;
+		uint32_t offset;			// from the start of the malloc'ed block
+	};
+
+	static_assert(sizeof(Header) == 16, "header keeps malloc alignment");
+
+	std::atomic<ThreadData *> threads{nullptr};
+
+	// Registration (rare), names are read by snapshot()
+	std::mutex names_mutex;
+	const char *subsystem_names[AllocTracker::max_subsystems] = {"other"};
+	std::atomic<unsigned> subsystem_count{1};
+	std::string *connection_names[AllocTracker::max_connections];
+	std::atomic<unsigned> connection_count{1};
+	std::atomic<uint64_t> messages[AllocTracker::max_subsystems];
+	ConnectionCounters connections[AllocTracker::max_connections];
+
+	// Plain thread_local data: no constructors run inside operator new
+	thread_local ThreadData *this_thread_data = nullptr;
+	thread_local unsigned current_subsystem = 0;
+	thread_local unsigned current_connection = 0;
+
+	ThreadData *thread_data()
+	{
+		if(this_thread_data){
+			return this_thread_data;
+		}
+
+		// Not with operator new (we are inside it), never freed: counters outlive the thread
+		void *memory = std::calloc(1, sizeof(ThreadData));
+
+		if( !memory ){
+			return nullptr;
+		}
+
+		ThreadData *data = new(memory) ThreadData();
+		data->next = threads.load();
+
+		while( !threads.compare_exchange_weak(data->next, data) ){}
+
+		this_thread_data = data;
+		return data;
+	}
+
+	void count_site(ThreadData &data, uintptr_t address, size_t size)
+	{
+		size_t slot = (address >> 4) * 0x9E3779B97F4A7C15ull >> 54;		// 10 bits
+
+		for(size_t i = 0; i < site_probes; ++i, slot = (slot + 1) % site_slots){
+			SiteCounters &site = data.sites[slot];
+			const uintptr_t current = site.address.load(std::memory_order_relaxed);
+
+			if(current == address || current == 0){
+				if( !current ){
+					site.address.store(address, std::memory_order_relaxed);
+				}
+
+				site.allocations.add(1);
+				site.bytes.add(size);
+				return;
+			}
+		}
+
+		data.untracked_sites.add(1);
+	}
+
+	void count_allocation(Header &header, size_t size, uintptr_t site)
+	{
+		header.size = size;
+		header.subsystem = static_cast<uint16_t>(current_subsystem);
+		header.connection = static_cast<uint16_t>(current_connection);
+
+		if(ThreadData *data = thread_data()){
+			data->subsystems[header.subsystem].allocations.add(1);
+			data->subsystems[header.subsystem].bytes.add(size);
+			data->allocations.add(1);
+			data->bytes.add(size);
+			count_site(*data, site, size);
+		}
+
+		if(header.connection){
+			ConnectionCounters &c = connections[header.connection];
+			c.allocations.fetch_add(1, std::memory_order_relaxed);
+
+			const int64_t live = c.live.fetch_add(static_cast<int64_t>(size), std::memory_order_relaxed) + static_cast<int64_t>(size);
+			int64_t peak = c.peak.load(std::memory_order_relaxed);
+
+			while(live > peak && !c.peak.compare_exchange_weak(peak, live, std::memory_order_relaxed)){}
+		}
+	}
+
+	void *allocate(size_t size, size_t alignment, uintptr_t site)
+	{
+		// Header right before the returned pointer, the block is aligned as requested
+		const size_t offset = std::max(sizeof(Header), alignment);
+		void *block = nullptr;
+
+		if(alignment <= alignof(std::max_align_t)){
+			block = std::malloc(offset + size);
+		}
+		else{
+			const size_t total = (offset + size + alignment - 1) / alignment * alignment;
+			block = std::aligned_alloc(alignment, total);
+		}
+
+		if( !block ){
+			return nullptr;
+		}
+
+		char *ptr = static_cast<char *>(block) + offset;
+		Header &header = *reinterpret_cast<Header *>(ptr - sizeof(Header));
+		header.offset = static_cast<uint32_t>(offset);
+
+		count_allocation(header, size, site);
+		return ptr;
+	}
+
+	void deallocate(void *ptr)
+	{
+		if( !ptr ){
+			return;
+		}
+
+		Header &header = *reinterpret_cast<Header *>(static_cast<char *>(ptr) - sizeof(Header));
+
+		if(ThreadData *data = thread_data()){
+			data->subsystems[header.subsystem].frees.add(1);
+			data->subsystems[header.subsystem].freed_bytes.add(header.size);
+		}
+
+		if(header.connection){
+			connections[header.connection].live.fetch_sub(static_cast<int64_t>(header.size), std::memory_order_relaxed);
+		}
+
+		std::free(static_cast<char *>(ptr) - header.offset);
+	}
+
+	void *allocate_or_throw(size_t size, size_t alignment, uintptr_t site)
+	{
+		for(;;){
+			if(void *ptr = allocate(size, alignment, site)){
+				return ptr;
+			}
+
+			std::new_handler handler = std::get_new_handler();
+
+			if( !handler ){
+				throw std::bad_alloc();
+			}
+
+			handler();
+		}
+	}
+
+	std::string resolve(uintptr_t address)
+	{
+		Dl_info info;
+		char buf[32];
+		snprintf(buf, sizeof(buf), "%#lx", static_cast<unsigned long>(address));
+
+		if( !dladdr(reinterpret_cast<void *>(address), &info) || !info.dli_sname ){
+			return buf;
+		}
+
+		int status = 0;
+		char *demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+		std::string res = status == 0 && demangled ? demangled : info.dli_sname;
+		std::free(demangled);
+
+		snprintf(buf, sizeof(buf), "+%#lx", static_cast<unsigned long>(address - reinterpret_cast<uintptr_t>(info.dli_saddr)));
+		return res + buf;
+	}
+
+	uintptr_t caller(void *address)
+	{
+		return reinterpret_cast<uintptr_t>(address);
+	}
+}
+
+
+// Replaced global allocation functions
+
+void *operator new(size_t size)
+{
+	return allocate_or_throw(size, 0, caller(__builtin_return_address(0)));
+}
+
+void *operator new[](size_t size)
+{
+	return allocate_or_throw(size, 0, caller(__builtin_return_address(0)));
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept
+{
+	return allocate(size, 0, caller(__builtin_return_address(0)));
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept
+{
+	return allocate(size, 0, caller(__builtin_return_address(0)));
+}
+
+void *operator new(size_t size, std::align_val_t alignment)
+{
+	return allocate_or_throw(size, static_cast<size_t>(alignment), caller(__builtin_return_address(0)));
+}
+
+void *operator new[](size_t size, std::align_val_t alignment)
+{
+	return allocate_or_throw(size, static_cast<size_t>(alignment), caller(__builtin_return_address(0)));
+}
+
+void operator delete(void *ptr) noexcept { deallocate(ptr); }
+void operator delete[](void *ptr) noexcept { deallocate(ptr); }
+void operator delete(void *ptr, size_t) noexcept { deallocate(ptr); }
+void operator delete[](void *ptr, size_t) noexcept { deallocate(ptr); }
+void operator delete(void *ptr, std::align_val_t) noexcept { deallocate(ptr); }
+void operator delete[](void *ptr, std::align_val_t) noexcept { deallocate(ptr); }
+void operator delete(void *ptr, size_t, std::align_val_t) noexcept { deallocate(ptr); }
+void operator delete[](void *ptr, size_t, std::align_val_t) noexcept { deallocate(ptr); }
+
+
+unsigned AllocTracker::subsystem(const char *name)
+{
+	std::lock_guard<std::mutex> lock(names_mutex);
+
+	const unsigned count = subsystem_count.load();
+
+	for(unsigned i = 0; i < count; ++i){
+		if(std::strcmp(subsystem_names[i], name) == 0){
+			return i;
+		}
+	}
+
+	if(count == max_subsystems){
+		return 0;
+	}
+
+	subsystem_names[count] = strdup(name);
+	subsystem_count.store(count + 1);
+	return count;
+}
+
+unsigned AllocTracker::connection(const std::string &name)
+{
+	std::lock_guard<std::mutex> lock(names_mutex);
+
+	const unsigned count = connection_count.load();
+
+	if(count == max_connections){
+		return 0;
+	}
+
+	connection_names[count] = new std::string(name);
+	connection_count.store(count + 1);
+	return count;
+}
+
+void AllocTracker::message(unsigned subsystem, uint64_t count)
+{
+	if(subsystem < max_subsystems){
+		messages[subsystem].fetch_add(count, std::memory_order_relaxed);
+	}
+}
+
+AllocTracker::ThreadCounters AllocTracker::this_thread()
+{
+	ThreadCounters res;
+
+	if(ThreadData *data = thread_data()){
+		res.allocations = data->allocations.get();
+		res.bytes = data->bytes.get();
+	}
+
+	return res;
+}
+
+namespace
+{
+	// Totals of all the threads, before subtracting the baseline of reset()
+	struct Totals
+	{
+		std::vector<AllocTracker::Subsystem> subsystems;
+		std::vector<uint64_t> freed_bytes;
+		std::vector<uint64_t> connection_allocations;
+		std::map<uintptr_t, AllocTracker::Site> sites;
+		uint64_t untracked_sites = 0;
+	};
+
+	Totals baseline;
+
+	Totals totals()
+	{
+		Totals res;
+
+		const unsigned subsystems = subsystem_count.load();
+		const unsigned connection_slots = connection_count.load();
+
+		res.subsystems.resize(subsystems);
+		res.freed_bytes.resize(subsystems);
+
+		for(unsigned i = 0; i < connection_slots; ++i){
+			res.connection_allocations.push_back(connections[i].allocations.load());
+		}
+
+		for(ThreadData *data = threads.load(); data; data = data->next){
+			for(unsigned i = 0; i < subsystems; ++i){
+				const SubsystemCounters &c = data->subsystems[i];
+				AllocTracker::Subsystem &s = res.subsystems[i];
+
+				s.allocations += c.allocations.get();
+				s.bytes += c.bytes.get();
+				s.frees += c.frees.get();
+				res.freed_bytes[i] += c.freed_bytes.get();
+			}
+
+			for(const SiteCounters &site : data->sites){
+				if(const uintptr_t address = site.address.load(std::memory_order_relaxed)){
+					AllocTracker::Site &s = res.sites[address];
+					s.allocations += site.allocations.get();
+					s.bytes += site.bytes.get();
+				}
+			}
+
+			res.untracked_sites += data->untracked_sites.get();
+		}
+
+		for(unsigned i = 0; i < subsystems; ++i){
+			res.subsystems[i].messages = messages[i].load();
+			res.subsystems[i].live_bytes = static_cast<int64_t>(res.subsystems[i].bytes) - static_cast<int64_t>(res.freed_bytes[i]);
+		}
+
+		return res;
+	}
+
+	template<typename T>
+	T since(T value, const std::vector<T> &base, size_t index)
+	{
+		return index < base.size() ? value - base[index] : value;
+	}
+}
+
+AllocTracker::Snapshot AllocTracker::snapshot(size_t top_sites)
+{
+	Snapshot res;
+	res.enabled = true;
+
+	std::lock_guard<std::mutex> lock(names_mutex);
+
+	Totals now = totals();
+
+	// Counters since the last reset(), live bytes and peaks are absolute
+	for(size_t i = 0; i < now.subsystems.size(); ++i){
+		Subsystem s = now.subsystems[i];
+		s.name = subsystem_names[i];
+
+		if(i < baseline.subsystems.size()){
+			const Subsystem &base = baseline.subsystems[i];
+			s.allocations -= base.allocations;
+			s.bytes -= base.bytes;
+			s.frees -= base.frees;
+			s.messages -= base.messages;
+		}
+
+		res.subsystems.push_back(std::move(s));
+	}
+
+	for(size_t i = 1; i < now.connection_allocations.size(); ++i){
+		Connection c;
+		c.name = *connection_names[i];
+		c.allocations = since(now.connection_allocations[i], baseline.connection_allocations, i);
+		c.live_bytes = connections[i].live.load();
+		c.peak_bytes = connections[i].peak.load();
+		res.connections.push_back(std::move(c));
+	}
+
+	std::vector<std::pair<uintptr_t, Site>> sorted;
+
+	for(auto &site : now.sites){
+		auto base = baseline.sites.find(site.first);
+
+		if(base != baseline.sites.end()){
+			site.second.allocations -= base->second.allocations;
+			site.second.bytes -= base->second.bytes;
+		}
+
+		if(site.second.allocations){
+			sorted.push_back(site);
+		}
+	}
+
+	const size_t top = std::min(top_sites, sorted.size());
+
+	std::partial_sort(sorted.begin(), sorted.begin() + top, sorted.end(), [](const auto &a, const auto &b)
+	{
+		return a.second.allocations > b.second.allocations;
+	});
+
+	for(size_t i = 0; i < top; ++i){
+		sorted[i].second.location = resolve(sorted[i].first);
+		res.sites.push_back(std::move(sorted[i].second));
+	}
+
+	res.untracked_sites = now.untracked_sites - baseline.untracked_sites;
+	return res;
+}
+
+std::string AllocTracker::format(const Snapshot &snapshot)
+{
+	std::string res;
+	char line[512];
+
+	snprintf(line, sizeof(line), "%-20s %12s %14s %12s %12s %10s %10s\n",
+		"subsystem", "allocations", "bytes", "live bytes", "messages", "allocs/msg", "bytes/msg");
+	res += line;
+
+	for(const auto &s : snapshot.subsystems){
+		const double per = s.messages ? 1.0 / s.messages : 0;
+
+		snprintf(line, sizeof(line), "%-20s %12lu %14lu %12ld %12lu %10.2f %10.1f\n", s.name.c_str(),
+			static_cast<unsigned long>(s.allocations), static_cast<unsigned long>(s.bytes), static_cast<long>(s.live_bytes),
+			static_cast<unsigned long>(s.messages), s.allocations * per, s.bytes * per);
+		res += line;
+	}
+
+	if( !snapshot.connections.empty() ){
+		snprintf(line, sizeof(line), "\n%-20s %12s %14s %14s\n", "connection", "allocations", "live bytes", "peak bytes");
+		res += line;
+
+		for(const auto &c : snapshot.connections){
+			snprintf(line, sizeof(line), "%-20s %12lu %14ld %14ld\n", c.name.c_str(),
+				static_cast<unsigned long>(c.allocations), static_cast<long>(c.live_bytes), static_cast<long>(c.peak_bytes));
+			res += line;
+		}
+	}
+
+	if( !snapshot.sites.empty() ){
+		snprintf(line, sizeof(line), "\n%12s %14s  %s\n", "allocations", "bytes", "site");
+		res += line;
+
+		for(const auto &s : snapshot.sites){
+			snprintf(line, sizeof(line), "%12lu %14lu  %.400s\n",
+				static_cast<unsigned long>(s.allocations), static_cast<unsigned long>(s.bytes), s.location.c_str());
+			res += line;
+		}
+
+		if(snapshot.untracked_sites){
+			snprintf(line, sizeof(line), "%12lu %14s  (sites not tracked, tables full)\n", static_cast<unsigned long>(snapshot.untracked_sites), "");
+			res += line;
+		}
+	}
+
+	return res;
+}
+
+void AllocTracker::reset()
+{
+	std::lock_guard<std::mutex> lock(names_mutex);
+	baseline = totals();
+}
+
+AllocTracker::Scope::Scope(unsigned subsystem): _previous(current_subsystem)
+{
+	current_subsystem = subsystem < max_subsystems ? subsystem : 0;
+}
+
+AllocTracker::Scope::~Scope()
+{
+	current_subsystem = _previous;
+}
+
+AllocTracker::ConnectionScope::ConnectionScope(unsigned connection): _previous(current_connection)
+{
+	current_connection = connection < max_connections ? connection : 0;
+}
+
+AllocTracker::ConnectionScope::~ConnectionScope()
+{
+	current_connection = _previous;
+}
+
+#endif
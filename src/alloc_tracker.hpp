@@ -0,0 +1,166 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+/*
+	Allocation accounting (opt-in: cmake -DENABLE_ALLOC_TRACKER=ON ..).
+
+	Global operator new/delete are replaced and every allocation is counted
+	on the allocating thread, without locks, against:
+
+	* the subsystem of the current Scope on the thread (e.g. "event_loop",
+	  "rpc_client"), 0 - "other"
+	* the connection of the current ConnectionScope: live bytes and their
+	  high-water mark (MyTcpHandler::loop() sets it for its connection)
+	* the call site (return address of operator new), for the top sites report
+
+	Components count the messages they handle with message(), so the report
+	shows allocations and bytes per published / consumed message.
+
+	Every block carries a 16 byte header (size, subsystem, connection), which
+	is the price of the live bytes accounting. Counters of exited threads are
+	kept. Without ENABLE_ALLOC_TRACKER the API is inline no-ops.
+
+	Usage:
+		static const unsigned publish = AllocTracker::subsystem("publish");
+
+		AllocTracker::Scope scope(publish);
+		channel.publish(...);
+		AllocTracker::message(publish);
+		...
+		std::cerr << AllocTracker::format(AllocTracker::snapshot());
+*/
+
+class AllocTracker
+{
+public:
+
+	static constexpr unsigned max_subsystems = 32;
+	static constexpr unsigned max_connections = 256;
+
+	struct Subsystem
+	{
+		std::string name;
+		uint64_t allocations = 0;
+		uint64_t bytes = 0;
+		uint64_t frees = 0;
+		int64_t live_bytes = 0;			// allocated by the subsystem and not freed yet
+		uint64_t messages = 0;
+	};
+
+	struct Connection
+	{
+		std::string name;
+		uint64_t allocations = 0;
+		int64_t live_bytes = 0;
+		int64_t peak_bytes = 0;			// high-water mark of live_bytes
+	};
+
+	struct Site
+	{
+		std::string location;			// function+offset (or address)
+		uint64_t allocations = 0;
+		uint64_t bytes = 0;
+	};
+
+	struct Snapshot
+	{
+		bool enabled = false;
+		std::vector<Subsystem> subsystems;
+		std::vector<Connection> connections;
+		std::vector<Site> sites;		// by allocations, descending
+		uint64_t untracked_sites = 0;	// allocations not fitting the per-thread site tables
+	};
+
+	// Allocations of the calling thread
+	struct ThreadCounters
+	{
+		uint64_t allocations = 0;
+		uint64_t bytes = 0;
+	};
+
+#ifdef ALLOC_TRACKER
+
+	static constexpr bool enabled = true;
+
+	/**
+	 *  Subsystem ID by name, registered on first use. Thread-safe.
+	 *  @return unsigned        ID, 0 ("other") when all the slots are taken
+	 */
+	static unsigned subsystem(const char *name);
+
+	// Connection ID, a new one on every call (0 - "none" when all the slots are taken)
+	static unsigned connection(const std::string &name);
+
+	// Messages handled by the subsystem
+	static void message(unsigned subsystem, uint64_t count = 1);
+
+	static ThreadCounters this_thread();
+
+	/**
+	 *  Counters of all the threads
+	 *  @param  top_sites       Number of call sites to resolve
+	 */
+	static Snapshot snapshot(size_t top_sites = 10);
+
+	static std::string format(const Snapshot &snapshot);
+
+	// Start counting from zero (live bytes and peaks are not affected)
+	static void reset();
+
+	// Allocations of the thread are counted against the subsystem
+	class Scope
+	{
+	public:
+		explicit Scope(unsigned subsystem);
+		~Scope();
+
+		Scope(const Scope &) = delete;
+		Scope &operator=(const Scope &) = delete;
+
+	private:
+		unsigned _previous;
+	};
+
+	// Allocations of the thread are counted against the connection
+	class ConnectionScope
+	{
+	public:
+		explicit ConnectionScope(unsigned connection);
+		~ConnectionScope();
+
+		ConnectionScope(const ConnectionScope &) = delete;
+		ConnectionScope &operator=(const ConnectionScope &) = delete;
+
+	private:
+		unsigned _previous;
+	};
+
+#else
+
+	static constexpr bool enabled = false;
+
+	static unsigned subsystem(const char *) { return 0; }
+	static unsigned connection(const std::string &) { return 0; }
+	static void message(unsigned, uint64_t = 1) {}
+	static ThreadCounters this_thread() { return ThreadCounters(); }
+	static Snapshot snapshot(size_t = 10) { return Snapshot(); }
+	static std::string format(const Snapshot &) { return "allocation tracker is disabled (ENABLE_ALLOC_TRACKER)\n"; }
+	static void reset() {}
+
+	class Scope
+	{
+	public:
+		explicit Scope(unsigned) {}
+	};
+
+	class ConnectionScope
+	{
+	public:
+		explicit ConnectionScope(unsigned) {}
+	};
+
+#endif
+};
@@ -0,0 +1,571 @@
+#include <vector>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <cstdio>
+#include <ctime>
+#include <cerrno>
+
+#include <unistd.h>
+
+#include "async_log.hpp"
+
+
+namespace
+{
+	// Strings are cut to keep a record well below the ring size
+	const size_t max_string = 4096;
+
+	// Record in a ring, followed by the arguments, size is a multiple of 8.
+	// Padding at the end of the buffer has level -1.
+	struct Record
+	{
+		uint32_t size;
+		int32_t level;
+		uint32_t count;
+		const char *format;
+		int64_t time;			// ns since the epoch
+	};
+
+	struct Encoded
+	{
+		AsyncLog::Arg::Type type;
+		uint32_t length;		// STRING, bytes follow padded to 8
+		union
+		{
+			long long i;
+			unsigned long long u;
+			double d;
+			const void *p;
+		};
+	};
+
+	size_t align8(size_t n)
+	{
+		return (n + 7) & ~size_t(7);
+	}
+
+	// Single producer (the owner thread), single consumer (the writer)
+	struct Ring
+	{
+		explicit Ring(size_t capacity): buffer(new char[capacity]), capacity(capacity)
+		{
+
+		}
+
+		std::unique_ptr<char[]> buffer;
+		const size_t capacity;
+
+		alignas(64) std::atomic<uint64_t> head{0};		// owner thread
+		std::atomic<uint64_t> dropped{0};				// owner thread
+
+		alignas(64) std::atomic<uint64_t> tail{0};		// writer thread
+		uint64_t reported = 0;							// drops written by the writer
+
+		std::atomic<bool> closed{false};				// owner thread exited
+	};
+
+	struct State
+	{
+		~State()
+		{
+			this->stop();
+		}
+
+		void stop()
+		{
+			if( !writer.joinable() ){
+				return;
+			}
+
+			running.store(false, std::memory_order_release);
+
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stopping = true;
+			}
+
+			cv.notify_one();
+			writer.join();
+		}
+
+		std::mutex mutex;
+		std::vector<std::unique_ptr<Ring>> rings;
+		AsyncLog::Options options;
+		std::thread writer;
+		std::condition_variable cv;
+		bool stopping = false;
+
+		std::atomic<bool> running{false};
+		std::atomic<int> level{MSG_DEBUG};
+		std::atomic<int> policy{0};
+		std::atomic<size_t> ring_size{64 * 1024};
+
+		std::atomic<uint64_t> records{0};
+		std::atomic<uint64_t> dropped{0};
+		std::atomic<uint64_t> batches{0};
+		std::atomic<uint64_t> bytes{0};
+	};
+
+	State &state()
+	{
+		static State instance;
+		return instance;
+	}
+
+	// Ring of the thread, registered on the first record
+	struct Handle
+	{
+		~Handle()
+		{
+			if(ring){
+				ring->closed.store(true, std::memory_order_release);
+			}
+		}
+
+		Ring *ring = nullptr;
+	};
+
+	thread_local Handle handle;
+
+	Ring *thread_ring()
+	{
+		if(handle.ring){
+			return handle.ring;
+		}
+
+		State &s = state();
+		size_t capacity = 256;
+
+		while(capacity < s.ring_size.load(std::memory_order_relaxed)){
+			capacity <<= 1;
+		}
+
+		std::unique_ptr<Ring> ring(new Ring(capacity));
+		handle.ring = ring.get();
+
+		std::lock_guard<std::mutex> lock(s.mutex);
+		s.rings.push_back(std::move(ring));
+
+		return handle.ring;
+	}
+
+	class Writer
+	{
+	public:
+
+		explicit Writer(const AsyncLog::Options &options): _options(options)
+		{
+			_batch.reserve(_options.batch_size + 4096);
+		}
+
+		// Format the records of the ring, true if there were any
+		bool drain(Ring &ring)
+		{
+			uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+			const uint64_t head = ring.head.load(std::memory_order_acquire);
+			const size_t mask = ring.capacity - 1;
+
+			if(tail == head){
+				this->dropped(ring);
+				return false;
+			}
+
+			while(tail != head){
+				const Record *record = reinterpret_cast<const Record *>(ring.buffer.get() + (tail & mask));
+
+				if(record->level >= 0){
+					this->format(*record);
+				}
+
+				tail += record->size;
+
+				// Room for the owner as soon as possible
+				if(_batch.size() >= _options.batch_size){
+					ring.tail.store(tail, std::memory_order_release);
+					this->flush();
+				}
+			}
+
+			ring.tail.store(tail, std::memory_order_release);
+			this->dropped(ring);
+
+			return true;
+		}
+
+		void flush()
+		{
+			if(_batch.empty()){
+				return;
+			}
+
+			State &s = state();
+			s.records.fetch_add(_records, std::memory_order_relaxed);
+			_records = 0;
+
+			const char *data = _batch.data();
+			size_t left = _batch.size();
+
+			while(left){
+				const ssize_t res = ::write(_options.fd, data, left);
+
+				if(res < 0){
+					if(errno == EINTR) continue;
+					break;
+				}
+
+				data += res;
+				left -= res;
+			}
+
+			s.batches.fetch_add(1, std::memory_order_relaxed);
+			s.bytes.fetch_add(_batch.size() - left, std::memory_order_relaxed);
+
+			_batch.clear();
+		}
+
+	private:
+
+		void dropped(Ring &ring)
+		{
+			const uint64_t dropped = ring.dropped.load(std::memory_order_relaxed);
+
+			if(dropped == ring.reported){
+				return;
+			}
+
+			char line[64];
+			const int n = snprintf(line, sizeof(line), "AsyncLog: %lu records dropped\n", static_cast<unsigned long>(dropped - ring.reported));
+			_batch.append(line, n);
+
+			state().dropped.fetch_add(dropped - ring.reported, std::memory_order_relaxed);
+			ring.reported = dropped;
+		}
+
+		void format(const Record &record)
+		{
+			++_records;
+			this->prefix(record.time);
+
+			const Encoded *arg = reinterpret_cast<const Encoded *>(&record + 1);
+			uint32_t left = record.count;
+			const char *f = record.format;
+			char spec[32];
+			char value[512];
+
+			while(*f){
+				const char *percent = strchr(f, '%');
+
+				if( !percent ){
+					_batch.append(f);
+					break;
+				}
+
+				_batch.append(f, percent - f);
+				f = percent + 1;
+
+				if(*f == '%'){
+					_batch.push_back('%');
+					++f;
+					continue;
+				}
+
+				// Flags, width, precision and length up to the conversion
+				const size_t length = strcspn(f, "diouxXeEfFgGaAcsp");
+
+				if( !f[length] || !left ){
+					_batch.append(percent, f + length + (f[length] ? 1 : 0) - percent);
+					f += length + (f[length] ? 1 : 0);
+					continue;
+				}
+
+				// '*' width or precision takes an int argument, its value goes into the spec
+				size_t used = 1;
+				spec[0] = '%';
+
+				for(size_t i = 0; i <= length && used < sizeof(spec); ++i){
+					if(f[i] != '*'){
+						spec[used++] = f[i];
+					}
+					else if(left && arg->type == AsyncLog::Arg::INT){
+						used += snprintf(spec + used, sizeof(spec) - used, "%d", static_cast<int>(arg->i));
+						arg = Writer::next(arg);
+						--left;
+					}
+					else{
+						used = sizeof(spec);
+					}
+				}
+
+				if(used >= sizeof(spec) || !left){
+					_batch.append(percent, f + length + 1 - percent);
+					f += length + 1;
+					continue;
+				}
+
+				spec[used] = '\0';
+				f += length + 1;
+
+				int n = 0;
+
+				// %s with a string only, the rest is printf's business as usual
+				if((f[-1] == 's') != (arg->type == AsyncLog::Arg::STRING)){
+					_batch.push_back('?');
+				}
+				else switch(arg->type){
+				case AsyncLog::Arg::INT: n = snprintf(value, sizeof(value), spec, static_cast<int>(arg->i)); break;
+				case AsyncLog::Arg::UINT: n = snprintf(value, sizeof(value), spec, static_cast<unsigned>(arg->u)); break;
+				case AsyncLog::Arg::LONG: n = snprintf(value, sizeof(value), spec, static_cast<long>(arg->i)); break;
+				case AsyncLog::Arg::ULONG: n = snprintf(value, sizeof(value), spec, static_cast<unsigned long>(arg->u)); break;
+				case AsyncLog::Arg::LLONG: n = snprintf(value, sizeof(value), spec, arg->i); break;
+				case AsyncLog::Arg::ULLONG: n = snprintf(value, sizeof(value), spec, arg->u); break;
+				case AsyncLog::Arg::DOUBLE: n = snprintf(value, sizeof(value), spec, arg->d); break;
+				case AsyncLog::Arg::POINTER: n = snprintf(value, sizeof(value), spec, arg->p); break;
+
+				case AsyncLog::Arg::STRING:
+					// Plain %s without the copy through snprintf
+					if(length == 0){
+						_batch.append(reinterpret_cast<const char *>(arg + 1), arg->length);
+						n = -1;
+					}
+					else{
+						const std::string s(reinterpret_cast<const char *>(arg + 1), arg->length);
+						n = snprintf(value, sizeof(value), spec, s.c_str());
+					}
+					break;
+				}
+
+				if(n > 0){
+					_batch.append(value, std::min<size_t>(n, sizeof(value) - 1));
+				}
+
+				arg = Writer::next(arg);
+				--left;
+			}
+		}
+
+		static const Encoded *next(const Encoded *arg)
+		{
+			const size_t size = sizeof(Encoded) + (arg->type == AsyncLog::Arg::STRING ? align8(arg->length) : 0);
+			return reinterpret_cast<const Encoded *>(reinterpret_cast<const char *>(arg) + size);
+		}
+
+		// "HH:MM:SS.uuuuuu "
+		void prefix(int64_t time)
+		{
+			const time_t seconds = time / 1000000000;
+
+			if(seconds != _second){
+				struct tm tm;
+				localtime_r(&seconds, &tm);
+				snprintf(_clock, sizeof(_clock), "%02d:%02d:%02d", tm.tm_hour, tm.tm_min, tm.tm_sec);
+				_second = seconds;
+			}
+
+			char line[32];
+			const int n = snprintf(line, sizeof(line), "%s.%06ld ", _clock, static_cast<long>(time % 1000000000 / 1000));
+			_batch.append(line, n);
+		}
+
+		const AsyncLog::Options &_options;
+		std::string _batch;
+		uint64_t _records = 0;
+		time_t _second = -1;
+		char _clock[16] = "";
+	};
+
+	void write_loop()
+	{
+		State &s = state();
+		Writer writer(s.options);
+		std::vector<Ring *> rings;
+
+		for(;;){
+			bool stopping = false;
+
+			{
+				std::unique_lock<std::mutex> lock(s.mutex);
+
+				// Rings of the exited threads are freed when written out
+				for(auto it = s.rings.begin(); it != s.rings.end();){
+					Ring &ring = **it;
+
+					if(ring.closed.load(std::memory_order_acquire) && ring.tail.load() == ring.head.load() && ring.reported == ring.dropped.load()){
+						it = s.rings.erase(it);
+					}
+					else{
+						++it;
+					}
+				}
+
+				rings.clear();
+
+				for(auto &ring : s.rings){
+					rings.push_back(ring.get());
+				}
+
+				stopping = s.stopping;
+			}
+
+			bool busy = false;
+
+			for(Ring *ring : rings){
+				busy |= writer.drain(*ring);
+			}
+
+			writer.flush();
+
+			if(busy){
+				continue;
+			}
+
+			if(stopping){
+				break;
+			}
+
+			std::unique_lock<std::mutex> lock(s.mutex);
+			s.cv.wait_for(lock, s.options.flush_interval, [&s]{ return s.stopping; });
+		}
+	}
+}
+
+
+void AsyncLog::start(const Options &options)
+{
+	AsyncLog::stop();
+
+	State &s = state();
+
+	{
+		std::lock_guard<std::mutex> lock(s.mutex);
+		s.options = options;
+		s.stopping = false;
+	}
+
+	s.level.store(options.level);
+	s.policy.store(static_cast<int>(options.policy));
+	s.ring_size.store(options.ring_size);
+
+	s.writer = std::thread(write_loop);
+	s.running.store(true, std::memory_order_release);
+}
+
+void AsyncLog::start()
+{
+	AsyncLog::start(Options());
+}
+
+void AsyncLog::stop()
+{
+	state().stop();
+}
+
+bool AsyncLog::running()
+{
+	return state().running.load(std::memory_order_acquire);
+}
+
+AsyncLog::Stats AsyncLog::stats()
+{
+	State &s = state();
+	Stats stats;
+
+	stats.records = s.records.load(std::memory_order_relaxed);
+	stats.dropped = s.dropped.load(std::memory_order_relaxed);
+	stats.batches = s.batches.load(std::memory_order_relaxed);
+	stats.bytes = s.bytes.load(std::memory_order_relaxed);
+
+	return stats;
+}
+
+AsyncLog::Mode AsyncLog::mode(int level)
+{
+	State &s = state();
+
+	if( !s.running.load(std::memory_order_acquire) ){
+		return FORWARD;
+	}
+
+	return level > s.level.load(std::memory_order_relaxed) ? FILTERED : ASYNC;
+}
+
+AsyncLog::Arg AsyncLog::pack(const char *value)
+{
+	if( !value ){
+		value = "(null)";
+	}
+
+	return AsyncLog::string(value, strlen(value));
+}
+
+void AsyncLog::push(int level, const char *format, const Arg *args, size_t count)
+{
+	Ring &ring = *thread_ring();
+	State &s = state();
+
+	size_t size = sizeof(Record);
+
+	for(size_t i = 0; i < count; ++i){
+		size += sizeof(Encoded) + (args[i].type == Arg::STRING ? align8(std::min(args[i].length, max_string)) : 0);
+	}
+
+	const uint64_t head = ring.head.load(std::memory_order_relaxed);
+	const size_t offset = head & (ring.capacity - 1);
+	const size_t contiguous = ring.capacity - offset;
+	const size_t needed = size <= contiguous ? size : size + contiguous;
+
+	if(needed > ring.capacity){
+		ring.dropped.store(ring.dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		return;
+	}
+
+	while(head + needed - ring.tail.load(std::memory_order_acquire) > ring.capacity){
+		if(s.policy.load(std::memory_order_relaxed) == static_cast<int>(Policy::DROP) || !s.running.load(std::memory_order_relaxed)){
+			ring.dropped.store(ring.dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+			return;
+		}
+
+		std::this_thread::yield();
+	}
+
+	char *data = ring.buffer.get() + offset;
+
+	// Not enough room up to the end of the buffer: skipped
+	if(size > contiguous){
+		Record *padding = reinterpret_cast<Record *>(data);
+		padding->size = contiguous;
+		padding->level = -1;
+		data = ring.buffer.get();
+	}
+
+	Record *record = reinterpret_cast<Record *>(data);
+	record->size = size;
+	record->level = level;
+	record->count = count;
+	record->format = format;
+	record->time = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+
+	Encoded *encoded = reinterpret_cast<Encoded *>(record + 1);
+
+	for(size_t i = 0; i < count; ++i){
+		encoded->type = args[i].type;
+		encoded->length = 0;
+		encoded->u = args[i].u;
+
+		size_t length = 0;
+
+		if(args[i].type == Arg::STRING){
+			length = std::min(args[i].length, max_string);
+			encoded->length = length;
+			memcpy(encoded + 1, args[i].p, length);
+		}
+
+		encoded = reinterpret_cast<Encoded *>(reinterpret_cast<char *>(encoded + 1) + align8(length));
+	}
+
+	ring.head.store(head + needed, std::memory_order_release);
+}
@@ -0,0 +1,207 @@
+#pragma once
+
+#include <string>
+#include <chrono>
+#include <cstdint>
+#include <type_traits>
+
+#include "logger.hpp"
+
+/*
+	Asynchronous logging front end.
+
+	AsyncLog::msg() takes the same arguments as logger.msg(), but only copies
+	a compact record (level, format pointer, time, raw arguments, strings by
+	value) into a lock-free ring of the calling thread. The writer thread
+	formats the records of all the rings and writes them in batches, so the
+	caller pays neither printf formatting nor the output syscall.
+
+	The format must be a string literal (it is read later by the writer).
+	A '*' width or precision takes an int argument as in printf, a
+	conversion with a mismatched argument is written as is.
+	When the ring is full the record is dropped (counted and reported in the
+	output) or the caller waits for the writer, see Options::policy.
+
+	Until start() and after stop() the calls go to logger.msg() as is.
+
+	Usage:
+		AsyncLog::Options options;
+		options.level = MSG_DEBUG;
+		AsyncLog::start(options);
+
+		AsyncLog::msg(MSG_DEBUG, "monitor: fd: %d, flags: %d\n", fd, flags);
+
+		AsyncLog::stop();		// the rest is written
+*/
+
+class AsyncLog
+{
+public:
+
+	enum class Policy
+	{
+		DROP,			// record is lost, counted
+		BLOCK			// caller waits for the room
+	};
+
+	struct Options
+	{
+		int level = MSG_DEBUG;						// records above are filtered
+		size_t ring_size = 64 * 1024;				// bytes per thread, rounded up to a power of 2
+		Policy policy = Policy::DROP;
+		int fd = 1;									// output, stdout by default
+		size_t batch_size = 64 * 1024;				// written at once
+		std::chrono::milliseconds flush_interval{10};	// writer wakeup when idle
+	};
+
+	struct Stats
+	{
+		uint64_t records = 0;		// written
+		uint64_t dropped = 0;		// rings full
+		uint64_t batches = 0;		// write() calls
+		uint64_t bytes = 0;
+	};
+
+	// Argument of a record, strings are copied into the ring
+	struct Arg
+	{
+		enum Type : uint8_t
+		{
+			INT,
+			UINT,
+			LONG,
+			ULONG,
+			LLONG,
+			ULLONG,
+			DOUBLE,
+			POINTER,
+			STRING
+		};
+
+		Type type;
+		union
+		{
+			long long i;
+			unsigned long long u;
+			double d;
+			const void *p;
+		};
+		size_t length = 0;		// STRING
+	};
+
+	static void start(const Options &options);
+	static void start();
+
+	// Writes the records and joins the writer thread
+	static void stop();
+
+	static bool running();
+
+	static Stats stats();
+
+	template<typename... Args>
+	static void msg(int level, const char *format, const Args&... args)
+	{
+		switch(AsyncLog::mode(level)){
+		case FILTERED:
+			return;
+
+		case FORWARD:
+			logger.msg(level, format, args...);
+			return;
+
+		case ASYNC:
+			break;
+		}
+
+		const Arg packed[] = { Arg(), AsyncLog::pack(args)... };
+		AsyncLog::push(level, format, packed + 1, sizeof...(Args));
+	}
+
+private:
+
+	enum Mode
+	{
+		FILTERED,
+		FORWARD,
+		ASYNC
+	};
+
+	static Mode mode(int level);
+	static void push(int level, const char *format, const Arg *args, size_t count);
+
+	static Arg pack(const std::string &value)
+	{
+		return AsyncLog::string(value.data(), value.size());
+	}
+
+	static Arg pack(const char *value);
+
+	static Arg pack(char *value)
+	{
+		return AsyncLog::pack(static_cast<const char *>(value));
+	}
+
+	static Arg pack(double value)
+	{
+		Arg arg;
+		arg.type = Arg::DOUBLE;
+		arg.d = value;
+		return arg;
+	}
+
+	// Integers with the types printf gets them (promoted), so the conversions stay valid
+	template<typename T>
+	static typename std::enable_if<std::is_integral<T>::value, Arg>::type pack(T value)
+	{
+		using U = decltype(+value);
+
+		Arg arg;
+
+		if(std::is_same<U, long long>::value) arg.type = Arg::LLONG;
+		else if(std::is_same<U, unsigned long long>::value) arg.type = Arg::ULLONG;
+		else if(std::is_same<U, long>::value) arg.type = Arg::LONG;
+		else if(std::is_same<U, unsigned long>::value) arg.type = Arg::ULONG;
+		else if(std::is_unsigned<U>::value) arg.type = Arg::UINT;
+		else arg.type = Arg::INT;
+
+		if(std::is_unsigned<U>::value){
+			arg.u = static_cast<unsigned long long>(value);
+		}
+		else{
+			arg.i = static_cast<long long>(value);
+		}
+
+		return arg;
+	}
+
+	template<typename T>
+	static typename std::enable_if<std::is_enum<T>::value, Arg>::type pack(T value)
+	{
+		return AsyncLog::pack(static_cast<typename std::underlying_type<T>::type>(value));
+	}
+
+	template<typename T>
+	static typename std::enable_if<std::is_floating_point<T>::value, Arg>::type pack(T value)
+	{
+		return AsyncLog::pack(static_cast<double>(value));
+	}
+
+	template<typename T>
+	static Arg pack(const T *value)
+	{
+		Arg arg;
+		arg.type = Arg::POINTER;
+		arg.p = value;
+		return arg;
+	}
+
+	static Arg string(const char *data, size_t length)
+	{
+		Arg arg;
+		arg.type = Arg::STRING;
+		arg.p = data;
+		arg.length = length;
+		return arg;
+	}
+};
@@ -0,0 +1,656 @@
+#include <deque>
+#include <random>
+#include <cstdlib>
+#include <cstdio>
+#include <algorithm>
+#include <vector>
+#include <unordered_map>
+
+#include "logger.hpp"
+#include "alloc_tracker.hpp"
+#include "async_rpc_client.hpp"
+
+
+namespace
+{
+	using steady_clock = std::chrono::steady_clock;
+
+	struct Request
+	{
+		uint64_t id;
+		std::string routingkey;
+		std::string body;
+		std::string content_type;
+		AsyncRpcClient::Callback callback;
+		steady_clock::time_point deadline;		// time_point::max() - no deadline
+		uint64_t timer = 0;				// deadline timer ID
+		std::string flight;				// coalescing key (empty - not coalesced)
+		size_t callers = 1;				// coalesced calls included
+	};
+
+	struct PendingCall
+	{
+		AsyncRpcClient::Callback callback;
+		uint64_t timer = 0;
+		std::string flight;
+		size_t callers = 1;
+
+		// Hedging: request is kept to be published again
+		uint64_t hedge_timer = 0;
+		steady_clock::time_point sent;
+		steady_clock::time_point deadline;
+		std::string routingkey;
+		std::string body;
+		std::string content_type;
+	};
+
+	// Latency samples the hedge delay percentile is taken from
+	const size_t latency_window = 1024;
+
+	// Hedge delay is recalculated after this many new samples
+	const size_t latency_refresh = 64;
+
+	// Hedge tokens are accumulated up to this, limits hedge bursts
+	const double max_hedge_tokens = 10;
+}
+
+
+struct AsyncRpcClient::Impl : public std::enable_shared_from_this<AsyncRpcClient::Impl>
+{
+	MyTcpHandler &handler;
+	AMQP::Channel &channel;
+	Options options;
+
+	std::string reply_queue;		// empty until declared
+	std::string prefix;				// correlation ID prefix unique for the client
+
+	uint64_t next_id = 0;
+	std::unordered_map<uint64_t, PendingCall> pending;
+	std::deque<Request> waiting;
+
+	// Options::coalesce - call ID of in-flight request by routing key and body
+	std::unordered_map<std::string, uint64_t> flights;
+
+	// Options::hedge_percentile - recent latencies (us), ring buffer
+	std::vector<uint32_t> latencies;
+	size_t latency_next = 0;
+	size_t latency_new = 0;
+	std::chrono::microseconds hedge_delay{0};
+	double hedge_tokens = 0;
+
+	Stats stats;
+
+	Impl(MyTcpHandler &h, AMQP::Channel &c, const Options &o): handler(h), channel(c), options(o)
+	{
+		options.hedge_budget = std::min(std::max(options.hedge_budget, 0.0), 1.0);
+		hedge_delay = options.hedge_delay;
+
+		std::random_device rd;
+		char buf[32];
+		snprintf(buf, sizeof(buf), "%08x%08x", rd(), rd());
+		prefix = buf;
+	}
+
+	~Impl()
+	{
+		for(auto &p : pending){
+			this->cancel_timers(p.second);
+		}
+
+		for(auto &request : waiting){
+			if(request.timer) handler.cancel_timer(request.timer);
+		}
+	}
+
+	void cancel_timers(const PendingCall &call)
+	{
+		if(call.timer) handler.cancel_timer(call.timer);
+		if(call.hedge_timer) handler.cancel_timer(call.hedge_timer);
+	}
+
+	bool hedging() const
+	{
+		return options.hedge_percentile > 0 && options.hedge_budget > 0;
+	}
+
+	void start()
+	{
+		if(options.direct_reply_to){
+			// Pseudo-queue needs no declaration. Consuming has to start before 
+			// the first publish, which is guaranteed by the order of channel operations.
+			reply_queue = "amq.rabbitmq.reply-to";
+			this->consume();
+			return;
+		}
+
+		std::weak_ptr<Impl> weak = this->shared_from_this();
+
+		// Server-named exclusive queue for replies
+		channel.declareQueue("", AMQP::exclusive).onSuccess(
+			[weak](const std::string &name, uint32_t messagecount, uint32_t consumercount)
+			{
+				auto self = weak.lock();
+				if( !self ){
+					return;
+				}
+
+				self->reply_queue = name;
+				self->consume();
+				self->flush_waiting();
+			}
+		);
+	}
+
+	void consume()
+	{
+		std::weak_ptr<Impl> weak = this->shared_from_this();
+
+		channel.consume(reply_queue, AMQP::noack).onReceived(
+			[weak](const AMQP::Message &message, uint64_t deliveryTag, bool redelivered)
+			{
+				if(auto self = weak.lock()){
+					self->on_reply(message);
+				}
+			}
+		);
+	}
+
+	std::string correlation_id(uint64_t id) const
+	{
+		char buf[24];
+		snprintf(buf, sizeof(buf), ".%lx", static_cast<unsigned long>(id));
+		return prefix + buf;
+	}
+
+	// Call ID of our correlation ID, 0 if it is foreign
+	uint64_t parse_id(const std::string &corr_id) const
+	{
+		if(corr_id.size() <= prefix.size() + 1 || corr_id.compare(0, prefix.size(), prefix) != 0 || corr_id[prefix.size()] != '.'){
+			return 0;
+		}
+
+		return std::strtoull(corr_id.c_str() + prefix.size() + 1, nullptr, 16);
+	}
+
+	bool has_free_slot() const
+	{
+		return !options.max_in_flight || pending.size() < options.max_in_flight;
+	}
+
+	static Reply failure(Status status, const std::string &error)
+	{
+		Reply reply;
+		reply.status = status;
+		reply.error = error;
+		return reply;
+	}
+
+	// Attach callback to the call, so it gets the same reply
+	bool attach(uint64_t id, Callback callback)
+	{
+		Callback *leader = nullptr;
+		size_t *callers = nullptr;
+		auto it = pending.find(id);
+
+		if(it != pending.end()){
+			leader = &it->second.callback;
+			callers = &it->second.callers;
+		}
+		else{
+			for(auto &request : waiting){
+				if(request.id == id){
+					leader = &request.callback;
+					callers = &request.callers;
+				}
+			}
+		}
+
+		if( !leader ){
+			return false;
+		}
+
+		++*callers;
+
+		*leader = [first = std::move(*leader), second = std::move(callback)](const Reply &reply)
+		{
+			first(reply);
+			second(reply);
+		};
+
+		return true;
+	}
+
+	uint64_t submit(std::string routingkey, std::string body, const CallOptions &call_options, Callback callback)
+	{
+		std::string flight;
+
+		if(options.coalesce){
+			flight.reserve(routingkey.size() + call_options.content_type.size() + 2 + body.size());
+			flight.append(routingkey).append(1, '\0').append(call_options.content_type).append(1, '\0').append(body);
+
+			auto it = flights.find(flight);
+
+			if(it != flights.end() && this->attach(it->second, std::move(callback))){
+				++stats.coalesced;
+				return it->second;
+			}
+		}
+
+		Request request;
+		request.id = ++next_id;
+		request.routingkey = std::move(routingkey);
+		request.body = std::move(body);
+		request.content_type = call_options.content_type;
+		request.callback = std::move(callback);
+		request.deadline = steady_clock::time_point::max();
+
+		const auto timeout = call_options.timeout.count() > 0 ? call_options.timeout : options.timeout;
+
+		if(timeout.count() > 0){
+			request.deadline = steady_clock::now() + timeout;
+
+			std::weak_ptr<Impl> weak = this->shared_from_this();
+			const uint64_t id = request.id;
+
+			request.timer = handler.add_timer(timeout, [weak, id]{
+				if(auto self = weak.lock()){
+					self->expire(id);
+				}
+			});
+		}
+
+		const uint64_t id = request.id;
+
+		if( !flight.empty() ){
+			flights[flight] = id;
+			request.flight = std::move(flight);
+		}
+
+		if(reply_queue.empty() || !waiting.empty() || !this->has_free_slot()){
+			waiting.push_back(std::move(request));
+		}
+		else{
+			this->publish(std::move(request));
+		}
+
+		return id;
+	}
+
+	bool send(uint64_t id, const std::string &routingkey, const std::string &body, const std::string &content_type, steady_clock::time_point deadline)
+	{
+		AMQP::Envelope env(body.data(), body.size());
+		env.setCorrelationID(this->correlation_id(id));
+		env.setReplyTo(reply_queue);
+
+		if( !content_type.empty() ){
+			env.setContentType(content_type);
+		}
+
+		if(options.tracer){
+			options.tracer->stamp(env);
+		}
+
+		if(deadline != steady_clock::time_point::max()){
+			// Broker drops the request if it is not consumed before the deadline
+			auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - steady_clock::now());
+			env.setExpiration(std::to_string(std::max<int64_t>(left.count(), 1)));
+		}
+
+		return channel.publish(options.exchange, routingkey, env);
+	}
+
+	void publish(Request &&request)
+	{
+		static const unsigned subsystem = AllocTracker::subsystem("rpc_client");
+		AllocTracker::Scope scope(subsystem);
+		AllocTracker::message(subsystem);
+
+		if( !this->send(request.id, request.routingkey, request.body, request.content_type, request.deadline) ){
+			++stats.errors;
+
+			if(request.timer){
+				handler.cancel_timer(request.timer);
+			}
+
+			if( !request.flight.empty() ){
+				flights.erase(request.flight);
+			}
+
+			request.callback(failure(Status::ERROR, "publish failed"));
+			return;
+		}
+
+		++stats.requests;
+
+		PendingCall call;
+		call.callback = std::move(request.callback);
+		call.timer = request.timer;
+		call.flight = std::move(request.flight);
+		call.callers = request.callers;
+		call.sent = steady_clock::now();
+
+		if(this->hedging()){
+			hedge_tokens = std::min(hedge_tokens + options.hedge_budget, max_hedge_tokens);
+
+			const auto delay = std::chrono::duration_cast<std::chrono::milliseconds>(hedge_delay);
+
+			// Not worth hedging if the deadline comes first
+			if(request.deadline == steady_clock::time_point::max() || call.sent + delay < request.deadline){
+				std::weak_ptr<Impl> weak = this->shared_from_this();
+				const uint64_t id = request.id;
+
+				call.hedge_timer = handler.add_timer(std::max(delay, std::chrono::milliseconds(1)), [weak, id]{
+					if(auto self = weak.lock()){
+						self->hedge(id);
+					}
+				});
+
+				call.deadline = request.deadline;
+				call.routingkey = std::move(request.routingkey);
+				call.body = std::move(request.body);
+				call.content_type = std::move(request.content_type);
+			}
+		}
+
+		pending.emplace(request.id, std::move(call));
+	}
+
+	// Publish the request once more if the budget allows
+	void hedge(uint64_t id)
+	{
+		auto it = pending.find(id);
+
+		if(it == pending.end()){
+			return;
+		}
+
+		PendingCall &call = it->second;
+		call.hedge_timer = 0;
+
+		if(hedge_tokens < 1){
+			++stats.hedges_throttled;
+		}
+		else if(this->send(id, call.routingkey, call.body, call.content_type, call.deadline)){
+			hedge_tokens -= 1;
+			++stats.hedged;
+			logger.msg(MSG_TRACE, "AsyncRpcClient: hedged request %s\n", this->correlation_id(id));
+		}
+
+		// Not needed any more
+		std::string().swap(call.routingkey);
+		std::string().swap(call.body);
+	}
+
+	void add_latency(steady_clock::duration latency)
+	{
+		const auto us = std::chrono::duration_cast<std::chrono::microseconds>(latency).count();
+		const uint32_t sample = static_cast<uint32_t>(std::min<int64_t>(us, UINT32_MAX));
+
+		if(latencies.size() < latency_window){
+			latencies.push_back(sample);
+		}
+		else{
+			latencies[latency_next] = sample;
+			latency_next = (latency_next + 1) % latency_window;
+		}
+
+		if(++latency_new < latency_refresh){
+			return;
+		}
+
+		latency_new = 0;
+
+		std::vector<uint32_t> sorted(latencies);
+		const double rank = std::min(options.hedge_percentile, 100.0) / 100 * (sorted.size() - 1);
+		auto nth = sorted.begin() + static_cast<size_t>(rank);
+		std::nth_element(sorted.begin(), nth, sorted.end());
+
+		hedge_delay = std::max<std::chrono::microseconds>(std::chrono::microseconds(*nth), options.hedge_delay);
+	}
+
+	void flush_waiting()
+	{
+		while( !reply_queue.empty() && !waiting.empty() && this->has_free_slot() ){
+			Request request = std::move(waiting.front());
+			waiting.pop_front();
+			this->publish(std::move(request));
+		}
+	}
+
+	// Remove the call from pending or waiting ones, returns its callback
+	Callback take(uint64_t id, steady_clock::time_point *sent = nullptr)
+	{
+		Callback callback;
+		std::string flight;
+
+		auto it = pending.find(id);
+
+		if(it != pending.end()){
+			callback = std::move(it->second.callback);
+			flight = std::move(it->second.flight);
+
+			if(sent){
+				*sent = it->second.sent;
+			}
+
+			this->cancel_timers(it->second);
+			pending.erase(it);
+		}
+		else{
+			auto wit = std::find_if(waiting.begin(), waiting.end(), [id](const Request &r){ return r.id == id; });
+
+			if(wit == waiting.end()){
+				return nullptr;
+			}
+
+			callback = std::move(wit->callback);
+			flight = std::move(wit->flight);
+
+			if(wit->timer){
+				handler.cancel_timer(wit->timer);
+			}
+
+			waiting.erase(wit);
+		}
+
+		// Following identical calls make a new request
+		if( !flight.empty() ){
+			flights.erase(flight);
+		}
+
+		return callback;
+	}
+
+	void expire(uint64_t id)
+	{
+		auto it = pending.find(id);
+
+		if(it != pending.end()){
+			// Timer has fired already, nothing to cancel
+			it->second.timer = 0;
+		}
+		else{
+			for(auto &request : waiting){
+				if(request.id == id) request.timer = 0;
+			}
+		}
+
+		steady_clock::time_point sent;
+
+		if(Callback callback = this->take(id, &sent)){
+			++stats.timeouts;
+
+			// Published and never answered: its latency is at least this. Without
+			// it the percentile is biased low exactly when the server is slow.
+			if(this->hedging() && sent != steady_clock::time_point()){
+				this->add_latency(steady_clock::now() - sent);
+			}
+
+			callback(failure(Status::TIMEOUT, "deadline exceeded"));
+			this->flush_waiting();
+		}
+	}
+
+	void on_reply(const AMQP::Message &message)
+	{
+		steady_clock::time_point sent;
+		Callback callback = this->take(this->parse_id(message.correlationID()), &sent);
+
+		if( !callback ){
+			// Also the slower reply of a hedged request
+			++stats.unknown_replies;
+			logger.msg(MSG_TRACE, "AsyncRpcClient: dropped reply with unknown correlation ID '%s'\n", message.correlationID());
+			return;
+		}
+
+		++stats.replies;
+
+		if(options.tracer){
+			options.tracer->received(message);
+		}
+
+		if(this->hedging()){
+			this->add_latency(steady_clock::now() - sent);
+		}
+
+		Reply reply;
+		reply.body.assign(message.body(), message.bodySize());
+
+		if(message.hasContentType()){
+			reply.content_type = message.contentType();
+		}
+
+		callback(reply);
+		this->flush_waiting();
+	}
+};
+
+
+AsyncRpcClient::AsyncRpcClient(MyTcpHandler &handler, AMQP::Channel &channel):
+	AsyncRpcClient(handler, channel, Options())
+{
+
+}
+
+AsyncRpcClient::AsyncRpcClient(MyTcpHandler &handler, AMQP::Channel &channel, const Options &options):
+	pimpl(std::make_shared<Impl>(handler, channel, options))
+{
+	pimpl->start();
+}
+
+AsyncRpcClient::~AsyncRpcClient() = default;
+
+uint64_t AsyncRpcClient::call(const std::string &routingkey, const std::string &body, Callback callback)
+{
+	return pimpl->submit(routingkey, body, CallOptions(), std::move(callback));
+}
+
+uint64_t AsyncRpcClient::call(const std::string &routingkey, const std::string &body, const CallOptions &options, Callback callback)
+{
+	return pimpl->submit(routingkey, body, options, std::move(callback));
+}
+
+bool AsyncRpcClient::cancel(uint64_t id)
+{
+	Callback callback = pimpl->take(id);
+
+	if( !callback ){
+		return false;
+	}
+
+	++pimpl->stats.cancelled;
+	callback(Impl::failure(Status::CANCELLED, "cancelled"));
+	pimpl->flush_waiting();
+	return true;
+}
+
+bool AsyncRpcClient::release(uint64_t id)
+{
+	size_t *callers = nullptr;
+	auto it = pimpl->pending.find(id);
+
+	if(it != pimpl->pending.end()){
+		callers = &it->second.callers;
+	}
+	else{
+		for(auto &request : pimpl->waiting){
+			if(request.id == id) callers = &request.callers;
+		}
+	}
+
+	if( !callers ){
+		return false;
+	}
+
+	// Others still wait for the reply
+	if(--*callers){
+		return false;
+	}
+
+	return this->cancel(id);
+}
+
+std::future<AsyncRpcClient::Reply> AsyncRpcClient::async_call(const std::string &routingkey, std::string body)
+{
+	return this->async_call(routingkey, std::move(body), CallOptions());
+}
+
+std::future<AsyncRpcClient::Reply> AsyncRpcClient::async_call(const std::string &routingkey, std::string body, const CallOptions &options)
+{
+	auto promise = std::make_shared<std::promise<Reply>>();
+	auto future = promise->get_future();
+
+	std::weak_ptr<Impl> weak = pimpl;
+
+	pimpl->handler.post([weak, promise, routingkey, body = std::move(body), options]() mutable
+	{
+		auto self = weak.lock();
+
+		if( !self ){
+			promise->set_value(Impl::failure(Status::ERROR, "client destroyed"));
+			return;
+		}
+
+		self->submit(routingkey, std::move(body), options, [promise](const Reply &reply)
+		{
+			promise->set_value(reply);
+		});
+	});
+
+	return future;
+}
+
+void AsyncRpcClient::fail_pending(const std::string &reason)
+{
+	const Reply reply = Impl::failure(Status::ERROR, reason);
+
+	std::vector<Callback> callbacks;
+
+	for(auto &p : pimpl->pending){
+		pimpl->cancel_timers(p.second);
+		callbacks.push_back(std::move(p.second.callback));
+	}
+
+	for(auto &request : pimpl->waiting){
+		if(request.timer) pimpl->handler.cancel_timer(request.timer);
+		callbacks.push_back(std::move(request.callback));
+	}
+
+	pimpl->pending.clear();
+	pimpl->waiting.clear();
+	pimpl->flights.clear();
+	pimpl->stats.errors += callbacks.size();
+
+	for(auto &callback : callbacks){
+		callback(reply);
+	}
+}
+
+AsyncRpcClient::Stats AsyncRpcClient::stats() const
+{
+	Stats res = pimpl->stats;
+	res.in_flight = pimpl->pending.size();
+	res.waiting = pimpl->waiting.size();
+	res.hedge_delay = pimpl->hedge_delay;
+	return res;
+}
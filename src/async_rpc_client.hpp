@@ -0,0 +1,169 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <future>
+#include <functional>
+#include <chrono>
+#include <cstdint>
+
+#include <amqpcpp.h>
+
+#include "my_handler.hpp"
+#include "latency_tracer.hpp"
+
+/*
+	Asynchronous pipelined RPC client.
+
+	One reply queue per client (per connection), many concurrent requests in
+	flight. Every request gets a unique correlation ID, pending calls are kept 
+	in a hash map and completed when a reply with the same correlation ID 
+	arrives. Replies for unknown (e.g. already completed) calls are dropped.
+
+	Calls issued before the reply queue is declared are published as soon as
+	it is ready, so no need to wait for the channel callbacks before calling.
+
+	With Options::direct_reply_to RabbitMQ 'amq.rabbitmq.reply-to' pseudo-queue
+	is consumed (in no-ack mode) instead of declaring a queue: no round trip 
+	before the first request and no broker queue per client. Replies are sent 
+	straight to the channel, which must stay open until they arrive.
+
+	Calls may have a deadline driven by the event loop timers. When it passes 
+	the call completes with TIMEOUT status and its slot is freed, a late reply
+	is dropped by a single hash map lookup. Request 'expiration' property is 
+	set to the remaining time, so the broker discards requests nobody waits for.
+
+	With Options::coalesce identical calls (same routing key and body) made 
+	while a request is in flight are attached to it instead of publishing 
+	again, and the single reply is passed to all of them. Attached calls share 
+	the ID (cancel() cancels all of them, release() gives up one) and the
+	deadline of the first call.
+
+	Options::hedge_percentile enables hedged requests: if there is no reply 
+	after the given percentile of recent reply latencies, the request is 
+	published once more with the same correlation ID (e.g. to be picked by 
+	another rpc_server instance). The first reply completes the call, the 
+	other one is dropped as unknown. Hedges are limited by a token bucket 
+	refilled by Options::hedge_budget per request, so at most one extra 
+	request per call is sent and the load can't more than double. Timed out
+	calls count in the latencies at their deadline. Hedging only helps with
+	several servers on the queue: a hedged copy handled by the same server
+	waits behind the original request.
+
+	With Options::tracer requests carry the send time header and replies are
+	recorded by the tracer: transit is the round trip, hop 'rpc_server' is the
+	time to the reply on the server (see LatencyTracer).
+
+	call() must be used on the event loop thread, async_call() from any thread.
+*/
+
+class AsyncRpcClient
+{
+public:
+
+	enum class Status
+	{
+		OK,
+		TIMEOUT,	// deadline passed
+		CANCELLED,	// cancel() called
+		ERROR		// request can't be published or channel failed
+	};
+
+	struct Reply
+	{
+		Status status = Status::OK;
+		std::string body;
+		std::string content_type;
+		std::string error;
+	};
+
+	using Callback = std::function<void(const Reply &reply)>;
+
+	struct Options
+	{
+		std::string exchange;			// exchange requests are published to ("" - default)
+		size_t max_in_flight = 0;		// 0 - unlimited, otherwise calls wait for a free slot
+		bool direct_reply_to = false;	// use 'amq.rabbitmq.reply-to' instead of own reply queue
+		std::chrono::milliseconds timeout{0};	// default call timeout, 0 - no deadline
+		bool coalesce = false;			// attach identical calls to the in-flight request
+
+		double hedge_percentile = 0;	// hedge after this percentile of latency (e.g. 95), 0 - disabled
+		std::chrono::milliseconds hedge_delay{10};	// minimal hedge delay, used until latency is known
+		double hedge_budget = 0.05;		// hedges per request on average (at most 1)
+
+		std::shared_ptr<LatencyTracer> tracer;	// stamps requests, records replies (nullptr - off)
+	};
+
+	struct CallOptions
+	{
+		std::chrono::milliseconds timeout{0};	// 0 - use Options::timeout
+		std::string content_type;				// content-type of the request (empty - not set)
+	};
+
+	struct Stats
+	{
+		uint64_t requests = 0;			// published requests
+		uint64_t replies = 0;			// replies matched to pending calls
+		uint64_t unknown_replies = 0;	// late or foreign replies
+		uint64_t timeouts = 0;
+		uint64_t cancelled = 0;
+		uint64_t coalesced = 0;			// calls attached to an in-flight request
+		uint64_t hedged = 0;			// duplicate requests published
+		uint64_t hedges_throttled = 0;	// hedges skipped for lack of budget
+		std::chrono::microseconds hedge_delay{0};	// current hedge delay
+		uint64_t errors = 0;
+		size_t in_flight = 0;
+		size_t waiting = 0;				// calls waiting for reply queue or a free slot
+	};
+
+	AsyncRpcClient(MyTcpHandler &handler, AMQP::Channel &channel);
+	AsyncRpcClient(MyTcpHandler &handler, AMQP::Channel &channel, const Options &options);
+
+	// Pending calls are dropped without callbacks
+	~AsyncRpcClient();
+
+	/**
+	 *  Issue a request. Event loop thread only.
+	 *  @param  routingkey      Routing key of the request (server queue for default exchange)
+	 *  @param  body            Request body
+	 *  @param  callback        Called with the reply on the event loop thread
+	 *  @return                 Call ID
+	 */
+	uint64_t call(const std::string &routingkey, const std::string &body, Callback callback);
+	uint64_t call(const std::string &routingkey, const std::string &body, const CallOptions &options, Callback callback);
+
+	/**
+	 *  Cancel a pending call: callback is called with CANCELLED status and 
+	 *  the reply (if any) is dropped. Event loop thread only.
+	 *  @return                 Whether the call was pending
+	 */
+	bool cancel(uint64_t id);
+
+	/**
+	 *  Give up one caller of a call. With Options::coalesce a call has all the
+	 *  attached callers, it is cancelled only when the last one gives up; the
+	 *  callback of the caller is still called, so it must ignore the reply.
+	 *  Event loop thread only.
+	 *  @return                 Whether the call was cancelled
+	 */
+	bool release(uint64_t id);
+
+	/**
+	 *  Issue a request from any thread. Request is published by the event loop.
+	 *  @return                 Future of the reply
+	 */
+	std::future<Reply> async_call(const std::string &routingkey, std::string body);
+	std::future<Reply> async_call(const std::string &routingkey, std::string body, const CallOptions &options);
+
+	/**
+	 *  Complete all pending calls with ERROR status, e.g. from channel onError().
+	 */
+	void fail_pending(const std::string &reason);
+
+	Stats stats() const;
+
+private:
+
+	struct Impl;
+	std::shared_ptr<Impl> pimpl;
+};
@@ -0,0 +1,288 @@
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <exception>
+#include <cstdint>
+
+#include "logger.hpp"
+#include "alloc_tracker.hpp"
+#include "thread_pool.hpp"
+#include "async_rpc_server.hpp"
+
+
+namespace
+{
+	struct Completion
+	{
+		std::shared_ptr<Delivery> request;
+		std::shared_ptr<ReplyCache> cache;
+		bool success;
+		std::string body;
+	};
+
+	struct Service
+	{
+		AsyncRpcServer::Handler handler;
+		std::shared_ptr<ReplyCache> cache;	// nullptr - not cached
+	};
+}
+
+
+struct AsyncRpcServer::Impl : public std::enable_shared_from_this<AsyncRpcServer::Impl>
+{
+	MyTcpHandler &handler;
+	AMQP::Channel &channel;
+	Options options;
+
+	// Event loop thread data
+	size_t in_flight = 0;
+	Stats stats;
+
+	// Completed by workers, not yet published
+	std::mutex completed_mutex;
+	std::vector<Completion> completed;
+
+	std::atomic<bool> stopping{false};
+
+	// Destroyed first: waits for the requests being processed
+	std::unique_ptr<ThreadPool> pool;
+
+	Impl(MyTcpHandler &h, AMQP::Channel &c, const Options &o): handler(h), channel(c), options(o), pool(new ThreadPool(o.threads))
+	{
+		if( !options.max_concurrency ){
+			options.max_concurrency = static_cast<uint16_t>(std::min<size_t>(pool->size() * 2, UINT16_MAX));
+		}
+
+		// Prefetch shared by all consumers of the channel
+		channel.setQos(options.max_concurrency, true);
+	}
+
+	~Impl()
+	{
+		stopping.store(true);
+		pool.reset();
+	}
+
+	std::vector<std::shared_ptr<Service>> services;
+
+	// Same body may mean different requests in different encodings
+	static std::string cache_key(const Delivery &request)
+	{
+		if(request.content_type.empty()){
+			return request.body;
+		}
+
+		return request.content_type + '\0' + request.body;
+	}
+
+	void on_request(const std::shared_ptr<Service> &service, const AMQP::Message &message, uint64_t deliveryTag, bool redelivered)
+	{
+		++stats.requests;
+		++in_flight;
+
+		if(options.tracer){
+			options.tracer->received(message, deliveryTag);
+		}
+
+		auto request = std::make_shared<Delivery>(message, deliveryTag, redelivered);
+
+		if(service->cache){
+			if(const std::string *reply = service->cache->find(cache_key(*request))){
+				++stats.cached;
+				this->reply(*request, *reply);
+				this->processed(deliveryTag, true);
+				return;
+			}
+		}
+
+		pool->submit([this, service, request]
+		{
+			if(stopping.load()){
+				// Not acked - broker redelivers it
+				return;
+			}
+
+			Completion completion{request, service->cache, false, std::string()};
+
+			try{
+				completion.body = service->handler(*request);
+				completion.success = true;
+			}
+			catch(const std::exception &e){
+				logger.msg(MSG_ERROR, "AsyncRpcServer: handler exception: %s\n", e.what());
+			}
+
+			this->complete(std::move(completion));
+		});
+	}
+
+	// Worker thread
+	void complete(Completion &&completion)
+	{
+		bool was_empty = false;
+
+		{
+			std::lock_guard<std::mutex> lock(completed_mutex);
+			was_empty = completed.empty();
+			completed.push_back(std::move(completion));
+		}
+
+		if( !was_empty ){
+			return;
+		}
+
+		// Empty while Impl is being destroyed
+		std::weak_ptr<Impl> weak = this->weak_from_this();
+
+		handler.post([weak]{
+			if(auto self = weak.lock()){
+				self->flush();
+			}
+		});
+	}
+
+	// Event loop thread: request is processed - acked on its own, requests have no order
+	// to keep, so a slow one doesn't hold the acks (and prefetch slots) of the later ones
+	void processed(uint64_t deliveryTag, bool success)
+	{
+		if(success){
+			channel.ack(deliveryTag);
+		}
+		else{
+			channel.reject(deliveryTag);
+		}
+
+		// Processing ends with the ack frame, not with the handler
+		if(options.tracer){
+			options.tracer->acked(deliveryTag);
+		}
+
+		--in_flight;
+	}
+
+	void reply(const Delivery &request, const std::string &body)
+	{
+		if(request.reply_to.empty()){
+			return;
+		}
+
+		AMQP::Envelope reply(body.data(), body.size());
+		reply.setCorrelationID(request.correlation_id);
+
+		if(options.tracer){
+			options.tracer->forward(request.headers, reply, "rpc_server");
+		}
+
+		const std::string &content_type = options.content_type.empty() ? request.content_type : options.content_type;
+
+		if( !content_type.empty() ){
+			reply.setContentType(content_type);
+		}
+
+		// Sending response to callback queue using default exchange "" (direct)
+		channel.publish("", request.reply_to, reply);
+		++stats.replies;
+	}
+
+	// Event loop thread: publish completed replies, then ack their requests
+	void flush()
+	{
+		std::vector<Completion> batch;
+
+		{
+			std::lock_guard<std::mutex> lock(completed_mutex);
+			batch.swap(completed);
+		}
+
+		for(auto &c : batch){
+
+			if(c.success){
+				this->reply(*c.request, c.body);
+
+				if(c.cache){
+					c.cache->insert(cache_key(*c.request), c.body);
+				}
+			}
+			else{
+				++stats.failures;
+			}
+
+			this->processed(c.request->delivery_tag, c.success);
+		}
+
+		++stats.batches;
+	}
+};
+
+
+AsyncRpcServer::AsyncRpcServer(MyTcpHandler &handler, AMQP::Channel &channel):
+	AsyncRpcServer(handler, channel, Options())
+{
+
+}
+
+AsyncRpcServer::AsyncRpcServer(MyTcpHandler &handler, AMQP::Channel &channel, const Options &options):
+	pimpl(std::make_shared<Impl>(handler, channel, options))
+{
+
+}
+
+AsyncRpcServer::~AsyncRpcServer() = default;
+
+void AsyncRpcServer::add(const std::string &queue, Handler handler)
+{
+	auto service = std::make_shared<Service>();
+	service->handler = std::move(handler);
+	pimpl->services.push_back(service);
+
+	std::weak_ptr<Impl> weak = pimpl;
+
+	pimpl->channel.declareQueue(queue);
+	pimpl->channel.consume(queue).onReceived(
+		[weak, service](const AMQP::Message &message, uint64_t deliveryTag, bool redelivered)
+		{
+			static const unsigned subsystem = AllocTracker::subsystem("rpc_server");
+			AllocTracker::Scope scope(subsystem);
+			AllocTracker::message(subsystem);
+
+			if(auto self = weak.lock()){
+				self->on_request(service, message, deliveryTag, redelivered);
+			}
+		}
+	);
+}
+
+void AsyncRpcServer::add(const std::string &queue, Handler handler, const ReplyCache::Options &cache)
+{
+	this->add(queue, std::move(handler));
+	pimpl->services.back()->cache = std::make_shared<ReplyCache>(cache);
+}
+
+AsyncRpcServer::Stats AsyncRpcServer::stats() const
+{
+	Stats res = pimpl->stats;
+	res.in_flight = pimpl->in_flight;
+	return res;
+}
+
+ReplyCache::Stats AsyncRpcServer::cache_stats() const
+{
+	ReplyCache::Stats res;
+
+	for(const auto &service : pimpl->services){
+		if( !service->cache ){
+			continue;
+		}
+
+		const auto stats = service->cache->stats();
+		res.hits += stats.hits;
+		res.misses += stats.misses;
+		res.expired += stats.expired;
+		res.evictions += stats.evictions;
+		res.entries += stats.entries;
+		res.bytes += stats.bytes;
+	}
+
+	return res;
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <functional>
+#include <thread>
+
+#include <amqpcpp.h>
+
+#include "delivery.hpp"
+#include "my_handler.hpp"
+#include "reply_cache.hpp"
+#include "latency_tracer.hpp"
+
+/*
+	Concurrent RPC server.
+
+	Handlers are registered per queue and executed on a worker pool, so the 
+	event loop keeps processing I/O while requests are computed. Replies and 
+	acks are published back on the event loop thread in batches: all the 
+	replies completed since the last loop wakeup are published and their 
+	requests acked one by one (not in order, so a slow request doesn't hold 
+	back the acks and prefetch slots of the ones completed after it).
+
+	Channel prefetch is set to max_concurrency (shared by all the queues), so
+	the broker never sends more requests than the server can process at once.
+	Use a dedicated channel.
+
+	Queues with pure handlers (reply depends on the request body only) may 
+	have a reply cache: cached replies are published right away on the event 
+	loop thread, without invoking the handler.
+
+	With Options::tracer request transit is recorded on receive, processing
+	until the ack of the request is sent (after its reply is published on the
+	event loop thread), and replies carry the request trace with the
+	'rpc_server' hop timestamp.
+*/
+
+class AsyncRpcServer
+{
+public:
+
+	// Computes reply body on a worker thread. Exception rejects the request without reply.
+	using Handler = std::function<std::string(const Delivery &request)>;
+
+	struct Options
+	{
+		size_t threads = std::thread::hardware_concurrency();
+		uint16_t max_concurrency = 0;	// requests in flight, 0 - 2 * threads
+		std::string content_type;		// content-type of replies (empty - same as the request)
+		std::shared_ptr<LatencyTracer> tracer;	// records requests, forwards traces to replies (nullptr - off)
+	};
+
+	struct Stats
+	{
+		uint64_t requests = 0;
+		uint64_t replies = 0;
+		uint64_t failures = 0;			// handler exceptions
+		uint64_t cached = 0;			// replies from cache
+		uint64_t batches = 0;			// reply batches published by the event loop
+		size_t in_flight = 0;
+	};
+
+	AsyncRpcServer(MyTcpHandler &handler, AMQP::Channel &channel);
+	AsyncRpcServer(MyTcpHandler &handler, AMQP::Channel &channel, const Options &options);
+
+	// Waits for the requests being processed, their replies are dropped
+	~AsyncRpcServer();
+
+	/**
+	 *  Declare the queue and start serving requests from it
+	 *  @param  queue           Request queue
+	 *  @param  handler         Request handler
+	 */
+	void add(const std::string &queue, Handler handler);
+
+	/**
+	 *  Same as above, with memoization of the handler replies
+	 *  @param  cache           Reply cache options of the queue
+	 */
+	void add(const std::string &queue, Handler handler, const ReplyCache::Options &cache);
+
+	Stats stats() const;
+
+	// Reply cache stats summed over all the queues
+	ReplyCache::Stats cache_stats() const;
+
+private:
+
+	struct Impl;
+	std::shared_ptr<Impl> pimpl;
+};
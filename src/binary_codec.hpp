@@ -0,0 +1,509 @@
+#pragma once
+
+#include <array>
+#include <tuple>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <limits>
+#include <cstring>
+#include <cstdint>
+
+/*
+	Compact binary serialization of plain structs.
+
+	A struct describes its wire layout with a static constexpr schema()
+	listing the fields in order:
+
+		struct Point
+		{
+			int32_t x;
+			int32_t y;
+			std::string name;
+
+			static constexpr auto schema()
+			{
+				return codec::fields(codec::varint(&Point::x), codec::varint(&Point::y), codec::bytes(&Point::name));
+			}
+		};
+
+	Field encodings:
+	* fixed   - integer, floating point, bool or enum as little-endian sizeof(T) bytes
+	* varint  - integer or enum as LEB128, signed ones zigzag encoded (small values take 1 byte)
+	* bytes   - std::string as varint length followed by the data
+
+	There are no tags or field names on the wire: both sides must use the
+	same schema. Layout is resolved at compile time, encoding is a sequence
+	of stores into a buffer sized in advance. Messages without bytes fields
+	are fixed-size (up to max_size<T>() bytes) and may be encoded into a
+	stack buffer with encode_fixed(), without heap allocation.
+
+	Decoding accepts only the canonical encoding: a bool byte other than
+	0 or 1, a varint with redundant trailing zero groups or a value out of
+	the field's range fail the decode.
+*/
+
+namespace codec
+{
+	// Content-type of codec encoded messages
+	constexpr const char *content_type = "application/x-binary-codec";
+
+	template<typename T, typename M>
+	struct Fixed
+	{
+		M T::*member;
+	};
+
+	template<typename T, typename M>
+	struct Varint
+	{
+		M T::*member;
+	};
+
+	template<typename T>
+	struct Bytes
+	{
+		std::string T::*member;
+	};
+
+	template<typename T, typename M>
+	constexpr Fixed<T, M> fixed(M T::*member)
+	{
+		static_assert(std::is_arithmetic<M>::value || std::is_enum<M>::value, "fixed field must be arithmetic or enum");
+		return {member};
+	}
+
+	template<typename T, typename M>
+	constexpr Varint<T, M> varint(M T::*member)
+	{
+		static_assert(std::is_integral<M>::value || std::is_enum<M>::value, "varint field must be integral or enum");
+		return {member};
+	}
+
+	template<typename T>
+	constexpr Bytes<T> bytes(std::string T::*member)
+	{
+		return {member};
+	}
+
+	template<typename... Fields>
+	constexpr std::tuple<Fields...> fields(Fields... f)
+	{
+		return std::tuple<Fields...>(f...);
+	}
+
+
+	namespace detail
+	{
+		template<typename M>
+		using wire_int = typename std::conditional<std::is_enum<M>::value, std::underlying_type<M>, std::common_type<M>>::type::type;
+
+		template<typename M>
+		using wire_uint = typename std::make_unsigned<typename std::conditional<std::is_same<wire_int<M>, bool>::value, uint8_t, wire_int<M>>::type>::type;
+
+		// Bytes of a fixed field, bit pattern as unsigned integer
+		template<typename M>
+		struct FixedBits
+		{
+			using type = typename std::conditional<sizeof(M) == 1, uint8_t,
+				typename std::conditional<sizeof(M) == 2, uint16_t,
+				typename std::conditional<sizeof(M) == 4, uint32_t, uint64_t>::type>::type>::type;
+
+			static_assert(sizeof(type) == sizeof(M), "unsupported fixed field size");
+		};
+
+		constexpr size_t varint_max(size_t bytes)
+		{
+			return (bytes * 8 + 6) / 7;
+		}
+
+		inline size_t varint_size(uint64_t value)
+		{
+			size_t size = 1;
+
+			while(value >= 0x80){
+				value >>= 7;
+				++size;
+			}
+
+			return size;
+		}
+
+		template<typename M>
+		uint64_t zigzag(M value)
+		{
+			using I = wire_int<M>;
+			using U = wire_uint<M>;
+
+			const I v = static_cast<I>(value);
+
+			if constexpr (std::is_signed<I>::value){
+				// (v << 1) ^ (v >> bits-1), computed in unsigned to avoid overflow
+				return static_cast<U>((static_cast<U>(v) << 1) ^ static_cast<U>(v < 0 ? -1 : 0));
+			}
+
+			return static_cast<U>(v);
+		}
+
+		template<typename M>
+		M unzigzag(uint64_t value)
+		{
+			using I = wire_int<M>;
+			using U = wire_uint<M>;
+
+			const U u = static_cast<U>(value);
+
+			if constexpr (std::is_signed<I>::value){
+				return static_cast<M>(static_cast<I>(static_cast<U>((u >> 1) ^ static_cast<U>(0 - (u & 1)))));
+			}
+
+			return static_cast<M>(u);
+		}
+
+		template<typename T, typename M>
+		constexpr size_t max_field(Fixed<T, M>)
+		{
+			return sizeof(M);
+		}
+
+		template<typename T, typename M>
+		constexpr size_t max_field(Varint<T, M>)
+		{
+			return varint_max(sizeof(M));
+		}
+
+		template<typename T>
+		constexpr bool is_bytes(Bytes<T>)
+		{
+			return true;
+		}
+
+		template<typename F>
+		constexpr bool is_bytes(F)
+		{
+			return false;
+		}
+
+		template<typename Tuple, size_t... I>
+		constexpr bool any_bytes(const Tuple &t, std::index_sequence<I...>)
+		{
+			return (false || ... || is_bytes(std::get<I>(t)));
+		}
+
+		template<typename Tuple, size_t... I>
+		constexpr size_t sum_max(const Tuple &t, std::index_sequence<I...>)
+		{
+			return (size_t(0) + ... + max_field(std::get<I>(t)));
+		}
+
+		template<typename T>
+		using Schema = decltype(T::schema());
+	}
+
+
+	// Whether all the fields of T have bounded size
+	template<typename T>
+	constexpr bool is_fixed_size()
+	{
+		return !detail::any_bytes(T::schema(), std::make_index_sequence<std::tuple_size<detail::Schema<T>>::value>());
+	}
+
+	// Upper bound of the encoded size of fixed-size T
+	template<typename T>
+	constexpr size_t max_size()
+	{
+		static_assert(is_fixed_size<T>(), "message has variable-size fields");
+		return detail::sum_max(T::schema(), std::make_index_sequence<std::tuple_size<detail::Schema<T>>::value>());
+	}
+
+
+	// Writes into a buffer large enough for the message, no bounds checks
+	class Writer
+	{
+	public:
+
+		explicit Writer(char *data): _begin(data), _pos(data)
+		{
+
+		}
+
+		template<typename M>
+		void fixed(M value)
+		{
+			using U = typename detail::FixedBits<M>::type;
+
+			U bits;
+			std::memcpy(&bits, &value, sizeof(bits));
+
+			// Compiles to a plain store on little-endian targets
+			for(size_t i = 0; i < sizeof(U); ++i){
+				*_pos++ = static_cast<char>(static_cast<uint8_t>(bits >> (8 * i)));
+			}
+		}
+
+		void varint(uint64_t value)
+		{
+			while(value >= 0x80){
+				*_pos++ = static_cast<char>(static_cast<uint8_t>(value) | 0x80);
+				value >>= 7;
+			}
+
+			*_pos++ = static_cast<char>(value);
+		}
+
+		void bytes(std::string_view data)
+		{
+			this->varint(data.size());
+			std::memcpy(_pos, data.data(), data.size());
+			_pos += data.size();
+		}
+
+		size_t size() const
+		{
+			return _pos - _begin;
+		}
+
+	private:
+		char *_begin;
+		char *_pos;
+	};
+
+
+	// Reads from untrusted data, every read is bounds checked
+	class Reader
+	{
+	public:
+
+		explicit Reader(std::string_view data): _pos(data.data()), _end(data.data() + data.size())
+		{
+
+		}
+
+		template<typename M>
+		bool fixed(M &value)
+		{
+			using U = typename detail::FixedBits<M>::type;
+
+			if(static_cast<size_t>(_end - _pos) < sizeof(U)){
+				return _ok = false;
+			}
+
+			U bits = 0;
+
+			for(size_t i = 0; i < sizeof(U); ++i){
+				bits |= static_cast<U>(static_cast<uint8_t>(*_pos++)) << (8 * i);
+			}
+
+			if constexpr (std::is_same<M, bool>::value){
+				// Any other byte than 0 or 1 is not a valid bool representation
+				if(bits > 1){
+					return _ok = false;
+				}
+
+				value = bits != 0;
+			}
+			else{
+				std::memcpy(&value, &bits, sizeof(bits));
+			}
+
+			return true;
+		}
+
+		// Value above max_value (the field range) fails as well
+		bool varint(uint64_t &value, size_t max_bytes, uint64_t max_value = UINT64_MAX)
+		{
+			value = 0;
+
+			for(size_t i = 0; i < max_bytes && _pos != _end; ++i){
+				const uint8_t byte = static_cast<uint8_t>(*_pos++);
+				const uint64_t bits = byte & 0x7f;
+
+				// Bits beyond 64 are lost
+				if(((bits << (7 * i)) >> (7 * i)) != bits){
+					break;
+				}
+
+				value |= bits << (7 * i);
+
+				if( !(byte & 0x80) ){
+					// Zero last group (but the only one) - overlong encoding
+					if((byte == 0 && i > 0) || value > max_value){
+						return _ok = false;
+					}
+
+					return true;
+				}
+			}
+
+			// Truncated, too long or overflowing
+			return _ok = false;
+		}
+
+		bool bytes(std::string &data)
+		{
+			uint64_t size = 0;
+
+			if( !this->varint(size, detail::varint_max(sizeof(size))) ){
+				return false;
+			}
+
+			if(size > static_cast<size_t>(_end - _pos)){
+				return _ok = false;
+			}
+
+			data.assign(_pos, size);
+			_pos += size;
+			return true;
+		}
+
+		bool ok() const
+		{
+			return _ok;
+		}
+
+		bool done() const
+		{
+			return _ok && _pos == _end;
+		}
+
+	private:
+		const char *_pos;
+		const char *_end;
+		bool _ok = true;
+	};
+
+
+	namespace detail
+	{
+		template<typename T, typename M>
+		size_t field_size(const T &, Fixed<T, M>)
+		{
+			return sizeof(M);
+		}
+
+		template<typename T, typename M>
+		size_t field_size(const T &msg, Varint<T, M> f)
+		{
+			return varint_size(zigzag(msg.*(f.member)));
+		}
+
+		template<typename T>
+		size_t field_size(const T &msg, Bytes<T> f)
+		{
+			const size_t size = (msg.*(f.member)).size();
+			return varint_size(size) + size;
+		}
+
+		template<typename T, typename M>
+		void write_field(Writer &w, const T &msg, Fixed<T, M> f)
+		{
+			w.fixed(msg.*(f.member));
+		}
+
+		template<typename T, typename M>
+		void write_field(Writer &w, const T &msg, Varint<T, M> f)
+		{
+			w.varint(zigzag(msg.*(f.member)));
+		}
+
+		template<typename T>
+		void write_field(Writer &w, const T &msg, Bytes<T> f)
+		{
+			w.bytes(msg.*(f.member));
+		}
+
+		template<typename T, typename M>
+		bool read_field(Reader &r, T &msg, Fixed<T, M> f)
+		{
+			return r.fixed(msg.*(f.member));
+		}
+
+		template<typename T, typename M>
+		bool read_field(Reader &r, T &msg, Varint<T, M> f)
+		{
+			uint64_t value = 0;
+
+			// Wider than the field (a bool is 0 or 1)
+			const uint64_t max = std::is_same<wire_int<M>, bool>::value ? 1 : std::numeric_limits<wire_uint<M>>::max();
+
+			if( !r.varint(value, varint_max(sizeof(M)), max) ){
+				return false;
+			}
+
+			msg.*(f.member) = unzigzag<M>(value);
+			return true;
+		}
+
+		template<typename T>
+		bool read_field(Reader &r, T &msg, Bytes<T> f)
+		{
+			return r.bytes(msg.*(f.member));
+		}
+	}
+
+
+	// Exact encoded size of the message
+	template<typename T>
+	size_t size(const T &msg)
+	{
+		return std::apply([&msg](auto... f){ return (size_t(0) + ... + detail::field_size(msg, f)); }, T::schema());
+	}
+
+	// Encode into the buffer of at least size(msg) bytes, returns the encoded size
+	template<typename T>
+	size_t encode(const T &msg, char *data)
+	{
+		Writer writer(data);
+		std::apply([&](auto... f){ (detail::write_field(writer, msg, f), ...); }, T::schema());
+		return writer.size();
+	}
+
+	// Encoded fixed-size message on the stack
+	template<typename T>
+	struct FixedBuffer
+	{
+		std::array<char, max_size<T>()> data;
+		size_t size = 0;
+
+		std::string_view view() const
+		{
+			return std::string_view(data.data(), size);
+		}
+	};
+
+	template<typename T>
+	FixedBuffer<T> encode_fixed(const T &msg)
+	{
+		FixedBuffer<T> res;
+		res.size = codec::encode(msg, res.data.data());
+		return res;
+	}
+
+	template<typename T>
+	std::string encode(const T &msg)
+	{
+		if constexpr (is_fixed_size<T>()){
+			// Single pass, short messages fit std::string small buffer
+			return std::string(codec::encode_fixed(msg).view());
+		}
+		else{
+			std::string res(codec::size(msg), '\0');
+			codec::encode(msg, &res[0]);
+			return res;
+		}
+	}
+
+	/**
+	 *  Decode the message. Fields are assigned as they are read, so msg is
+	 *  partially updated on failure.
+	 *  @return                 false if data is truncated, malformed or has trailing bytes
+	 */
+	template<typename T>
+	bool decode(std::string_view data, T &msg)
+	{
+		Reader reader(data);
+		std::apply([&](auto... f){ (void)(detail::read_field(reader, msg, f) && ...); }, T::schema());
+		return reader.done();
+	}
+}
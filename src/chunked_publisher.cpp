@@ -0,0 +1,226 @@
+#include <deque>
+#include <vector>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+
+extern "C"{
+#include <sys/stat.h>
+#include <unistd.h>
+}
+
+#include "logger.hpp"
+#include "chunked_publisher.hpp"
+
+
+namespace
+{
+	struct Stream
+	{
+		int fd;
+		std::string exchange;
+		std::string routingkey;
+		std::string id;
+		ChunkedPublisher::DoneCallback done;
+
+		uint64_t size = 0;
+		uint64_t offset = 0;
+		uint64_t seq = 0;
+		bool all_published = false;
+	};
+}
+
+
+struct ChunkedPublisher::Impl
+{
+	AMQP::Channel &channel;
+	Options options;
+
+	std::vector<char> buffer;
+	std::deque<Stream> streams;
+
+	bool ready = false;			// confirm mode is enabled
+	bool failed = false;		// current stream was nacked
+
+	// Publisher confirms: sequence numbers start from 1
+	uint64_t published = 0;
+	std::deque<uint64_t> unconfirmed;
+
+	Impl(AMQP::Channel &c, const Options &o): channel(c), options(o), buffer(o.chunk_size ? o.chunk_size : 1)
+	{
+		channel.confirmSelect()
+			.onSuccess([this]()
+			{
+				ready = true;
+				this->pump();
+			})
+			.onAck([this](uint64_t deliveryTag, bool multiple)
+			{
+				this->confirmed(deliveryTag, multiple, true);
+			})
+			.onNack([this](uint64_t deliveryTag, bool multiple, bool requeue)
+			{
+				this->confirmed(deliveryTag, multiple, false);
+			});
+	}
+
+	void confirmed(uint64_t deliveryTag, bool multiple, bool ack)
+	{
+		if( !ack ){
+			failed = true;
+		}
+
+		if(multiple){
+			while( !unconfirmed.empty() && unconfirmed.front() <= deliveryTag ){
+				unconfirmed.pop_front();
+			}
+		}
+		else{
+			for(auto it = unconfirmed.begin(); it != unconfirmed.end(); ++it){
+				if(*it == deliveryTag){
+					unconfirmed.erase(it);
+					break;
+				}
+			}
+		}
+
+		this->pump();
+	}
+
+	void finish(bool success)
+	{
+		Stream stream = std::move(streams.front());
+		streams.pop_front();
+		failed = false;
+
+		logger.msg(MSG_DEBUG, "ChunkedPublisher: stream '%s' %s (%lu bytes, %lu chunks)\n", 
+			stream.id, success ? "published" : "failed", stream.offset, stream.seq);
+
+		if(stream.done){
+			stream.done(success);
+		}
+	}
+
+	// Read and publish the next chunk of the current stream
+	bool publish_chunk(Stream &stream)
+	{
+		const size_t want = std::min<uint64_t>(buffer.size(), stream.size - stream.offset);
+		size_t got = 0;
+
+		while(got < want){
+			ssize_t res = pread(stream.fd, buffer.data() + got, want - got, stream.offset + got);
+
+			if(res < 0 && errno == EINTR){
+				continue;
+			}
+
+			if(res <= 0){
+				logger.msg(MSG_ERROR, "ChunkedPublisher: read of '%s' failed: %s\n", stream.id, res ? strerror(errno) : "unexpected EOF");
+				return false;
+			}
+
+			got += res;
+		}
+
+		const bool last = stream.offset + got >= stream.size;
+
+		AMQP::Table headers;
+		headers.set("x-stream-id", AMQP::LongString(stream.id));
+		headers.set("x-stream-seq", AMQP::ULongLong(stream.seq));
+		headers.set("x-stream-last", AMQP::ULongLong(last ? 1 : 0));
+
+		AMQP::Envelope env(buffer.data(), got);
+		env.setHeaders(headers);
+
+		if(options.persistent){
+			env.setDeliveryMode(2);
+		}
+
+		if( !channel.publish(stream.exchange, stream.routingkey, env) ){
+			logger.msg(MSG_ERROR, "ChunkedPublisher: publish of '%s' failed\n", stream.id);
+			return false;
+		}
+
+		unconfirmed.push_back(++published);
+		stream.offset += got;
+		++stream.seq;
+		stream.all_published = last;
+		return true;
+	}
+
+	void pump()
+	{
+		while(ready && !streams.empty()){
+			Stream &stream = streams.front();
+
+			if(failed){
+				// Wait for outstanding confirms of the failed stream
+				if(unconfirmed.empty()){
+					this->finish(false);
+					continue;
+				}
+				return;
+			}
+
+			if(stream.all_published){
+				if(unconfirmed.empty()){
+					this->finish(true);
+					continue;
+				}
+				return;
+			}
+
+			if(unconfirmed.size() >= options.window){
+				return;
+			}
+
+			if( !this->publish_chunk(stream) ){
+				failed = true;
+			}
+		}
+	}
+};
+
+
+ChunkedPublisher::ChunkedPublisher(AMQP::Channel &channel): ChunkedPublisher(channel, Options())
+{
+
+}
+
+ChunkedPublisher::ChunkedPublisher(AMQP::Channel &channel, const Options &options):
+	pimpl(new ChunkedPublisher::Impl(channel, options))
+{
+
+}
+
+ChunkedPublisher::~ChunkedPublisher() = default;
+
+void ChunkedPublisher::publish(int fd, const std::string &exchange, const std::string &routingkey, const std::string &stream_id, DoneCallback done)
+{
+	Stream stream;
+	stream.fd = fd;
+	stream.exchange = exchange;
+	stream.routingkey = routingkey;
+	stream.id = stream_id;
+	stream.done = std::move(done);
+
+	struct stat st;
+
+	if(fstat(fd, &st) < 0){
+		logger.msg(MSG_ERROR, "ChunkedPublisher: fstat of '%s' failed: %s\n", stream_id, strerror(errno));
+
+		if(stream.done){
+			stream.done(false);
+		}
+		return;
+	}
+
+	stream.size = st.st_size;
+	pimpl->streams.push_back(std::move(stream));
+	pimpl->pump();
+}
+
+size_t ChunkedPublisher::pending() const
+{
+	return pimpl->streams.size();
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <functional>
+
+#include <amqpcpp.h>
+
+/*
+	Chunked publisher of large payloads.
+
+	AMQP-CPP needs the whole message body in memory to publish it, and the 
+	output buffer of the connection may hold all of it if the socket is slower
+	than the producer. ChunkedPublisher reads a file descriptor chunk by chunk 
+	with pread() into one reusable buffer and publishes every chunk as a 
+	separate message with stream headers:
+
+	* x-stream-id   - stream name (file name for FileSink)
+	* x-stream-seq  - chunk number, starting from 0
+	* x-stream-last - 1 for the last chunk
+
+	The channel is put into confirm mode and at most 'window' chunks are 
+	unconfirmed at a time, so peak memory is bounded by window * chunk_size.
+	Use a dedicated channel, confirms of other publishers would break the window.
+
+	Chunks of a stream have to be consumed in order (one queue, one consumer), 
+	see StreamConsumer and FileSink.
+*/
+
+class ChunkedPublisher
+{
+public:
+
+	struct Options
+	{
+		size_t chunk_size = 128 * 1024;
+		size_t window = 4;			// unconfirmed chunks
+		bool persistent = true;		// delivery mode 2
+	};
+
+	// Called when all the chunks are confirmed (true) or broker nacked one of them (false)
+	using DoneCallback = std::function<void(bool success)>;
+
+	explicit ChunkedPublisher(AMQP::Channel &channel);
+	ChunkedPublisher(AMQP::Channel &channel, const Options &options);
+	~ChunkedPublisher();
+
+	/**
+	 *  Queue the stream for publishing. Streams are published one after another.
+	 *  @param  fd              File descriptor to read from (not closed by publisher)
+	 *  @param  exchange        Exchange to publish to
+	 *  @param  routingkey      Routing key of the chunks
+	 *  @param  stream_id       Name of the stream
+	 *  @param  done            Completion callback
+	 */
+	void publish(int fd, const std::string &exchange, const std::string &routingkey, const std::string &stream_id, DoneCallback done = nullptr);
+
+	// Number of streams not yet completed
+	size_t pending() const;
+
+private:
+
+	struct Impl;
+	std::unique_ptr<Impl> pimpl;
+};
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <string>
+#include <functional>
+#include <stdexcept>
+
+#include "binary_codec.hpp"
+#include "delivery.hpp"
+#include "async_rpc_client.hpp"
+#include "async_rpc_server.hpp"
+
+/*
+	Codec encoded RPC: typed requests and replies on top of AsyncRpcClient 
+	and AsyncRpcServer. Requests and replies have codec::content_type set, 
+	so a server may serve text and binary clients on the same queue.
+
+	Client:
+		codec::call<FibReply>(client, "rpc_queue", FibRequest{30}, [](const AsyncRpcClient::Reply &reply, const FibReply *fib){ ... });
+
+	Server:
+		server.add("rpc_queue", codec::handler<FibRequest>([](const FibRequest &request){ return FibReply{...}; }));
+*/
+
+namespace codec
+{
+	// Response is nullptr if the call failed or the reply can't be decoded (reply.status is ERROR then)
+	template<typename Response>
+	using Callback = std::function<void(const AsyncRpcClient::Reply &reply, const Response *response)>;
+
+	template<typename Response, typename Request>
+	uint64_t call(AsyncRpcClient &client, const std::string &routingkey, const Request &request, AsyncRpcClient::CallOptions options, Callback<Response> callback)
+	{
+		options.content_type = content_type;
+
+		return client.call(routingkey, codec::encode(request), options, [callback = std::move(callback)](const AsyncRpcClient::Reply &reply)
+		{
+			if(reply.status != AsyncRpcClient::Status::OK){
+				callback(reply, nullptr);
+				return;
+			}
+
+			Response response;
+
+			if(reply.content_type != content_type || !codec::decode(reply.body, response)){
+				AsyncRpcClient::Reply error;
+				error.status = AsyncRpcClient::Status::ERROR;
+				error.content_type = reply.content_type;
+				error.error = "malformed reply";
+				callback(error, nullptr);
+				return;
+			}
+
+			callback(reply, &response);
+		});
+	}
+
+	template<typename Response, typename Request>
+	uint64_t call(AsyncRpcClient &client, const std::string &routingkey, const Request &request, Callback<Response> callback)
+	{
+		return codec::call<Response>(client, routingkey, request, AsyncRpcClient::CallOptions(), std::move(callback));
+	}
+
+	/**
+	 *  Decode the request, call the handler and encode its response. 
+	 *  For handlers serving several encodings of the request.
+	 *  @throws std::invalid_argument   If the request can't be decoded
+	 */
+	template<typename Request, typename F>
+	std::string serve(const Delivery &delivery, F &&handler)
+	{
+		Request request;
+
+		if(delivery.content_type != content_type || !codec::decode(delivery.body, request)){
+			throw std::invalid_argument("malformed request");
+		}
+
+		return codec::encode(handler(static_cast<const Request &>(request)));
+	}
+
+	// Server handler of codec encoded requests, malformed ones are rejected
+	template<typename Request, typename F>
+	AsyncRpcServer::Handler handler(F handler)
+	{
+		return [handler = std::move(handler)](const Delivery &delivery)
+		{
+			return codec::serve<Request>(delivery, handler);
+		};
+	}
+}
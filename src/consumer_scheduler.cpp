@@ -0,0 +1,217 @@
+#include <deque>
+#include <algorithm>
+
+#include "logger.hpp"
+#include "consumer_scheduler.hpp"
+
+
+namespace
+{
+	struct ScheduledQueue
+	{
+		std::string name;
+		ConsumerScheduler::Handler handler;
+		ConsumerScheduler::QueueOptions options;
+
+		std::deque<Delivery> buffer;
+		size_t deficit = 0;		// WEIGHTED_FAIR: messages allowed in the current round
+
+		ConsumerScheduler::QueueStats stats;
+	};
+}
+
+
+struct ConsumerScheduler::Impl : public std::enable_shared_from_this<ConsumerScheduler::Impl>
+{
+	MyTcpHandler &handler;
+	AMQP::Channel *channel;
+	Policy policy;
+	size_t drain_batch;
+
+	std::vector<std::unique_ptr<ScheduledQueue>> queues;
+	size_t buffered = 0;
+	size_t round_robin = 0;		// WEIGHTED_FAIR: current queue
+	bool drain_posted = false;
+
+	Impl(MyTcpHandler &h, AMQP::Channel &c, Policy p, size_t batch):
+		handler(h), channel(&c), policy(p), drain_batch(std::max<size_t>(batch, 1))
+	{
+
+	}
+
+	AMQP::DeferredConsumer& consume(ScheduledQueue *q)
+	{
+		// Per-consumer prefetch: qos applies to consumers started after it
+		channel->setQos(q->options.prefetch, false);
+
+		std::weak_ptr<Impl> weak = this->shared_from_this();
+
+		return channel->consume(q->name).onReceived(
+			[weak, q](const AMQP::Message &message, uint64_t deliveryTag, bool redelivered)
+			{
+				if(auto self = weak.lock()){
+					self->buffer(q, message, deliveryTag, redelivered);
+				}
+			}
+		);
+	}
+
+	void buffer(ScheduledQueue *q, const AMQP::Message &message, uint64_t deliveryTag, bool redelivered)
+	{
+		q->buffer.emplace_back(message, deliveryTag, redelivered);
+		++q->stats.received;
+		q->stats.max_buffered = std::max(q->stats.max_buffered, q->buffer.size());
+		++buffered;
+
+		this->post_drain();
+	}
+
+	// Drain after all the frames of current I/O batch are processed
+	void post_drain()
+	{
+		if(drain_posted){
+			return;
+		}
+
+		drain_posted = true;
+		std::weak_ptr<Impl> weak = this->shared_from_this();
+
+		handler.post([weak]{
+			if(auto self = weak.lock()){
+				self->drain_posted = false;
+				self->drain();
+			}
+		});
+	}
+
+	ScheduledQueue* next_priority()
+	{
+		ScheduledQueue *res = nullptr;
+
+		for(auto &q : queues){
+			if( !q->buffer.empty() && (!res || q->options.priority > res->options.priority) ){
+				res = q.get();
+			}
+		}
+
+		return res;
+	}
+
+	ScheduledQueue* next_fair()
+	{
+		// Deficit round robin: stay on the queue while it has deficit and messages
+		for(size_t i = 0; i <= queues.size(); ++i){
+			ScheduledQueue *q = queues[round_robin].get();
+
+			if( !q->buffer.empty() ){
+				if( !q->deficit ){
+					q->deficit = std::max(q->options.weight, 1u);
+				}
+
+				--q->deficit;
+				return q;
+			}
+
+			// Empty queue doesn't accumulate credit
+			q->deficit = 0;
+			round_robin = (round_robin + 1) % queues.size();
+		}
+
+		return nullptr;
+	}
+
+	void drain()
+	{
+		for(size_t n = 0; n < drain_batch && buffered; ++n){
+			ScheduledQueue *q = policy == Policy::STRICT_PRIORITY ? this->next_priority() : this->next_fair();
+
+			if( !q ){
+				break;
+			}
+
+			Delivery delivery = std::move(q->buffer.front());
+			q->buffer.pop_front();
+			--buffered;
+
+			// Round of the queue is over
+			if(policy == Policy::WEIGHTED_FAIR && !q->deficit){
+				round_robin = (round_robin + 1) % queues.size();
+			}
+
+			bool success = false;
+
+			try{
+				success = q->handler(delivery);
+			}
+			catch(const std::exception &e){
+				logger.msg(MSG_ERROR, "ConsumerScheduler: '%s' handler exception: %s\n", q->name, e.what());
+			}
+
+			if(success){
+				channel->ack(delivery.delivery_tag);
+				++q->stats.processed;
+			}
+			else{
+				channel->reject(delivery.delivery_tag, q->options.requeue_failed ? AMQP::requeue : 0);
+				++q->stats.rejected;
+			}
+		}
+
+		// Let the loop read new deliveries (maybe of higher priority) before continuing
+		if(buffered){
+			this->post_drain();
+		}
+	}
+};
+
+
+ConsumerScheduler::ConsumerScheduler(MyTcpHandler &handler, AMQP::Channel &channel, Policy policy, size_t drain_batch):
+	pimpl(std::make_shared<Impl>(handler, channel, policy, drain_batch))
+{
+
+}
+
+ConsumerScheduler::~ConsumerScheduler() = default;
+
+AMQP::DeferredConsumer& ConsumerScheduler::add(const std::string &queue, Handler handler)
+{
+	return this->add(queue, std::move(handler), QueueOptions());
+}
+
+AMQP::DeferredConsumer& ConsumerScheduler::add(const std::string &queue, Handler handler, const QueueOptions &options)
+{
+	auto q = std::make_unique<ScheduledQueue>();
+	q->name = queue;
+	q->handler = std::move(handler);
+	q->options = options;
+	q->stats.queue = queue;
+
+	pimpl->queues.push_back(std::move(q));
+	return pimpl->consume(pimpl->queues.back().get());
+}
+
+void ConsumerScheduler::reset(AMQP::Channel &channel)
+{
+	pimpl->channel = &channel;
+	pimpl->buffered = 0;
+
+	for(auto &q : pimpl->queues){
+		// Delivery tags of the old channel are invalid, messages will be redelivered
+		q->buffer.clear();
+		q->deficit = 0;
+		pimpl->consume(q.get());
+	}
+}
+
+std::vector<ConsumerScheduler::QueueStats> ConsumerScheduler::stats() const
+{
+	std::vector<QueueStats> res;
+	res.reserve(pimpl->queues.size());
+
+	for(const auto &q : pimpl->queues){
+		res.push_back(q->stats);
+		res.back().buffered = q->buffer.size();
+	}
+
+	return res;
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+
+#include <amqpcpp.h>
+
+#include "delivery.hpp"
+#include "my_handler.hpp"
+
+/*
+	Multi-queue consumer scheduler.
+
+	Callbacks of consumers normally run in the order of message arrival, so 
+	a flood on one queue delays messages of all the others. The scheduler 
+	buffers deliveries per queue and drains the buffers after the I/O batch
+	is processed, choosing queues with the configured policy:
+
+	* WEIGHTED_FAIR   - deficit round robin, queue gets 'weight' messages per round
+	* STRICT_PRIORITY - queue with highest 'priority' is always drained first
+
+	Every queue has its own prefetch budget (per-consumer basic.qos), which also
+	bounds its buffer. Handlers run on the event loop thread, message is acked 
+	when the handler returns true and rejected otherwise.
+
+	Usage:
+
+		ConsumerScheduler scheduler(myHandler, channel, ConsumerScheduler::Policy::STRICT_PRIORITY);
+
+		ConsumerScheduler::QueueOptions alerts;
+		alerts.priority = 10;
+		alerts.prefetch = 5;
+		scheduler.add("alerts", on_alert, alerts);
+
+		ConsumerScheduler::QueueOptions bulk;
+		bulk.prefetch = 100;
+		scheduler.add("bulk", on_bulk, bulk);
+*/
+
+class ConsumerScheduler
+{
+public:
+
+	enum class Policy
+	{
+		WEIGHTED_FAIR,
+		STRICT_PRIORITY
+	};
+
+	// Returning false rejects the message
+	using Handler = std::function<bool(const Delivery &delivery)>;
+
+	struct QueueOptions
+	{
+		unsigned weight = 1;		// WEIGHTED_FAIR: messages per round
+		int priority = 0;			// STRICT_PRIORITY: higher is drained first
+		uint16_t prefetch = 16;		// unacked messages budget of the queue consumer
+		bool requeue_failed = false;
+	};
+
+	struct QueueStats
+	{
+		std::string queue;
+		size_t buffered = 0;
+		size_t max_buffered = 0;
+		uint64_t received = 0;
+		uint64_t processed = 0;
+		uint64_t rejected = 0;
+	};
+
+	/**
+	 *  @param  handler         Event loop of the channel connection
+	 *  @param  channel         Channel to consume from
+	 *  @param  policy          Queues selection policy
+	 *  @param  drain_batch     Max messages handled before letting the loop process I/O
+	 */
+	ConsumerScheduler(MyTcpHandler &handler, AMQP::Channel &channel, Policy policy = Policy::WEIGHTED_FAIR, size_t drain_batch = 64);
+	~ConsumerScheduler();
+
+	/**
+	 *  Start consuming a queue
+	 *  @return                 Deferred consumer to install other callbacks (onSuccess, onError)
+	 */
+	AMQP::DeferredConsumer& add(const std::string &queue, Handler handler);
+	AMQP::DeferredConsumer& add(const std::string &queue, Handler handler, const QueueOptions &options);
+
+	// Drop buffered deliveries and consume registered queues on a new channel (after reconnection)
+	void reset(AMQP::Channel &channel);
+
+	std::vector<QueueStats> stats() const;
+
+private:
+
+	struct Impl;
+	std::shared_ptr<Impl> pimpl;
+};
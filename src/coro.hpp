@@ -0,0 +1,836 @@
+#pragma once
+
+#if !defined(__cpp_impl_coroutine) || !__has_include(<coroutine>)
+#error "coro.hpp requires C++20 coroutines, configure with -DENABLE_COROUTINES=ON"
+#endif
+
+#include <coroutine>
+#include <exception>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <memory>
+#include <vector>
+#include <deque>
+#include <array>
+#include <chrono>
+#include <new>
+#include <cstddef>
+#include <cstdint>
+
+#include <amqpcpp.h>
+
+#include "logger.hpp"
+#include "my_handler.hpp"
+#include "async_rpc_client.hpp"
+#include "binary_codec.hpp"
+
+/*
+	C++20 coroutines on the MyTcpHandler event loop.
+
+	Instead of nesting callbacks, channel operations and RPC calls are awaited:
+
+		coro::Task<void> receive(AMQP::Channel &channel)
+		{
+			co_await coro::declare_exchange(channel, "topic_logs", AMQP::topic);
+			auto queue = co_await coro::declare_queue(channel, "", AMQP::exclusive);
+			co_await coro::bind_queue(channel, "topic_logs", queue.name, "kern.*");
+			...
+		}
+
+		coro::spawn(receive(channel));
+		handler.loop(&connection);
+
+	Everything runs on the event loop thread: a coroutine is resumed straight
+	from the AMQP-CPP callback (or timer) that completes the awaited operation.
+	Channel operations are sent when the awaitable is created, the result is
+	taken by co_await. Channel errors are thrown as coro::Error.
+
+	Task<T> is lazy: it starts when awaited (or spawned), the awaiting
+	coroutine is resumed by symmetric transfer when it completes. spawn()
+	runs a task detached, its frame is freed when it finishes.
+
+	Coroutine frames are allocated from per-thread free lists (FramePool), so
+	after warm-up flows don't touch the heap per step. Frames of a running
+	task must stay alive while it waits for a channel operation: don't
+	destroy a Task which is suspended (spawned tasks manage themselves).
+*/
+
+namespace coro
+{
+	class Error : public std::runtime_error
+	{
+	public:
+		using std::runtime_error::runtime_error;
+	};
+
+
+	// Size-class free lists of coroutine frames, one set per thread
+	class FramePool
+	{
+	public:
+
+		static void *allocate(size_t size)
+		{
+			const size_t cls = size_class(size);
+
+			if(cls >= classes){
+				return ::operator new(size);
+			}
+
+			Node *&head = lists().heads[cls];
+
+			if(head){
+				Node *node = head;
+				head = node->next;
+				return node;
+			}
+
+			return ::operator new((cls + 1) * granularity);
+		}
+
+		static void deallocate(void *ptr, size_t size)
+		{
+			const size_t cls = size_class(size);
+
+			if(cls >= classes){
+				::operator delete(ptr);
+				return;
+			}
+
+			Node *&head = lists().heads[cls];
+			Node *node = static_cast<Node *>(ptr);
+			node->next = head;
+			head = node;
+		}
+
+	private:
+
+		static constexpr size_t granularity = 64;
+		static constexpr size_t classes = 32;		// frames up to 2 KB are pooled
+
+		struct Node
+		{
+			Node *next;
+		};
+
+		struct Lists
+		{
+			std::array<Node *, classes> heads{};
+
+			~Lists()
+			{
+				for(Node *head : heads){
+					while(head){
+						Node *next = head->next;
+						::operator delete(head);
+						head = next;
+					}
+				}
+			}
+		};
+
+		static size_t size_class(size_t size)
+		{
+			return (size + granularity - 1) / granularity - 1;
+		}
+
+		static Lists &lists()
+		{
+			thread_local Lists lists;
+			return lists;
+		}
+	};
+
+
+	template<typename T = void>
+	class Task;
+
+	namespace detail
+	{
+		struct PromiseBase
+		{
+			std::coroutine_handle<> continuation;
+			std::exception_ptr exception;
+
+			static void *operator new(size_t size)
+			{
+				return FramePool::allocate(size);
+			}
+
+			static void operator delete(void *ptr, size_t size)
+			{
+				FramePool::deallocate(ptr, size);
+			}
+
+			struct FinalAwaiter
+			{
+				bool await_ready() noexcept
+				{
+					return false;
+				}
+
+				template<typename Promise>
+				std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+				{
+					auto continuation = handle.promise().continuation;
+					return continuation ? continuation : std::noop_coroutine();
+				}
+
+				void await_resume() noexcept
+				{
+
+				}
+			};
+
+			std::suspend_always initial_suspend() noexcept
+			{
+				return {};
+			}
+
+			FinalAwaiter final_suspend() noexcept
+			{
+				return {};
+			}
+
+			void unhandled_exception() noexcept
+			{
+				exception = std::current_exception();
+			}
+		};
+
+		template<typename T>
+		struct Promise : PromiseBase
+		{
+			T value;
+
+			Task<T> get_return_object() noexcept;
+
+			template<typename U>
+			void return_value(U &&v)
+			{
+				value = std::forward<U>(v);
+			}
+		};
+
+		template<>
+		struct Promise<void> : PromiseBase
+		{
+			Task<void> get_return_object() noexcept;
+
+			void return_void() noexcept
+			{
+
+			}
+		};
+	}
+
+
+	template<typename T>
+	class [[nodiscard]] Task
+	{
+	public:
+
+		using promise_type = detail::Promise<T>;
+		using handle_type = std::coroutine_handle<promise_type>;
+
+		explicit Task(handle_type handle): _handle(handle)
+		{
+
+		}
+
+		Task(Task &&other) noexcept: _handle(std::exchange(other._handle, nullptr))
+		{
+
+		}
+
+		Task &operator=(Task &&other) noexcept
+		{
+			if(this != &other){
+				if(_handle) _handle.destroy();
+				_handle = std::exchange(other._handle, nullptr);
+			}
+
+			return *this;
+		}
+
+		Task(const Task &) = delete;
+		Task &operator=(const Task &) = delete;
+
+		~Task()
+		{
+			if(_handle){
+				_handle.destroy();
+			}
+		}
+
+		bool await_ready() const noexcept
+		{
+			return !_handle || _handle.done();
+		}
+
+		// Start the task, the awaiting coroutine is its continuation
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+		{
+			_handle.promise().continuation = awaiting;
+			return _handle;
+		}
+
+		T await_resume()
+		{
+			if(_handle.promise().exception){
+				std::rethrow_exception(_handle.promise().exception);
+			}
+
+			if constexpr ( !std::is_void<T>::value ){
+				return std::move(_handle.promise().value);
+			}
+		}
+
+	private:
+		handle_type _handle;
+	};
+
+	namespace detail
+	{
+		template<typename T>
+		Task<T> Promise<T>::get_return_object() noexcept
+		{
+			return Task<T>(std::coroutine_handle<Promise<T>>::from_promise(*this));
+		}
+
+		inline Task<void> Promise<void>::get_return_object() noexcept
+		{
+			return Task<void>(std::coroutine_handle<Promise<void>>::from_promise(*this));
+		}
+
+		// Eagerly started coroutine which frees itself when finished
+		struct Detached
+		{
+			struct promise_type
+			{
+				static void *operator new(size_t size)
+				{
+					return FramePool::allocate(size);
+				}
+
+				static void operator delete(void *ptr, size_t size)
+				{
+					FramePool::deallocate(ptr, size);
+				}
+
+				Detached get_return_object() noexcept
+				{
+					return {};
+				}
+
+				std::suspend_never initial_suspend() noexcept
+				{
+					return {};
+				}
+
+				std::suspend_never final_suspend() noexcept
+				{
+					return {};
+				}
+
+				void return_void() noexcept
+				{
+
+				}
+
+				void unhandled_exception() noexcept
+				{
+
+				}
+			};
+		};
+	}
+
+	/**
+	 *  Run the task detached: it starts right away and runs until its first
+	 *  suspension, then continues from the event loop. Exceptions escaping
+	 *  the task are logged.
+	 */
+	inline detail::Detached spawn(Task<void> task)
+	{
+		try{
+			co_await task;
+		}
+		catch(const std::exception &e){
+			logger.msg(MSG_ERROR, "coro::spawn: unhandled exception: %s\n", e.what());
+		}
+		catch(...){
+			logger.msg(MSG_ERROR, "coro::spawn: unhandled exception of unknown type\n");
+		}
+	}
+
+
+	namespace detail
+	{
+		/*
+			Resumes the awaiting coroutine when the operation completes.
+			AMQP-CPP calls the callbacks of an already failed deferred (e.g. on
+			a closed channel) right when they are set, then the coroutine is
+			not suspended at all.
+		*/
+		class Completion
+		{
+		public:
+
+			Completion() = default;
+
+			// Callbacks refer to the awaiter, it must not move
+			Completion(const Completion &) = delete;
+			Completion &operator=(const Completion &) = delete;
+
+			bool await_ready() const noexcept
+			{
+				return false;
+			}
+
+		protected:
+
+			bool suspend(std::coroutine_handle<> handle) noexcept
+			{
+				_handle = handle;
+
+				if(_done){
+					return false;
+				}
+
+				_suspended = true;
+				return true;
+			}
+
+			void done()
+			{
+				_done = true;
+
+				if(_suspended){
+					_suspended = false;
+					_handle.resume();
+				}
+			}
+
+			// Awaiting coroutine is being destroyed, completion must not resume it
+			void abandon() noexcept
+			{
+				_suspended = false;
+			}
+
+			void fail(const char *message)
+			{
+				_error = message ? message : "unknown error";
+				_failed = true;
+				this->done();
+			}
+
+			void check() const
+			{
+				if(_failed){
+					throw Error(_error);
+				}
+			}
+
+		private:
+			std::coroutine_handle<> _handle;
+			bool _done = false;
+			bool _suspended = false;
+			bool _failed = false;
+			std::string _error;
+		};
+	}
+
+
+	// Awaits Deferred::onSuccess() without arguments
+	class Operation : public detail::Completion
+	{
+	public:
+
+		explicit Operation(AMQP::Deferred &deferred): _deferred(deferred)
+		{
+
+		}
+
+		bool await_suspend(std::coroutine_handle<> handle)
+		{
+			_deferred
+				.onSuccess([this]{ this->done(); })
+				.onError([this](const char *message){ this->fail(message); });
+
+			return this->suspend(handle);
+		}
+
+		void await_resume() const
+		{
+			this->check();
+		}
+
+	private:
+		AMQP::Deferred &_deferred;
+	};
+
+
+	struct QueueInfo
+	{
+		std::string name;
+		uint32_t messages = 0;
+		uint32_t consumers = 0;
+	};
+
+	class QueueOperation : public detail::Completion
+	{
+	public:
+
+		explicit QueueOperation(AMQP::DeferredQueue &deferred): _deferred(deferred)
+		{
+
+		}
+
+		bool await_suspend(std::coroutine_handle<> handle)
+		{
+			_deferred
+				.onSuccess([this](const std::string &name, uint32_t messagecount, uint32_t consumercount)
+				{
+					_info.name = name;
+					_info.messages = messagecount;
+					_info.consumers = consumercount;
+					this->done();
+				})
+				.onError([this](const char *message){ this->fail(message); });
+
+			return this->suspend(handle);
+		}
+
+		QueueInfo await_resume()
+		{
+			this->check();
+			return std::move(_info);
+		}
+
+	private:
+		AMQP::DeferredQueue &_deferred;
+		QueueInfo _info;
+	};
+
+	inline Operation declare_exchange(AMQP::Channel &channel, const std::string &name, AMQP::ExchangeType type, int flags = 0)
+	{
+		return Operation(channel.declareExchange(name, type, flags));
+	}
+
+	inline QueueOperation declare_queue(AMQP::Channel &channel, const std::string &name, int flags = 0)
+	{
+		return QueueOperation(channel.declareQueue(name, flags));
+	}
+
+	inline Operation bind_queue(AMQP::Channel &channel, const std::string &exchange, const std::string &queue, const std::string &routingkey)
+	{
+		return Operation(channel.bindQueue(exchange, queue, routingkey));
+	}
+
+
+	/*
+		Publisher confirms for coroutines. The channel is put into confirm
+		mode, every publish_confirmed() awaits its own ack (true) or nack (false).
+		Use a dedicated channel: confirms of other publishers would be mixed up.
+	*/
+	class Publisher
+	{
+	public:
+
+		class Confirm;
+
+		explicit Publisher(AMQP::Channel &channel): _channel(channel)
+		{
+			_channel.confirmSelect()
+				.onAck([this](uint64_t deliveryTag, bool multiple){ this->confirmed(deliveryTag, multiple, true); })
+				.onNack([this](uint64_t deliveryTag, bool multiple, bool requeue){ this->confirmed(deliveryTag, multiple, false); });
+		}
+
+		Publisher(const Publisher &) = delete;
+		Publisher &operator=(const Publisher &) = delete;
+
+		// Awaiting coroutines are not resumed
+		inline ~Publisher();
+
+		inline Confirm publish_confirmed(const std::string &exchange, const std::string &routingkey, const AMQP::Envelope &envelope);
+		inline Confirm publish_confirmed(const std::string &exchange, const std::string &routingkey, std::string_view body);
+
+		// Complete all awaiting publishes with false, e.g. from channel onError()
+		void fail_pending()
+		{
+			while( !_unconfirmed.empty() ){
+				this->confirmed(_unconfirmed.back().first, true, false);
+			}
+		}
+
+		size_t unconfirmed() const
+		{
+			return _unconfirmed.size();
+		}
+
+	private:
+
+		friend class Confirm;
+
+		AMQP::Channel &_channel;
+
+		// Publisher confirms: sequence numbers start from 1
+		uint64_t _published = 0;
+		std::deque<std::pair<uint64_t, Confirm *>> _unconfirmed;
+		std::vector<Confirm *> _ready;
+
+		inline void confirmed(uint64_t deliveryTag, bool multiple, bool ack);
+	};
+
+	class Publisher::Confirm : public detail::Completion
+	{
+	public:
+
+		bool await_suspend(std::coroutine_handle<> handle)
+		{
+			return this->suspend(handle);
+		}
+
+		// Whether the broker has confirmed the message
+		bool await_resume() const
+		{
+			return _ack;
+		}
+
+		~Confirm()
+		{
+			if( !_publisher ){
+				return;
+			}
+
+			for(auto &entry : _publisher->_unconfirmed){
+				if(entry.second == this) entry.second = nullptr;
+			}
+		}
+
+	private:
+
+		friend class Publisher;
+
+		// Registered in place: returned by guaranteed copy elision only
+		Confirm(Publisher *publisher, uint64_t tag): _publisher(publisher)
+		{
+			if(tag){
+				_publisher->_unconfirmed.emplace_back(tag, this);
+			}
+			else{
+				_publisher = nullptr;
+				this->done();
+			}
+		}
+
+		void complete(bool ack)
+		{
+			_publisher = nullptr;
+			_ack = ack;
+			this->done();
+		}
+
+		Publisher *_publisher;
+		bool _ack = false;
+	};
+
+	inline Publisher::~Publisher()
+	{
+		for(auto &entry : _unconfirmed){
+			if(entry.second) entry.second->_publisher = nullptr;
+		}
+	}
+
+	inline Publisher::Confirm Publisher::publish_confirmed(const std::string &exchange, const std::string &routingkey, const AMQP::Envelope &envelope)
+	{
+		// Failed publish is not counted by the broker, completes with false
+		return Confirm(this, _channel.publish(exchange, routingkey, envelope) ? ++_published : 0);
+	}
+
+	inline Publisher::Confirm Publisher::publish_confirmed(const std::string &exchange, const std::string &routingkey, std::string_view body)
+	{
+		return this->publish_confirmed(exchange, routingkey, AMQP::Envelope(body.data(), body.size()));
+	}
+
+	inline void Publisher::confirmed(uint64_t deliveryTag, bool multiple, bool ack)
+	{
+		// Resumed coroutines may publish again, so collect the confirmed first
+		std::vector<Confirm *> ready;
+		ready.swap(_ready);
+
+		if(multiple){
+			while( !_unconfirmed.empty() && _unconfirmed.front().first <= deliveryTag ){
+				ready.push_back(_unconfirmed.front().second);
+				_unconfirmed.pop_front();
+			}
+		}
+		else{
+			for(auto it = _unconfirmed.begin(); it != _unconfirmed.end(); ++it){
+				if(it->first == deliveryTag){
+					ready.push_back(it->second);
+					_unconfirmed.erase(it);
+					break;
+				}
+			}
+		}
+
+		for(Confirm *confirm : ready){
+			if(confirm) confirm->complete(ack);
+		}
+
+		// Keep the capacity for the next confirms
+		ready.clear();
+
+		if(_ready.empty()){
+			_ready.swap(ready);
+		}
+	}
+
+
+	// Awaits AsyncRpcClient reply, call is issued when awaited
+	class Call : public detail::Completion
+	{
+	public:
+
+		Call(AsyncRpcClient &client, std::string routingkey, std::string body, const AsyncRpcClient::CallOptions &options):
+			_client(client), _routingkey(std::move(routingkey)), _body(std::move(body)), _options(options)
+		{
+
+		}
+
+		// Destroyed while waiting: the call is cancelled, unless other (coalesced) callers wait for it
+		~Call()
+		{
+			if(_id){
+				this->forget();
+			}
+		}
+
+		bool await_suspend(std::coroutine_handle<> handle)
+		{
+			_self = std::make_shared<Call *>(this);
+
+			_id = _client.call(_routingkey, std::move(_body), _options, [self = _self](const AsyncRpcClient::Reply &reply)
+			{
+				// Call is gone, the request lives on for the other callers
+				Call *call = *self;
+
+				if( !call ){
+					return;
+				}
+
+				call->_id = 0;
+				call->_reply = reply;
+				call->done();
+			});
+
+			return this->suspend(handle);
+		}
+
+		AsyncRpcClient::Reply await_resume()
+		{
+			return std::move(_reply);
+		}
+
+	private:
+
+		void forget()
+		{
+			const uint64_t id = std::exchange(_id, 0);
+			*_self = nullptr;
+			this->abandon();
+			_client.release(id);
+		}
+
+		AsyncRpcClient &_client;
+		std::string _routingkey;
+		std::string _body;
+		AsyncRpcClient::CallOptions _options;
+		uint64_t _id = 0;
+		std::shared_ptr<Call *> _self;		// cleared when destroyed, the callback may outlive it
+		AsyncRpcClient::Reply _reply;
+	};
+
+	inline Call call(AsyncRpcClient &client, std::string routingkey, std::string body)
+	{
+		return Call(client, std::move(routingkey), std::move(body), AsyncRpcClient::CallOptions());
+	}
+
+	inline Call call(AsyncRpcClient &client, std::string routingkey, std::string body, const AsyncRpcClient::CallOptions &options)
+	{
+		return Call(client, std::move(routingkey), std::move(body), options);
+	}
+
+	/**
+	 *  Codec encoded call (see codec_rpc.hpp)
+	 *  @throws coro::Error     If the call fails or the reply can't be decoded
+	 */
+	template<typename Response, typename Request>
+	Task<Response> call(AsyncRpcClient &client, std::string routingkey, Request request)
+	{
+		AsyncRpcClient::CallOptions options;
+		options.content_type = codec::content_type;
+
+		AsyncRpcClient::Reply reply = co_await Call(client, std::move(routingkey), codec::encode(request), options);
+
+		if(reply.status != AsyncRpcClient::Status::OK){
+			throw Error(reply.error);
+		}
+
+		Response response;
+
+		if(reply.content_type != codec::content_type || !codec::decode(reply.body, response)){
+			throw Error("malformed reply");
+		}
+
+		co_return response;
+	}
+
+
+	// Resumes the coroutine on the event loop after the delay
+	class Sleep : public detail::Completion
+	{
+	public:
+
+		Sleep(MyTcpHandler &handler, std::chrono::milliseconds delay): _handler(handler), _delay(delay)
+		{
+
+		}
+
+		~Sleep()
+		{
+			if(_timer){
+				_handler.cancel_timer(_timer);
+			}
+		}
+
+		bool await_suspend(std::coroutine_handle<> handle)
+		{
+			_timer = _handler.add_timer(_delay, [this]{
+				_timer = 0;
+				this->done();
+			});
+
+			return this->suspend(handle);
+		}
+
+		void await_resume() const noexcept
+		{
+
+		}
+
+	private:
+		MyTcpHandler &_handler;
+		std::chrono::milliseconds _delay;
+		uint64_t _timer = 0;
+	};
+
+	inline Sleep sleep_for(MyTcpHandler &handler, std::chrono::milliseconds delay)
+	{
+		return Sleep(handler, delay);
+	}
+}
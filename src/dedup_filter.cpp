@@ -0,0 +1,244 @@
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <string_view>
+
+#include "utils.hpp"
+#include "lru_cache.hpp"
+#include "dedup_filter.hpp"
+
+
+namespace
+{
+	// Bloom filter of 64-bit keys with k probes derived by double hashing
+	class BloomFilter
+	{
+	public:
+
+		BloomFilter(size_t entries, double false_positive)
+		{
+			// Optimal size: m = -n * ln(p) / ln(2)^2, k = m / n * ln(2)
+			const double ln2 = std::log(2.0);
+			double bits = -double(entries) * std::log(false_positive) / (ln2 * ln2);
+
+			_words.assign(std::max<size_t>(1, static_cast<size_t>(bits) / 64 + 1), 0);
+			_probes = std::max(1, static_cast<int>(std::round(bits / entries * ln2)));
+		}
+
+		void insert(uint64_t key)
+		{
+			const uint64_t bits = _words.size() * 64;
+			uint64_t h1 = key, h2 = utils::mix(key) | 1;
+
+			for(int i = 0; i < _probes; ++i, h1 += h2){
+				uint64_t bit = h1 % bits;
+				_words[bit / 64] |= 1ULL << (bit % 64);
+			}
+		}
+
+		bool maybe_contains(uint64_t key) const
+		{
+			const uint64_t bits = _words.size() * 64;
+			uint64_t h1 = key, h2 = utils::mix(key) | 1;
+
+			for(int i = 0; i < _probes; ++i, h1 += h2){
+				uint64_t bit = h1 % bits;
+				if( !(_words[bit / 64] & (1ULL << (bit % 64))) ){
+					return false;
+				}
+			}
+
+			return true;
+		}
+
+		void clear() { std::fill(_words.begin(), _words.end(), 0); }
+
+		size_t memory_usage() const { return _words.size() * sizeof(uint64_t); }
+
+	private:
+		std::vector<uint64_t> _words;
+		int _probes;
+	};
+
+	struct NoHash
+	{
+		// keys are hashes already
+		size_t operator()(uint64_t key) const { return key; }
+	};
+
+	struct Empty {};
+}
+
+
+struct DedupFilter::Impl
+{
+	Options options;
+
+	// Bloom filters are rotated every 'capacity' insertions, so together they 
+	// always cover at least the keys of the LRU set.
+	BloomFilter bloom[2];
+	int current = 0;
+	size_t current_insertions = 0;
+
+	LruCache<uint64_t, Empty, NoHash> lru;
+
+	Stats stats;
+
+	explicit Impl(const Options &o):
+		options(o),
+		bloom{BloomFilter(o.capacity, o.false_positive), BloomFilter(o.capacity, o.false_positive)},
+		lru(o.capacity)
+	{
+
+	}
+
+	void bloom_insert(uint64_t key, bool count)
+	{
+		bloom[current].insert(key);
+
+		if( !count || ++current_insertions < options.capacity ){
+			return;
+		}
+
+		// Forget the oldest generation
+		current ^= 1;
+		bloom[current].clear();
+		current_insertions = 0;
+	}
+
+	uint64_t key(const AMQP::Message &message) const
+	{
+		uint64_t res = 0;
+
+		switch(options.source){
+			case KeySource::MESSAGE_ID:
+				if(message.hasMessageID() && !message.messageID().empty()){
+					res = utils::hash(message.messageID());
+				}
+				break;
+
+			case KeySource::HEADER:
+				if(message.hasHeaders() && message.headers().contains(options.header)){
+					const AMQP::Field &field = message.headers().get(options.header);
+					res = field.isString() ? 
+						utils::hash(static_cast<const std::string&>(field)) : 
+						utils::mix(static_cast<uint64_t>(field));
+				}
+				break;
+
+			case KeySource::BODY:
+				res = utils::hash(std::string_view(message.body(), message.bodySize()));
+				break;
+		}
+
+		// 0 is reserved for 'no key'
+		return res;
+	}
+
+	bool seen(uint64_t key)
+	{
+		if( !key ){
+			++stats.no_key;
+			return false;
+		}
+
+		++stats.checked;
+
+		if( !bloom[0].maybe_contains(key) && !bloom[1].maybe_contains(key) ){
+			++stats.bloom_negatives;
+			return false;
+		}
+
+		if( !lru.find(key) ){
+			++stats.bloom_false_positives;
+			return false;
+		}
+
+		// LRU position is refreshed - refresh Bloom filter too
+		this->bloom_insert(key, false);
+		++stats.duplicates;
+		return true;
+	}
+
+	void remember(uint64_t key)
+	{
+		if( !key ){
+			return;
+		}
+
+		// Repeated keys don't bring the rotation closer - the LRU set doesn't grow
+		const bool added = !lru.peek(key);
+
+		lru.insert(key, Empty());
+		this->bloom_insert(key, added);
+	}
+};
+
+
+DedupFilter::DedupFilter(): DedupFilter(Options())
+{
+
+}
+
+DedupFilter::DedupFilter(const Options &options): pimpl(std::make_shared<DedupFilter::Impl>(options))
+{
+
+}
+
+DedupFilter::~DedupFilter() = default;
+
+uint64_t DedupFilter::key(const AMQP::Message &message) const
+{
+	return pimpl->key(message);
+}
+
+bool DedupFilter::seen(uint64_t key)
+{
+	return pimpl->seen(key);
+}
+
+void DedupFilter::remember(uint64_t key)
+{
+	pimpl->remember(key);
+}
+
+AMQP::MessageCallback DedupFilter::wrap(AMQP::Channel &channel, Callback callback, bool noack)
+{
+	// Deliveries may outlive the filter (the channel keeps the callback)
+	std::weak_ptr<Impl> weak = pimpl;
+
+	return [weak, &channel, callback = std::move(callback), noack]
+		(const AMQP::Message &message, uint64_t deliveryTag, bool redelivered)
+	{
+		auto self = weak.lock();
+
+		if( !self ){
+			callback(message, deliveryTag, redelivered);
+			return;
+		}
+
+		const uint64_t key = self->key(message);
+		const bool check = redelivered || !self->options.only_redelivered;
+
+		if(check && self->seen(key)){
+			// Already processed, just remove it from the queue
+			if( !noack ){
+				channel.ack(deliveryTag);
+			}
+			return;
+		}
+
+		// Rejected or requeued messages must reach the callback again
+		if(callback(message, deliveryTag, redelivered)){
+			self->remember(key);
+		}
+	};
+}
+
+DedupFilter::Stats DedupFilter::stats() const
+{
+	Stats res = pimpl->stats;
+	res.entries = pimpl->lru.size();
+	res.memory_bytes = pimpl->lru.memory_usage() + pimpl->bloom[0].memory_usage() + pimpl->bloom[1].memory_usage();
+	return res;
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <functional>
+#include <cstdint>
+
+#include <amqpcpp.h>
+
+/*
+	Redelivery deduplication (idempotency) filter.
+
+	Remembers keys of successfully processed messages and drops the messages 
+	with already known keys before user callback runs. The key is a 64-bit hash 
+	of message-id, of a header value or of the message body.
+
+	Memory is bounded: a pair of rotating Bloom filters answers "definitely new"
+	for the most of messages, and only possible duplicates are checked against
+	the exact LRU set of the last 'capacity' keys. Bloom false positives never 
+	drop a message, they just cost an extra LRU lookup.
+
+	Filter outlives connections, so redeliveries after reconnection are caught.
+	Not thread-safe - use it on the event loop thread.
+*/
+
+class DedupFilter
+{
+public:
+
+	enum class KeySource
+	{
+		MESSAGE_ID,		// message-id property
+		HEADER,			// value of Options::header
+		BODY			// hash of the message body
+	};
+
+	struct Options
+	{
+		KeySource source = KeySource::MESSAGE_ID;
+		std::string header;				// header name for KeySource::HEADER
+		size_t capacity = 65536;		// number of remembered keys
+		double false_positive = 0.01;	// Bloom filter false positive rate
+		bool only_redelivered = false;	// check only messages with redelivered flag set
+	};
+
+	/**
+	 *  Consumer callback of wrap()
+	 *  @return bool            Message is processed (acked): its key is remembered.
+	 *                          False when it was rejected, nacked or left for
+	 *                          redelivery, so a redelivered copy isn't dropped
+	 */
+	using Callback = std::function<bool(const AMQP::Message &message, uint64_t deliveryTag, bool redelivered)>;
+
+	struct Stats
+	{
+		uint64_t checked = 0;			// messages checked for duplicate
+		uint64_t duplicates = 0;		// messages dropped
+		uint64_t no_key = 0;			// messages without key (always passed)
+		uint64_t bloom_negatives = 0;	// checks resolved by Bloom filter only
+		uint64_t bloom_false_positives = 0;
+		size_t entries = 0;				// keys in LRU set
+		size_t memory_bytes = 0;		// Bloom filters + LRU set
+
+		double hit_rate() const { return checked ? double(duplicates) / checked : 0.0; }
+	};
+
+	DedupFilter();
+	explicit DedupFilter(const Options &options);
+	~DedupFilter();
+
+	/**
+	 *  Key of the message (0 if the message has no key, e.g. no message-id)
+	 */
+	uint64_t key(const AMQP::Message &message) const;
+
+	/**
+	 *  Check if a message with the key was already processed
+	 */
+	bool seen(uint64_t key);
+
+	/**
+	 *  Remember the key of processed message
+	 */
+	void remember(uint64_t key);
+
+	/**
+	 *  Wrap onReceived() callback: duplicates are acked (unless consumer uses noack)
+	 *  and dropped, keys of other messages are remembered when the callback returns
+	 *  true (processed). After the filter is destroyed messages pass unchecked.
+	 *  @param  channel         Channel used to ack duplicates
+	 *  @param  callback        User callback
+	 *  @param  noack           Consumer was started with AMQP::noack flag
+	 */
+	AMQP::MessageCallback wrap(AMQP::Channel &channel, Callback callback, bool noack = false);
+
+	Stats stats() const;
+
+private:
+
+	struct Impl;
+	std::shared_ptr<Impl> pimpl;
+};
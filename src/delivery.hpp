@@ -0,0 +1,45 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+
+#include <amqpcpp.h>
+
+// Owning copy of a consumed message.
+//
+// AMQP::Message passed to onReceived() callback is valid only during the callback,
+// so messages processed later (e.g. on a worker thread) have to be copied.
+
+struct Delivery
+{
+	Delivery(const AMQP::Message &message, uint64_t deliveryTag, bool redelivered):
+		exchange(message.exchange()),
+		routingkey(message.routingkey()),
+		body(message.body(), message.bodySize()),
+		delivery_tag(deliveryTag),
+		redelivered(redelivered)
+	{
+		if(message.hasHeaders()) headers = message.headers();
+		if(message.hasMessageID()) message_id = message.messageID();
+		if(message.hasCorrelationID()) correlation_id = message.correlationID();
+		if(message.hasReplyTo()) reply_to = message.replyTo();
+		if(message.hasContentType()) content_type = message.contentType();
+		if(message.hasExpiration()) expiration = message.expiration();
+		if(message.hasTimestamp()) timestamp = message.timestamp();
+	}
+
+	std::string exchange;
+	std::string routingkey;
+	std::string body;
+
+	AMQP::Table headers;
+	std::string message_id;
+	std::string correlation_id;
+	std::string reply_to;
+	std::string content_type;
+	std::string expiration;
+	uint64_t timestamp = 0;
+
+	uint64_t delivery_tag = 0;
+	bool redelivered = false;
+};
@@ -0,0 +1,819 @@
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <unordered_map>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <random>
+#include <stdexcept>
+#include <system_error>
+#include <cstring>
+#include <cerrno>
+
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "logger.hpp"
+#include "fault_proxy.hpp"
+
+
+namespace
+{
+	using steady_clock = std::chrono::steady_clock;
+
+	struct Chunk
+	{
+		steady_clock::time_point release;
+		std::string data;
+		size_t offset = 0;
+	};
+
+	// Data read from one socket of the connection, to be written to the other one
+	struct Pipe
+	{
+		std::deque<Chunk> chunks;
+		size_t buffered = 0;
+		steady_clock::time_point last_release;		// chunks are released in order
+
+		double tokens = 0;							// bandwidth limit
+		steady_clock::time_point refilled;
+
+		bool eof = false;							// source closed its side
+		bool shut = false;							// destination write side is shut down
+	};
+
+	struct Connection
+	{
+		uint64_t id = 0;
+		int fd[2] = {-1, -1};						// client, upstream
+		Pipe pipe[2];								// pipe[i] - read from fd[i]
+		uint32_t events[2] = {0, 0};				// registered in epoll
+		bool write_blocked[2] = {false, false};
+		bool connecting = true;						// upstream connect() in progress
+		bool blackholed = false;					// HALF_OPEN: data is dropped
+		bool dead = false;							// to be closed at the end of the loop iteration
+	};
+
+	const uint32_t IN = EPOLLIN;
+	const uint32_t OUT = EPOLLOUT;
+
+	std::chrono::milliseconds parse_time(const std::string &value)
+	{
+		size_t pos = 0;
+		const double number = std::stod(value, &pos);
+		const std::string unit = value.substr(pos);
+
+		if(unit == "ms"){
+			return std::chrono::milliseconds(static_cast<int64_t>(number));
+		}
+
+		if(unit == "s" || unit.empty()){
+			return std::chrono::milliseconds(static_cast<int64_t>(number * 1000));
+		}
+
+		throw std::invalid_argument("bad time '" + value + "'");
+	}
+}
+
+
+struct FaultProxy::Impl
+{
+	Options options;
+
+	int listen_fd = -1;
+	int epoll_fd = -1;
+	int wakeup_fd = -1;
+	uint16_t port = 0;
+
+	sockaddr_storage upstream{};
+	socklen_t upstream_len = 0;
+
+	std::thread thread;
+	std::atomic<bool> stop{false};
+
+	// Control calls, executed by the proxy thread
+	std::mutex commands_mutex;
+	std::vector<std::function<void()>> commands;
+
+	// Proxy thread data
+	uint64_t next_connection = 0;
+	std::map<uint64_t, std::unique_ptr<Connection>> connections;
+	std::unordered_map<int, Connection *> by_fd;
+
+	steady_clock::time_point stall_until;
+	steady_clock::time_point half_open_until;
+	steady_clock::time_point refuse_until;
+
+	std::vector<Event> events;
+	size_t next_event = 0;
+	steady_clock::time_point schedule_start;
+	std::chrono::milliseconds period{0};
+
+	std::minstd_rand random{42};
+
+	struct
+	{
+		std::atomic<uint64_t> connections{0}, active{0}, bytes_up{0}, bytes_down{0}, bytes_dropped{0},
+			faults{0}, resets{0}, upstream_failures{0};
+	} counters;
+
+	explicit Impl(const Options &o): options(o)
+	{
+
+	}
+
+	~Impl()
+	{
+		for(auto &c : connections){
+			for(int fd : c.second->fd){
+				if(fd > -1) ::close(fd);
+			}
+		}
+
+		if(listen_fd > -1) ::close(listen_fd);
+		if(wakeup_fd > -1) ::close(wakeup_fd);
+		if(epoll_fd > -1) ::close(epoll_fd);
+	}
+
+	void listen()
+	{
+		epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+		if(epoll_fd < 0 || wakeup_fd < 0){
+			throw std::system_error(errno, std::generic_category(), "FaultProxy: epoll/eventfd");
+		}
+
+		this->watch(wakeup_fd, IN);
+
+		addrinfo hints{};
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = AI_NUMERICSERV;
+
+		addrinfo *res = nullptr;
+		std::string service = std::to_string(options.upstream_port);
+
+		if(getaddrinfo(options.upstream_host.c_str(), service.c_str(), &hints, &res) != 0 || !res){
+			throw std::system_error(EINVAL, std::generic_category(), "FaultProxy: can't resolve " + options.upstream_host);
+		}
+
+		std::memcpy(&upstream, res->ai_addr, res->ai_addrlen);
+		upstream_len = res->ai_addrlen;
+		freeaddrinfo(res);
+
+		hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+		service = std::to_string(options.port);
+
+		if(getaddrinfo(options.host.c_str(), service.c_str(), &hints, &res) != 0 || !res){
+			throw std::system_error(EINVAL, std::generic_category(), "FaultProxy: can't resolve " + options.host);
+		}
+
+		listen_fd = socket(res->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+		int on = 1;
+		setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+		if(listen_fd < 0 || bind(listen_fd, res->ai_addr, res->ai_addrlen) < 0 || ::listen(listen_fd, 128) < 0){
+			const int err = errno;
+			freeaddrinfo(res);
+			throw std::system_error(err, std::generic_category(), "FaultProxy: can't listen on " + options.host + ":" + service);
+		}
+
+		freeaddrinfo(res);
+
+		sockaddr_storage addr{};
+		socklen_t len = sizeof(addr);
+		getsockname(listen_fd, reinterpret_cast<sockaddr *>(&addr), &len);
+		port = ntohs(addr.ss_family == AF_INET6 ? reinterpret_cast<sockaddr_in6 *>(&addr)->sin6_port : reinterpret_cast<sockaddr_in *>(&addr)->sin_port);
+
+		this->watch(listen_fd, IN);
+	}
+
+	void watch(int fd, uint32_t events)
+	{
+		epoll_event ev{};
+		ev.events = events;
+		ev.data.fd = fd;
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+	}
+
+	void post(std::function<void()> command)
+	{
+		{
+			std::lock_guard<std::mutex> lock(commands_mutex);
+			commands.push_back(std::move(command));
+		}
+
+		uint64_t one = 1;
+		if(::write(wakeup_fd, &one, sizeof(one)) < 0){
+			// The counter is non-zero already
+		}
+	}
+
+	void run()
+	{
+		std::vector<epoll_event> ready(256);
+
+		while( !stop.load() ){
+			const int n = epoll_wait(epoll_fd, ready.data(), static_cast<int>(ready.size()), this->timeout());
+
+			if(n < 0 && errno != EINTR){
+				logger.msg(MSG_ERROR, "%s%s\n", excp_method("FaultProxy: epoll_wait failed: "), strerror(errno));
+				return;
+			}
+
+			for(int i = 0; i < n; ++i){
+				const int fd = ready[i].data.fd;
+				const uint32_t ev = ready[i].events;
+
+				if(fd == listen_fd){
+					this->accept();
+					continue;
+				}
+
+				if(fd == wakeup_fd){
+					this->run_commands();
+					continue;
+				}
+
+				auto it = by_fd.find(fd);
+
+				if(it == by_fd.end() || it->second->dead){
+					continue;
+				}
+
+				Connection &c = *it->second;
+				const int side = fd == c.fd[0] ? 0 : 1;
+
+				if(side == 1 && c.connecting){
+					if(ev & (OUT | EPOLLERR | EPOLLHUP)){
+						this->connected(c);
+					}
+
+					continue;
+				}
+
+				if(ev & OUT){
+					c.write_blocked[side] = false;
+				}
+
+				if(ev & (IN | EPOLLERR | EPOLLHUP)){
+					this->receive(c, side);
+				}
+			}
+
+			const auto now = steady_clock::now();
+			this->run_schedule(now);
+
+			for(auto it = connections.begin(); it != connections.end();){
+				Connection &c = *it->second;
+
+				if( !c.dead ){
+					this->flush(c, 0, now);
+					this->flush(c, 1, now);
+				}
+
+				if(c.dead){
+					this->close(c);
+					it = connections.erase(it);
+					continue;
+				}
+
+				this->update_events(c);
+				++it;
+			}
+		}
+	}
+
+	// Until the next chunk, schedule event or the stop check
+	int timeout() const
+	{
+		const auto now = steady_clock::now();
+		auto wake = now + std::chrono::milliseconds(250);
+
+		for(const auto &c : connections){
+			for(const Pipe &p : c.second->pipe){
+				if( !p.chunks.empty() ){
+					// Bandwidth limit and stalls are checked every millisecond
+					wake = std::min(wake, std::max(p.chunks.front().release, now + std::chrono::milliseconds(1)));
+				}
+			}
+		}
+
+		if(next_event < events.size()){
+			wake = std::min(wake, schedule_start + events[next_event].at);
+		}
+
+		const auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(wake - now).count();
+		return static_cast<int>(std::max<int64_t>(wait, 0));
+	}
+
+	void run_commands()
+	{
+		uint64_t value;
+		while(::read(wakeup_fd, &value, sizeof(value)) > 0){}
+
+		std::vector<std::function<void()>> batch;
+
+		{
+			std::lock_guard<std::mutex> lock(commands_mutex);
+			batch.swap(commands);
+		}
+
+		for(auto &command : batch){
+			command();
+		}
+	}
+
+	void run_schedule(steady_clock::time_point now)
+	{
+		while(next_event < events.size() && schedule_start + events[next_event].at <= now){
+			this->apply(events[next_event++]);
+
+			if(next_event == events.size() && period.count() > 0){
+				schedule_start += period;
+				next_event = 0;
+			}
+		}
+	}
+
+	void apply(const Event &event)
+	{
+		const auto now = steady_clock::now();
+
+		++counters.faults;
+		logger.msg(MSG_DEBUG, "FaultProxy: %s (%ld ms)\n", FaultProxy::name(event.action), static_cast<long>(event.duration.count()));
+
+		switch(event.action){
+			case Action::STALL:
+				stall_until = std::max(stall_until, now + event.duration);
+				break;
+
+			case Action::HALF_OPEN:
+				half_open_until = std::max(half_open_until, now + event.duration);
+
+				for(auto &c : connections){
+					this->blackhole(*c.second);
+				}
+				break;
+
+			case Action::RESET:
+				for(auto &c : connections){
+					if( !c.second->dead ){
+						this->reset(*c.second);
+						++counters.resets;
+					}
+				}
+				break;
+
+			case Action::REFUSE:
+				refuse_until = std::max(refuse_until, now + event.duration);
+				break;
+		}
+
+		if(options.on_fault){
+			options.on_fault(event);
+		}
+	}
+
+	void accept()
+	{
+		for(;;){
+			const int fd = ::accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+			if(fd < 0){
+				return;
+			}
+
+			++counters.connections;
+
+			if(steady_clock::now() < refuse_until){
+				this->reset_socket(fd);
+				++counters.resets;
+				continue;
+			}
+
+			const int up = socket(upstream.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+			if(up < 0 || (::connect(up, reinterpret_cast<const sockaddr *>(&upstream), upstream_len) < 0 && errno != EINPROGRESS)){
+				logger.msg(MSG_ERROR, "FaultProxy: upstream connect failed: %s\n", strerror(errno));
+				++counters.upstream_failures;
+
+				if(up > -1) ::close(up);
+				this->reset_socket(fd);
+				continue;
+			}
+
+			int on = 1;
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+			setsockopt(up, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+			auto c = std::make_unique<Connection>();
+			c->id = ++next_connection;
+			c->fd[0] = fd;
+			c->fd[1] = up;
+
+			for(Pipe &p : c->pipe){
+				p.tokens = static_cast<double>(this->burst());
+				p.refilled = steady_clock::now();
+			}
+
+			// The peer is unreachable for the new connections too
+			if(steady_clock::now() < half_open_until){
+				this->blackhole(*c);
+			}
+
+			this->watch(fd, 0);
+			this->watch(up, OUT);
+			c->events[1] = OUT;
+
+			by_fd[fd] = c.get();
+			by_fd[up] = c.get();
+			connections[c->id] = std::move(c);
+			++counters.active;
+		}
+	}
+
+	void connected(Connection &c)
+	{
+		int err = 0;
+		socklen_t len = sizeof(err);
+		getsockopt(c.fd[1], SOL_SOCKET, SO_ERROR, &err, &len);
+
+		if(err){
+			logger.msg(MSG_ERROR, "FaultProxy: upstream connect failed: %s\n", strerror(err));
+			++counters.upstream_failures;
+			this->reset(c);
+			return;
+		}
+
+		c.connecting = false;
+	}
+
+	void receive(Connection &c, int side)
+	{
+		Pipe &p = c.pipe[side];
+		char buf[65536];
+
+		// Bounded per wakeup, so one connection doesn't starve the others
+		for(int i = 0; i < 16 && !p.eof && p.buffered < options.max_buffer; ++i){
+			const ssize_t got = ::read(c.fd[side], buf, sizeof(buf));
+
+			if(got > 0){
+				if(c.blackholed){
+					counters.bytes_dropped += got;
+					continue;
+				}
+
+				const auto now = steady_clock::now();
+				auto delay = options.latency;
+
+				if(options.jitter.count() > 0){
+					delay += std::chrono::milliseconds(random() % (options.jitter.count() + 1));
+				}
+
+				Chunk chunk;
+				chunk.release = std::max(now + delay, p.last_release);
+				chunk.data.assign(buf, got);
+				p.last_release = chunk.release;
+				p.buffered += got;
+				p.chunks.push_back(std::move(chunk));
+				continue;
+			}
+
+			if(got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+				return;
+			}
+
+			if(got < 0 && errno == EINTR){
+				continue;
+			}
+
+			if(got < 0){
+				// Reset by the peer: pass it on
+				this->reset(c);
+				return;
+			}
+
+			p.eof = true;
+		}
+
+		if( !p.eof || !c.blackholed ){
+			return;
+		}
+
+		// Black-holed connection: the client gave up, or the broker did (the client doesn't learn it)
+		if(side == 0){
+			c.dead = true;
+		}
+		else{
+			this->close_fd(c, 1);
+		}
+	}
+
+	// Forward released chunks of the pipe to the other socket
+	void flush(Connection &c, int side, steady_clock::time_point now)
+	{
+		Pipe &p = c.pipe[side];
+		const int to = 1 - side;
+
+		if(c.fd[to] < 0 || (to == 1 && c.connecting) || now < stall_until){
+			return;
+		}
+
+		while( !p.chunks.empty() && !c.write_blocked[to] ){
+			Chunk &chunk = p.chunks.front();
+
+			if(chunk.release > now){
+				break;
+			}
+
+			size_t size = chunk.data.size() - chunk.offset;
+
+			if(options.bandwidth){
+				const double elapsed = std::chrono::duration<double>(now - p.refilled).count();
+				p.tokens = std::min(p.tokens + elapsed * options.bandwidth, static_cast<double>(this->burst()));
+				p.refilled = now;
+				size = std::min(size, static_cast<size_t>(p.tokens));
+
+				if( !size ){
+					break;
+				}
+			}
+
+			const ssize_t sent = ::send(c.fd[to], chunk.data.data() + chunk.offset, size, MSG_NOSIGNAL);
+
+			if(sent < 0){
+				if(errno == EAGAIN || errno == EWOULDBLOCK){
+					c.write_blocked[to] = true;
+				}
+				else if(errno != EINTR){
+					this->reset(c);
+					return;
+				}
+
+				continue;
+			}
+
+			chunk.offset += sent;
+			p.buffered -= sent;
+			p.tokens -= sent;
+			(side == 0 ? counters.bytes_up : counters.bytes_down) += sent;
+
+			if(chunk.offset == chunk.data.size()){
+				p.chunks.pop_front();
+			}
+		}
+
+		// Pass the FIN on when the data before it is delivered
+		if(p.eof && p.chunks.empty() && !p.shut && !c.blackholed){
+			::shutdown(c.fd[to], SHUT_WR);
+			p.shut = true;
+		}
+
+		if(c.pipe[0].shut && c.pipe[1].shut){
+			c.dead = true;
+		}
+	}
+
+	void update_events(Connection &c)
+	{
+		for(int side = 0; side < 2; ++side){
+			if(c.fd[side] < 0){
+				continue;
+			}
+
+			const Pipe &p = c.pipe[side];
+			uint32_t ev = 0;
+
+			if( !p.eof && p.buffered < options.max_buffer && !(side == 1 && c.connecting) ){
+				ev |= IN;
+			}
+
+			if(c.write_blocked[side] || (side == 1 && c.connecting)){
+				ev |= OUT;
+			}
+
+			if(ev != c.events[side]){
+				epoll_event event{};
+				event.events = ev;
+				event.data.fd = c.fd[side];
+				epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c.fd[side], &event);
+				c.events[side] = ev;
+			}
+		}
+	}
+
+	// Bandwidth bucket size: 10 ms of traffic, at least a few packets
+	size_t burst() const
+	{
+		return options.bandwidth ? std::max<size_t>(options.bandwidth / 100, 4096) : 0;
+	}
+
+	void blackhole(Connection &c)
+	{
+		c.blackholed = true;
+
+		for(Pipe &p : c.pipe){
+			counters.bytes_dropped += p.buffered;
+			p.chunks.clear();
+			p.buffered = 0;
+		}
+	}
+
+	// RST instead of FIN
+	void reset_socket(int fd)
+	{
+		linger l{1, 0};
+		setsockopt(fd, SOL_SOCKET, SO_LINGER, &l, sizeof(l));
+		::close(fd);
+	}
+
+	void reset(Connection &c)
+	{
+		for(int side = 0; side < 2; ++side){
+			if(c.fd[side] > -1){
+				linger l{1, 0};
+				setsockopt(c.fd[side], SOL_SOCKET, SO_LINGER, &l, sizeof(l));
+			}
+		}
+
+		c.dead = true;
+	}
+
+	void close_fd(Connection &c, int side)
+	{
+		if(c.fd[side] < 0){
+			return;
+		}
+
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c.fd[side], nullptr);
+		by_fd.erase(c.fd[side]);
+		::close(c.fd[side]);
+		c.fd[side] = -1;
+	}
+
+	void close(Connection &c)
+	{
+		this->close_fd(c, 0);
+		this->close_fd(c, 1);
+		--counters.active;
+	}
+};
+
+
+FaultProxy::FaultProxy(const Options &options): pimpl(new Impl(options))
+{
+	pimpl->listen();
+
+	pimpl->thread = std::thread([this]{ pimpl->run(); });
+}
+
+FaultProxy::~FaultProxy()
+{
+	pimpl->stop.store(true);
+
+	uint64_t one = 1;
+	if(::write(pimpl->wakeup_fd, &one, sizeof(one)) < 0){
+		// epoll_wait timeout stops it anyway
+	}
+
+	pimpl->thread.join();
+}
+
+uint16_t FaultProxy::port() const
+{
+	return pimpl->port;
+}
+
+std::string FaultProxy::url() const
+{
+	const std::string &host = pimpl->options.host;
+	const bool ipv6 = host.find(':') != std::string::npos;
+	return "amqp://guest:guest@" + (ipv6 ? "[" + host + "]" : host) + ":" + std::to_string(pimpl->port) + "/";
+}
+
+void FaultProxy::inject(Action action, std::chrono::milliseconds duration)
+{
+	Event event;
+	event.action = action;
+	event.duration = duration;
+
+	Impl *impl = pimpl.get();
+	impl->post([impl, event]{ impl->apply(event); });
+}
+
+void FaultProxy::schedule(std::vector<Event> events, std::chrono::milliseconds period)
+{
+	std::stable_sort(events.begin(), events.end(), [](const Event &a, const Event &b){ return a.at < b.at; });
+
+	Impl *impl = pimpl.get();
+	const auto start = steady_clock::now();
+
+	impl->post([impl, events = std::move(events), period, start]
+	{
+		impl->events = events;
+		impl->next_event = 0;
+		impl->schedule_start = start;
+		impl->period = period;
+	});
+}
+
+void FaultProxy::shape(std::chrono::milliseconds latency, std::chrono::milliseconds jitter, uint64_t bandwidth)
+{
+	Impl *impl = pimpl.get();
+
+	impl->post([impl, latency, jitter, bandwidth]
+	{
+		impl->options.latency = latency;
+		impl->options.jitter = jitter;
+		impl->options.bandwidth = bandwidth;
+	});
+}
+
+FaultProxy::Stats FaultProxy::stats() const
+{
+	const auto &c = pimpl->counters;
+
+	Stats res;
+	res.connections = c.connections.load();
+	res.active = c.active.load();
+	res.bytes_up = c.bytes_up.load();
+	res.bytes_down = c.bytes_down.load();
+	res.bytes_dropped = c.bytes_dropped.load();
+	res.faults = c.faults.load();
+	res.resets = c.resets.load();
+	res.upstream_failures = c.upstream_failures.load();
+	return res;
+}
+
+std::vector<FaultProxy::Event> FaultProxy::parse_schedule(const std::string &schedule)
+{
+	std::vector<Event> res;
+	size_t pos = 0;
+
+	while(pos < schedule.size()){
+		size_t end = schedule.find(',', pos);
+		if(end == std::string::npos) end = schedule.size();
+
+		std::vector<std::string> parts;
+		const std::string item = schedule.substr(pos, end - pos);
+		size_t from = 0;
+
+		while(from <= item.size()){
+			size_t colon = item.find(':', from);
+			if(colon == std::string::npos) colon = item.size();
+
+			parts.push_back(item.substr(from, colon - from));
+			from = colon + 1;
+		}
+
+		pos = end + 1;
+
+		if(item.empty()){
+			continue;
+		}
+
+		if(parts.size() < 2 || parts.size() > 3){
+			throw std::invalid_argument("bad schedule item '" + item + "', expected TIME:ACTION[:DURATION]");
+		}
+
+		Event event;
+		event.at = parse_time(parts[0]);
+
+		if(parts[1] == "stall") event.action = Action::STALL;
+		else if(parts[1] == "half-open") event.action = Action::HALF_OPEN;
+		else if(parts[1] == "reset") event.action = Action::RESET;
+		else if(parts[1] == "refuse") event.action = Action::REFUSE;
+		else throw std::invalid_argument("unknown fault '" + parts[1] + "'");
+
+		if(parts.size() == 3){
+			event.duration = parse_time(parts[2]);
+		}
+
+		res.push_back(event);
+	}
+
+	return res;
+}
+
+const char *FaultProxy::name(Action action)
+{
+	switch(action){
+		case Action::STALL: return "stall";
+		case Action::HALF_OPEN: return "half-open";
+		case Action::RESET: return "reset";
+		case Action::REFUSE: return "refuse";
+	}
+
+	return "unknown";
+}
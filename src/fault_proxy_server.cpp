@@ -0,0 +1,111 @@
+#include <iostream>
+#include <string>
+#include <csignal>
+#include <pthread.h>
+
+#include "logger.hpp"
+#include "fault_proxy.hpp"
+
+/*
+	Fault-injecting proxy in front of a broker, for trying the reconnection
+	demos and heartbeats against connection faults.
+
+	Usage:
+		fault_proxy_server [--listen 5673] [--upstream 127.0.0.1:5672]
+		                   [--latency MS] [--jitter MS] [--bandwidth BPS]
+		                   [--schedule 10s:reset,30s:half-open:90s] [--period S]
+
+	--schedule      faults, see FaultProxy::parse_schedule()
+	--period        repeat the schedule every S seconds, 0 - once
+
+	Stopped by SIGINT / SIGTERM.
+*/
+
+namespace
+{
+	bool parse_args(int argc, char* argv[], FaultProxy::Options &options, std::vector<FaultProxy::Event> &schedule, std::chrono::milliseconds &period)
+	{
+		for(int i = 1; i + 1 < argc; i += 2){
+			const std::string arg = argv[i];
+			const std::string value = argv[i + 1];
+
+			if(arg == "--listen"){
+				options.port = static_cast<uint16_t>(std::stoi(value));
+			}
+			else if(arg == "--upstream"){
+				const auto colon = value.rfind(':');
+
+				if(colon == std::string::npos){
+					options.upstream_host = value;
+				}
+				else{
+					options.upstream_host = value.substr(0, colon);
+					options.upstream_port = static_cast<uint16_t>(std::stoi(value.substr(colon + 1)));
+				}
+			}
+			else if(arg == "--latency") options.latency = std::chrono::milliseconds(std::stoi(value));
+			else if(arg == "--jitter") options.jitter = std::chrono::milliseconds(std::stoi(value));
+			else if(arg == "--bandwidth") options.bandwidth = std::stoull(value);
+			else if(arg == "--schedule") schedule = FaultProxy::parse_schedule(value);
+			else if(arg == "--period") period = std::chrono::seconds(std::stoi(value));
+			else return false;
+		}
+
+		return argc % 2 == 1;
+	}
+}
+
+
+int main(int argc, char* argv[])
+{
+	logger.init(MSG_DEBUG);
+
+	FaultProxy::Options options;
+	options.port = 5673;
+
+	std::vector<FaultProxy::Event> schedule;
+	std::chrono::milliseconds period(0);
+
+	try{
+		if( !parse_args(argc, argv, options, schedule, period) ){
+			std::cerr << "Usage: " << argv[0] << " [--listen PORT] [--upstream HOST:PORT] [--latency MS] [--jitter MS]"
+				" [--bandwidth BPS] [--schedule S] [--period S]" << std::endl;
+			return 1;
+		}
+	}
+	catch(const std::exception &e){
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+
+	options.on_fault = [](const FaultProxy::Event &event)
+	{
+		logger.msg(MSG_DEBUG, "Fault: %s %ld ms\n", FaultProxy::name(event.action), static_cast<long>(event.duration.count()));
+	};
+
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+
+	// Blocked before the proxy thread starts, so it inherits the mask
+	pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+	FaultProxy proxy(options);
+	logger.msg(MSG_DEBUG, "Listening on %s, upstream %s:%u\n", proxy.url().c_str(), options.upstream_host.c_str(),
+		static_cast<unsigned>(options.upstream_port));
+
+	if( !schedule.empty() ){
+		proxy.schedule(schedule, period);
+	}
+
+	int signal = 0;
+	sigwait(&signals, &signal);
+
+	const auto stats = proxy.stats();
+	logger.msg(MSG_DEBUG, "Stopped: connections %lu, faults %lu, up %lu bytes, down %lu bytes\n",
+		static_cast<unsigned long>(stats.connections), static_cast<unsigned long>(stats.faults),
+		static_cast<unsigned long>(stats.bytes_up), static_cast<unsigned long>(stats.bytes_down));
+
+	return 0;
+}
@@ -0,0 +1,650 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+
+#include <amqpcpp.h>
+#include <amqpcpp/linux_tcp.h>
+
+#include "logger.hpp"
+#include "my_handler.hpp"
+#include "local_broker.hpp"
+#include "fault_proxy.hpp"
+
+/*
+	Recovery test under load: connection faults are injected by FaultProxy
+	between the clients and the broker on a schedule, while a producer
+	publishes numbered messages with publisher confirms and a consumer acks
+	them. Both reconnect (MyTcpHandler::loop() again with a new connection)
+	after the connection is lost, the producer republishes the unconfirmed
+	messages, so the delivery is at-least-once.
+
+	Reported at the end:
+
+	* per fault: time until the producer noticed the connection loss, and
+	  the recovery time - until the first confirm of a message published
+	  after the fault
+	* lost messages: confirmed but never received (must be 0) and published,
+	  never confirmed and never received
+	* duplicates: received more than once (republished, or redelivered
+	  because the ack was lost with the connection)
+
+	By default the in-process LocalBroker is used, so the run is reproducible
+	on a single machine. HALF_OPEN faults give no error, the clients notice
+	them by the silence of the server: nothing received for two heartbeat
+	intervals (MyTcpHandler::set_heartbeat(), --heartbeat). The interval must
+	stay above the longest STALL, or stalls are reported as connection losses.
+
+	Usage:
+		fault_test [--url URL] [--rate 1000] [--size 100] [--duration 40]
+		           [--schedule 5s:reset,12s:stall:2s,20s:refuse:3s,28s:half-open:5s] [--period 0]
+		           [--latency 0] [--jitter 0] [--bandwidth 0] [--consumer-via-proxy]
+		           [--reconnect-delay 200] [--heartbeat 2]
+
+	--schedule      faults, see FaultProxy::parse_schedule()
+	--period        repeat the schedule every S seconds, 0 - once
+	--latency       proxy latency and jitter (ms), bandwidth limit (bytes/s)
+	--heartbeat     heartbeat interval of the clients (s), 0 - broker suggestion
+*/
+
+namespace
+{
+	using steady_clock = std::chrono::steady_clock;
+
+	const char *queue = "fault_test";
+
+	struct Config
+	{
+		std::string url;							// empty - LocalBroker
+		double rate = 1000;
+		size_t size = 100;
+		std::chrono::seconds duration{40};
+		std::string schedule = "5s:reset,12s:stall:2s,20s:refuse:3s,28s:half-open:5s";
+		std::chrono::seconds period{0};
+		std::chrono::milliseconds latency{0};
+		std::chrono::milliseconds jitter{0};
+		uint64_t bandwidth = 0;
+		bool consumer_via_proxy = false;
+		std::chrono::milliseconds reconnect_delay{200};
+		uint16_t heartbeat = 2;
+	};
+
+	bool parse_args(int argc, char* argv[], Config &config)
+	{
+		for(int i = 1; i < argc; ++i){
+			const std::string arg = argv[i];
+
+			if(arg == "--consumer-via-proxy"){
+				config.consumer_via_proxy = true;
+				continue;
+			}
+
+			if(i + 1 >= argc){
+				return false;
+			}
+
+			const std::string value = argv[++i];
+
+			if(arg == "--url") config.url = value;
+			else if(arg == "--rate") config.rate = std::stod(value);
+			else if(arg == "--size") config.size = std::max<size_t>(std::stoul(value), sizeof(uint64_t));
+			else if(arg == "--duration") config.duration = std::chrono::seconds(std::stoi(value));
+			else if(arg == "--schedule") config.schedule = value;
+			else if(arg == "--period") config.period = std::chrono::seconds(std::stoi(value));
+			else if(arg == "--latency") config.latency = std::chrono::milliseconds(std::stoi(value));
+			else if(arg == "--jitter") config.jitter = std::chrono::milliseconds(std::stoi(value));
+			else if(arg == "--bandwidth") config.bandwidth = std::stoull(value);
+			else if(arg == "--reconnect-delay") config.reconnect_delay = std::chrono::milliseconds(std::stoi(value));
+			else if(arg == "--heartbeat") config.heartbeat = static_cast<uint16_t>(std::stoul(value));
+			else return false;
+		}
+
+		return config.rate > 0;
+	}
+
+	double ms(steady_clock::duration d)
+	{
+		return std::chrono::duration<double, std::milli>(d).count();
+	}
+
+	struct Fault
+	{
+		FaultProxy::Event event;
+		steady_clock::time_point at;
+		steady_clock::time_point detected;		// producer connection loss noticed
+		steady_clock::time_point recovered;		// first confirm of a message published after the fault
+	};
+
+	// What happened to every message (by sequence number, from 1), shared by the threads
+	class Journal
+	{
+	public:
+
+		void fault(const FaultProxy::Event &event)
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_faults.push_back(Fault{event, steady_clock::now(), {}, {}});
+		}
+
+		void published(uint64_t seq, bool republished)
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			this->grow(seq);
+			_republished += republished;
+		}
+
+		void confirmed(uint64_t seq, steady_clock::time_point published)
+		{
+			const auto now = steady_clock::now();
+
+			std::lock_guard<std::mutex> lock(_mutex);
+			this->grow(seq);
+			_confirmed[seq] = true;
+
+			for(auto &f : _faults){
+				if(f.recovered == steady_clock::time_point() && published > f.at){
+					f.recovered = now;
+				}
+			}
+		}
+
+		void received(uint64_t seq)
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			this->grow(seq);
+
+			if(_received[seq] < UINT16_MAX){
+				++_received[seq];
+			}
+		}
+
+		void disconnected()
+		{
+			const auto now = steady_clock::now();
+
+			std::lock_guard<std::mutex> lock(_mutex);
+
+			for(auto &f : _faults){
+				if(f.detected == steady_clock::time_point() && f.recovered == steady_clock::time_point()){
+					f.detected = now;
+				}
+			}
+		}
+
+		// Confirmed messages not received yet
+		uint64_t missing() const
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			uint64_t res = 0;
+
+			for(size_t seq = 1; seq < _confirmed.size(); ++seq){
+				res += _confirmed[seq] && !_received[seq];
+			}
+
+			return res;
+		}
+
+		void report(steady_clock::time_point start) const
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+
+			uint64_t published = 0, confirmed = 0, received = 0, duplicates = 0, lost_confirmed = 0, lost_unconfirmed = 0;
+
+			for(size_t seq = 1; seq < _confirmed.size(); ++seq){
+				++published;
+				confirmed += _confirmed[seq];
+				received += _received[seq] > 0;
+				duplicates += _received[seq] > 1 ? _received[seq] - 1 : 0;
+
+				if( !_received[seq] ){
+					++(_confirmed[seq] ? lost_confirmed : lost_unconfirmed);
+				}
+			}
+
+			printf("\n%8s %-10s %10s | %12s %12s\n", "time", "fault", "duration", "detected ms", "recovery ms");
+
+			for(const auto &f : _faults){
+				char detected[32] = "-", recovered[32] = "not recovered";
+
+				if(f.detected != steady_clock::time_point()){
+					snprintf(detected, sizeof(detected), "%.1f", ms(f.detected - f.at));
+				}
+
+				if(f.recovered != steady_clock::time_point()){
+					snprintf(recovered, sizeof(recovered), "%.1f", ms(f.recovered - f.at));
+				}
+
+				printf("%7.1fs %-10s %8ldms | %12s %12s\n", ms(f.at - start) / 1000, FaultProxy::name(f.event.action),
+					static_cast<long>(f.event.duration.count()), detected, recovered);
+			}
+
+			printf("\npublished %lu (republished %lu), confirmed %lu, received %lu, duplicates %lu\n",
+				static_cast<unsigned long>(published), static_cast<unsigned long>(_republished), static_cast<unsigned long>(confirmed),
+				static_cast<unsigned long>(received), static_cast<unsigned long>(duplicates));
+			printf("lost: confirmed %lu, unconfirmed %lu\n", static_cast<unsigned long>(lost_confirmed), static_cast<unsigned long>(lost_unconfirmed));
+		}
+
+		bool confirmed_lost() const
+		{
+			return this->missing() > 0;
+		}
+
+	private:
+
+		void grow(uint64_t seq)
+		{
+			if(seq >= _confirmed.size()){
+				_confirmed.resize(seq + 1, false);
+				_received.resize(seq + 1, 0);
+			}
+		}
+
+		mutable std::mutex _mutex;
+		std::vector<Fault> _faults;
+		std::vector<bool> _confirmed;
+		std::vector<uint16_t> _received;
+		uint64_t _republished = 0;
+	};
+
+	// Client thread reconnecting until stopped
+	class Client
+	{
+	public:
+
+		Client(const AMQP::Address &address, const Config &config, Journal &journal):
+			_config(config), _journal(journal), _address(address)
+		{
+			// Half-open connections are detected by the silence of the server
+			_handler.set_heartbeat(config.heartbeat);
+		}
+
+		virtual ~Client() = default;
+
+		void start()
+		{
+			_thread = std::thread([this]{ this->run(); });
+		}
+
+		// Close the connection and wait for the thread
+		void stop()
+		{
+			_stop.store(true);
+
+			_handler.post([this]{
+				this->stopping();
+			});
+
+			_thread.join();
+		}
+
+		uint64_t reconnects() const
+		{
+			return _reconnects.load();
+		}
+
+	protected:
+
+		// Set up the channel of a new connection
+		virtual void session(AMQP::TcpChannel &channel) = 0;
+
+		// Connection of the session is lost (not stopped)
+		virtual void lost()
+		{
+
+		}
+
+		// Event loop thread: stop() called
+		virtual void stopping()
+		{
+			this->close();
+		}
+
+		// Event loop thread: close the connection, give up if the broker doesn't answer
+		void close()
+		{
+			if( !_connection ){
+				return;
+			}
+
+			_connection->close();
+			_handler.add_timer(std::chrono::seconds(2), [this]{ _handler.quit(); });
+		}
+
+		bool stopped() const
+		{
+			return _stop.load();
+		}
+
+		// Timers of the handler outlive the session: callbacks check it is still current
+		uint64_t current() const
+		{
+			return _session;
+		}
+
+		MyTcpHandler _handler;
+		const Config &_config;
+		Journal &_journal;
+
+	private:
+
+		void run()
+		{
+			while( !_stop.load() ){
+				AMQP::TcpConnection connection(&_handler, _address);
+				AMQP::TcpChannel channel(&connection);
+
+				const uint64_t session = ++_session;
+				_ready = false;
+
+				// Connection errors are reported to the channel too
+				channel.onError([this](const char *message)
+				{
+					logger.msg(MSG_DEBUG, "fault_test: channel error: %s\n", message);
+					_handler.quit();
+				});
+
+				channel.onReady([this]{ _ready = true; });
+
+				// Connect failures (e.g. refused) don't end the loop by themselves
+				_handler.add_timer(std::chrono::seconds(5), [this, session]
+				{
+					if(session == _session && !_ready) _handler.quit();
+				});
+
+				this->session(channel);
+
+				_connection = &connection;
+				_handler.loop(&connection);
+				_connection = nullptr;
+
+				if(_stop.load()){
+					break;
+				}
+
+				this->lost();
+				++_reconnects;
+				std::this_thread::sleep_for(_config.reconnect_delay);
+			}
+		}
+
+		AMQP::Address _address;
+		AMQP::TcpConnection *_connection = nullptr;
+		uint64_t _session = 0;
+		bool _ready = false;
+		std::atomic<bool> _stop{false};
+		std::atomic<uint64_t> _reconnects{0};
+		std::thread _thread;
+	};
+
+	class Producer : public Client
+	{
+	public:
+
+		Producer(const AMQP::Address &address, const Config &config, Journal &journal):
+			Client(address, config, journal), _body(config.size, 'x'),
+			_interval(std::chrono::duration_cast<steady_clock::duration>(std::chrono::duration<double>(1.0 / config.rate)))
+		{
+
+		}
+
+	protected:
+
+		void session(AMQP::TcpChannel &channel) override
+		{
+			// Delivery tags start over on a new channel
+			_tag = 0;
+
+			channel.confirmSelect()
+				.onSuccess([this, &channel]
+				{
+					_next = steady_clock::now();
+					this->pace(channel, this->current());
+				})
+				.onAck([this](uint64_t deliveryTag, bool multiple)
+				{
+					this->confirmed(deliveryTag, multiple, true);
+				})
+				.onNack([this](uint64_t deliveryTag, bool multiple, bool requeue)
+				{
+					this->confirmed(deliveryTag, multiple, false);
+				});
+		}
+
+		void lost() override
+		{
+			_journal.disconnected();
+
+			// Not confirmed: republished first
+			for(auto &p : _pending){
+				_retry.push_back(p.second.first);
+			}
+
+			_pending.clear();
+		}
+
+		void stopping() override
+		{
+			// Wait for the confirms (pace() closes when they are in)
+			_draining_until = steady_clock::now() + std::chrono::seconds(5);
+		}
+
+	private:
+
+		void pace(AMQP::TcpChannel &channel, uint64_t session)
+		{
+			if(session != this->current()){
+				return;
+			}
+
+			const auto now = steady_clock::now();
+
+			if(this->stopped()){
+				if(_pending.empty() || now > _draining_until){
+					this->close();
+					return;
+				}
+			}
+			else{
+				// Don't catch up with more than a second of backlog after an outage
+				_next = std::max(_next, now - std::chrono::seconds(1));
+
+				while(_next <= now){
+					this->publish(channel);
+					_next += _interval;
+				}
+			}
+
+			_handler.add_timer(std::chrono::milliseconds(1), [this, &channel, session]{ this->pace(channel, session); });
+		}
+
+		void publish(AMQP::TcpChannel &channel)
+		{
+			const bool republished = !_retry.empty();
+			uint64_t seq = 0;
+
+			if(republished){
+				seq = _retry.front();
+				_retry.pop_front();
+			}
+			else{
+				seq = ++_sequence;
+			}
+
+			std::memcpy(&_body[0], &seq, sizeof(seq));
+			channel.publish("", queue, _body.data(), _body.size());
+
+			_pending.emplace(++_tag, std::make_pair(seq, steady_clock::now()));
+			_journal.published(seq, republished);
+		}
+
+		void confirmed(uint64_t deliveryTag, bool multiple, bool ack)
+		{
+			auto first = multiple ? _pending.begin() : _pending.find(deliveryTag);
+			auto last = multiple ? _pending.upper_bound(deliveryTag) : first;
+
+			if( !multiple && last != _pending.end() ){
+				++last;
+			}
+
+			for(auto it = first; it != last; ++it){
+				if(ack){
+					_journal.confirmed(it->second.first, it->second.second);
+				}
+				else{
+					_retry.push_back(it->second.first);
+				}
+			}
+
+			_pending.erase(first, last);
+		}
+
+		std::string _body;
+		steady_clock::duration _interval;
+		steady_clock::time_point _next;
+		steady_clock::time_point _draining_until;
+
+		uint64_t _sequence = 0;
+		uint64_t _tag = 0;
+		std::map<uint64_t, std::pair<uint64_t, steady_clock::time_point>> _pending;	// delivery tag -> sequence, publish time
+		std::deque<uint64_t> _retry;
+	};
+
+	class Consumer : public Client
+	{
+	public:
+
+		using Client::Client;
+
+	protected:
+
+		void session(AMQP::TcpChannel &channel) override
+		{
+			channel.setQos(200);
+			channel.declareQueue(queue);
+			channel.consume(queue).onReceived([this, &channel](const AMQP::Message &message, uint64_t deliveryTag, bool redelivered)
+			{
+				uint64_t seq = 0;
+
+				if(message.bodySize() >= sizeof(seq)){
+					std::memcpy(&seq, message.body(), sizeof(seq));
+					_journal.received(seq);
+				}
+
+				channel.ack(deliveryTag);
+			});
+		}
+	};
+
+	// The queue exists before the producer starts, empty
+	bool setup(const std::string &url)
+	{
+		MyTcpHandler handler;
+		AMQP::TcpConnection connection(&handler, AMQP::Address(url));
+		AMQP::TcpChannel channel(&connection);
+		bool success = true;
+
+		channel.onError([&](const char *message)
+		{
+			logger.msg(MSG_ERROR, "fault_test: %s\n", message);
+			success = false;
+			connection.close();
+		});
+
+		channel.declareQueue(queue);
+		channel.purgeQueue(queue);
+		channel.close().onSuccess([&connection]{ connection.close(); });
+
+		handler.loop(&connection);
+		return success;
+	}
+}
+
+
+int main(int argc, char* argv[])
+{
+	logger.init(MSG_ERROR);
+
+	Config config;
+
+	if( !parse_args(argc, argv, config) ){
+		std::cerr << "Usage: " << argv[0] << " [--url URL] [--rate R] [--size N] [--duration S] [--schedule S] [--period S]"
+			" [--latency MS] [--jitter MS] [--bandwidth BPS] [--consumer-via-proxy] [--reconnect-delay MS] [--heartbeat S]" << std::endl;
+		return 1;
+	}
+
+	std::vector<FaultProxy::Event> schedule;
+
+	try{
+		schedule = FaultProxy::parse_schedule(config.schedule);
+	}
+	catch(const std::exception &e){
+		std::cerr << "--schedule: " << e.what() << std::endl;
+		return 1;
+	}
+
+	std::unique_ptr<LocalBroker> broker;
+
+	if(config.url.empty()){
+		broker = std::make_unique<LocalBroker>();
+		config.url = broker->url();
+	}
+
+	AMQP::Address address(config.url);
+	Journal journal;
+
+	FaultProxy::Options options;
+	options.upstream_host = address.hostname();
+	options.upstream_port = address.port();
+	options.latency = config.latency;
+	options.jitter = config.jitter;
+	options.bandwidth = config.bandwidth;
+	options.on_fault = [&journal](const FaultProxy::Event &event){ journal.fault(event); };
+
+	FaultProxy proxy(options);
+
+	// Credentials and vhost of the broker
+	AMQP::Address proxy_address("127.0.0.1", proxy.port(), address.login(), address.vhost(), address.secure());
+
+	if( !setup(config.url) ){
+		std::cerr << "Can't declare the queue, is the broker running?" << std::endl;
+		return 1;
+	}
+
+	Consumer consumer(config.consumer_via_proxy ? proxy_address : address, config, journal);
+	Producer producer(proxy_address, config, journal);
+
+	consumer.start();
+	producer.start();
+
+	const auto start = steady_clock::now();
+	proxy.schedule(schedule, config.period);
+
+	std::this_thread::sleep_until(start + config.duration);
+
+	producer.stop();
+
+	// Let the consumer get the confirmed messages
+	for(int i = 0; i < 50 && journal.missing(); ++i){
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	}
+
+	consumer.stop();
+
+	journal.report(start);
+
+	const auto stats = proxy.stats();
+	printf("reconnects: producer %lu, consumer %lu; proxy: connections %lu, resets %lu, dropped %lu bytes\n",
+		static_cast<unsigned long>(producer.reconnects()), static_cast<unsigned long>(consumer.reconnects()),
+		static_cast<unsigned long>(stats.connections), static_cast<unsigned long>(stats.resets), static_cast<unsigned long>(stats.bytes_dropped));
+
+	return journal.confirmed_lost() ? 2 : 0;
+}
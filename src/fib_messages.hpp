@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstdint>
+
+#include "binary_codec.hpp"
+
+// Binary messages of Tutorial #6 (rpc_client, rpc_server)
+
+struct FibRequest
+{
+	int32_t n = 0;
+
+	static constexpr auto schema()
+	{
+		return codec::fields(codec::varint(&FibRequest::n));
+	}
+};
+
+struct FibReply
+{
+	int32_t value = 0;
+
+	static constexpr auto schema()
+	{
+		return codec::fields(codec::varint(&FibReply::value));
+	}
+};
@@ -0,0 +1,270 @@
+#include <deque>
+#include <mutex>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <exception>
+
+#include "logger.hpp"
+#include "thread_pool.hpp"
+#include "ack_tracker.hpp"
+#include "keyed_dispatcher.hpp"
+
+
+namespace
+{
+	struct Completion
+	{
+		uint64_t generation;
+		uint64_t delivery_tag;
+		bool success;
+	};
+
+	struct Queued
+	{
+		std::unique_ptr<Delivery> delivery;
+		uint64_t generation;		// of the channel the delivery came from
+	};
+
+	struct Lane
+	{
+		std::mutex mutex;
+		std::deque<Queued> queue;
+		bool scheduled = false;		// lane is drained by a pool thread
+	};
+}
+
+
+struct KeyedDispatcher::Impl : public std::enable_shared_from_this<KeyedDispatcher::Impl>
+{
+	MyTcpHandler &handler;
+	AMQP::Channel *channel;
+	KeyExtractor key;
+	Handler process;
+	Options options;
+
+	std::vector<Lane> lanes;
+
+	// Event loop thread data
+	AckTracker unacked;
+
+	// Channel generation - completions of previous channel are dropped
+	std::atomic<uint64_t> generation{0};
+
+	// Dispatcher is being destroyed - queued deliveries are dropped (broker redelivers them)
+	std::atomic<bool> stopping{false};
+
+	// Completions reported by workers and not yet handled by the event loop
+	std::mutex completed_mutex;
+	std::vector<Completion> completed;
+
+	// Destroyed first: waits for the lanes being drained
+	std::unique_ptr<ThreadPool> pool;
+
+	Impl(MyTcpHandler &h, AMQP::Channel &c, KeyExtractor k, Handler p, const Options &o):
+		handler(h), channel(&c), key(std::move(k)), process(std::move(p)), options(o), 
+		lanes(std::max<size_t>(o.lanes, 1)), pool(new ThreadPool(o.threads))
+	{
+
+	}
+
+	~Impl()
+	{
+		stopping.store(true);
+
+		// Joined before the pointer is released: a lane being drained may reschedule itself
+		pool->shutdown();
+		pool.reset();
+	}
+
+	void dispatch(const AMQP::Message &message, uint64_t deliveryTag, bool redelivered)
+	{
+		const size_t lane_idx = std::hash<std::string>{}(key(message)) % lanes.size();
+
+		unacked.add(deliveryTag);
+		this->enqueue(std::make_unique<Delivery>(message, deliveryTag, redelivered), lane_idx);
+	}
+
+	void enqueue(std::unique_ptr<Delivery> delivery, size_t lane_idx)
+	{
+		Lane &lane = lanes[lane_idx];
+
+		{
+			std::lock_guard<std::mutex> lock(lane.mutex);
+			lane.queue.push_back(Queued{std::move(delivery), generation.load()});
+
+			if(lane.scheduled){
+				return;
+			}
+
+			lane.scheduled = true;
+		}
+
+		this->schedule(lane_idx);
+	}
+
+	void schedule(size_t lane_idx)
+	{
+		// Pool is owned by Impl, so raw pointer is valid while the task runs
+		pool->submit([this, lane_idx]{ this->drain(lane_idx); });
+	}
+
+	// Pool thread: process up to lane_batch deliveries of the lane in order
+	void drain(size_t lane_idx)
+	{
+		Lane &lane = lanes[lane_idx];
+
+		for(size_t n = 0; ; ++n){
+			Queued queued;
+
+			{
+				std::lock_guard<std::mutex> lock(lane.mutex);
+
+				if(lane.queue.empty() || stopping.load()){
+					lane.queue.clear();
+					lane.scheduled = false;
+					return;
+				}
+
+				if(n == options.lane_batch){
+					// Give other lanes a chance, lane stays scheduled
+					break;
+				}
+
+				queued = std::move(lane.queue.front());
+				lane.queue.pop_front();
+			}
+
+			bool success = false;
+
+			try{
+				success = process(*queued.delivery);
+			}
+			catch(const std::exception &e){
+				logger.msg(MSG_ERROR, "KeyedDispatcher: handler exception: %s\n", e.what());
+			}
+
+			// Generation of the dispatch: the tag means nothing to a channel set by reset() since
+			this->complete(Completion{queued.generation, queued.delivery->delivery_tag, success});
+		}
+
+		this->schedule(lane_idx);
+	}
+
+	// Pool thread: report processed delivery to the event loop
+	void complete(const Completion &completion)
+	{
+		bool was_empty = false;
+
+		{
+			std::lock_guard<std::mutex> lock(completed_mutex);
+			was_empty = completed.empty();
+			completed.push_back(completion);
+		}
+
+		if( !was_empty ){
+			// settle() is already posted and will take this one too
+			return;
+		}
+
+		// Empty while Impl is being destroyed
+		std::weak_ptr<Impl> weak = this->weak_from_this();
+
+		handler.post([weak]{
+			if(auto self = weak.lock()){
+				self->settle();
+			}
+		});
+	}
+
+	// Event loop thread: ack or reject the processed prefix of deliveries
+	void settle()
+	{
+		std::vector<Completion> batch;
+
+		{
+			std::lock_guard<std::mutex> lock(completed_mutex);
+			batch.swap(completed);
+		}
+
+		const uint64_t current = generation.load();
+
+		for(const auto &c : batch){
+			if(c.generation == current){
+				unacked.complete(c.delivery_tag, c.success);
+			}
+		}
+
+		unacked.settle(*channel, options.requeue_failed ? AMQP::requeue : 0);
+	}
+};
+
+
+KeyedDispatcher::KeyedDispatcher(MyTcpHandler &handler, AMQP::Channel &channel, KeyExtractor key, Handler process):
+	KeyedDispatcher(handler, channel, std::move(key), std::move(process), Options())
+{
+
+}
+
+KeyedDispatcher::KeyedDispatcher(MyTcpHandler &handler, AMQP::Channel &channel, KeyExtractor key, Handler process, const Options &options):
+	pimpl(std::make_shared<Impl>(handler, channel, std::move(key), std::move(process), options))
+{
+
+}
+
+KeyedDispatcher::~KeyedDispatcher() = default;
+
+AMQP::DeferredConsumer& KeyedDispatcher::consume(const std::string &queue)
+{
+	// Channel may outlive the dispatcher: later deliveries are left unacked
+	std::weak_ptr<Impl> weak = pimpl;
+
+	return pimpl->channel->consume(queue).onReceived(
+		[weak](const AMQP::Message &message, uint64_t deliveryTag, bool redelivered)
+		{
+			if(auto self = weak.lock()){
+				self->dispatch(message, deliveryTag, redelivered);
+			}
+		}
+	);
+}
+
+void KeyedDispatcher::dispatch(const AMQP::Message &message, uint64_t deliveryTag, bool redelivered)
+{
+	pimpl->dispatch(message, deliveryTag, redelivered);
+}
+
+void KeyedDispatcher::reset(AMQP::Channel &channel)
+{
+	++pimpl->generation;
+	pimpl->unacked.clear();
+	pimpl->channel = &channel;
+}
+
+size_t KeyedDispatcher::unacked() const
+{
+	return pimpl->unacked.size();
+}
+
+std::string KeyedDispatcher::by_routingkey(const AMQP::Message &message)
+{
+	return message.routingkey();
+}
+
+KeyedDispatcher::KeyExtractor KeyedDispatcher::by_header(const std::string &name)
+{
+	return [name](const AMQP::Message &message) -> std::string
+	{
+		if( !message.hasHeaders() || !message.headers().contains(name) ){
+			return std::string();
+		}
+
+		const AMQP::Field &field = message.headers().get(name);
+
+		if(field.isString()){
+			return static_cast<const std::string&>(field);
+		}
+
+		return std::to_string(static_cast<int64_t>(field));
+	};
+}
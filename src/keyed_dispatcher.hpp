@@ -0,0 +1,81 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <functional>
+#include <thread>
+
+#include <amqpcpp.h>
+
+#include "delivery.hpp"
+#include "my_handler.hpp"
+
+/*
+	Key-ordered parallel consumer.
+
+	Deliveries are sharded by key (routing key, header value, ...) into serial 
+	lanes. Messages with the same key are processed one by one in the order of 
+	arrival, while different lanes are processed in parallel on a thread pool.
+
+	Acknowledgements are sent on the event loop thread. The dispatcher acks the 
+	longest contiguous prefix of processed deliveries with a single 'multiple' ack,
+	so it never acknowledges past a message which is still being processed.
+
+	Watch out: 'multiple' ack covers every delivery of the channel, so use a
+	dedicated channel for the dispatcher. Channel prefetch (setQos) bounds the 
+	number of messages in flight and should be larger than the number of threads.
+*/
+
+class KeyedDispatcher
+{
+public:
+
+	// Extracts ordering key from a message
+	using KeyExtractor = std::function<std::string(const AMQP::Message &message)>;
+
+	// Processes delivery on a worker thread. Returning false (or throwing) rejects the message.
+	using Handler = std::function<bool(const Delivery &delivery)>;
+
+	struct Options
+	{
+		size_t threads = std::thread::hardware_concurrency();
+		size_t lanes = 64;				// number of serial lanes keys are hashed to
+		size_t lane_batch = 16;			// deliveries processed by a lane before yielding a thread
+		bool requeue_failed = false;	// reject failed messages with requeue flag
+	};
+
+	KeyedDispatcher(MyTcpHandler &handler, AMQP::Channel &channel, KeyExtractor key, Handler process);
+	KeyedDispatcher(MyTcpHandler &handler, AMQP::Channel &channel, KeyExtractor key, Handler process, const Options &options);
+
+	// Waits for the deliveries being processed. Their acks are dropped.
+	~KeyedDispatcher();
+
+	/**
+	 *  Start consuming a queue with manual acks and dispatch deliveries to the lanes.
+	 *  @param  queue           Name of the queue to consume
+	 *  @return                 Deferred consumer to install other callbacks (onSuccess, onError)
+	 */
+	AMQP::DeferredConsumer& consume(const std::string &queue);
+
+	/**
+	 *  Dispatch a message to its lane. Can be used from a custom onReceived() 
+	 *  callback. Must be called on the event loop thread.
+	 */
+	void dispatch(const AMQP::Message &message, uint64_t deliveryTag, bool redelivered);
+
+	// Forget unacked deliveries, e.g. after the channel was recreated on reconnection.
+	// Delivery tags start from 1 on a new channel, so pending state can't be reused.
+	void reset(AMQP::Channel &channel);
+
+	// Number of dispatched but not yet acked (or rejected) deliveries
+	size_t unacked() const;
+
+	// Ready to use key extractors
+	static std::string by_routingkey(const AMQP::Message &message);
+	static KeyExtractor by_header(const std::string &name);
+
+private:
+
+	struct Impl;
+	std::shared_ptr<Impl> pimpl;
+};
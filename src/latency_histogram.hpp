@@ -0,0 +1,140 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <algorithm>
+#include <limits>
+#include <cstdint>
+
+/*
+	Latency histogram in the spirit of HdrHistogram.
+
+	Values (nanoseconds) are counted in log-linear buckets: every power of
+	two range is split into 64 linear sub-buckets, so any recorded value is
+	reported with relative error below 1/64 (~1.6%) over the whole uint64
+	range, with a fixed 30 KB of counters and O(1) record().
+
+	Not thread-safe: use one histogram per thread and merge() them.
+*/
+
+class LatencyHistogram
+{
+public:
+
+	void record(uint64_t value)
+	{
+		++_counts[index(value)];
+		++_count;
+		_sum += value;
+		_min = std::min(_min, value);
+		_max = std::max(_max, value);
+	}
+
+	void record(std::chrono::nanoseconds value)
+	{
+		this->record(static_cast<uint64_t>(std::max<int64_t>(value.count(), 0)));
+	}
+
+	/**
+	 *  Value at percentile
+	 *  @param  percentile      0 .. 100
+	 *  @return uint64_t        Highest value equivalent to the bucket of the percentile (0 if empty)
+	 */
+	uint64_t percentile(double percentile) const
+	{
+		if( !_count ){
+			return 0;
+		}
+
+		percentile = std::min(std::max(percentile, 0.0), 100.0);
+
+		// Rank of the value, 1-based
+		uint64_t rank = static_cast<uint64_t>(percentile / 100 * _count + 0.5);
+		rank = std::min(std::max<uint64_t>(rank, 1), _count);
+
+		uint64_t seen = 0;
+
+		for(size_t i = 0; i < bucket_count; ++i){
+			seen += _counts[i];
+
+			if(seen >= rank){
+				return std::min(highest(i), _max);
+			}
+		}
+
+		return _max;
+	}
+
+	void merge(const LatencyHistogram &other)
+	{
+		for(size_t i = 0; i < bucket_count; ++i){
+			_counts[i] += other._counts[i];
+		}
+
+		_count += other._count;
+		_sum += other._sum;
+		_min = std::min(_min, other._min);
+		_max = std::max(_max, other._max);
+	}
+
+	void reset()
+	{
+		*this = LatencyHistogram();
+	}
+
+	uint64_t count() const
+	{
+		return _count;
+	}
+
+	uint64_t min() const
+	{
+		return _count ? _min : 0;
+	}
+
+	uint64_t max() const
+	{
+		return _max;
+	}
+
+	double mean() const
+	{
+		return _count ? static_cast<double>(_sum) / _count : 0;
+	}
+
+private:
+
+	static constexpr unsigned sub_bits = 6;
+	static constexpr uint64_t sub_half = uint64_t(1) << sub_bits;		// linear sub-buckets per power of two
+	static constexpr size_t bucket_count = (64 - sub_bits) * sub_half + sub_half;
+
+	// Values below 2 * sub_half are counted exactly, others by their top sub_bits + 1 bits
+	static size_t index(uint64_t value)
+	{
+		if(value < 2 * sub_half){
+			return static_cast<size_t>(value);
+		}
+
+		const unsigned msb = 63 - __builtin_clzll(value);
+		const unsigned shift = msb - sub_bits;
+		return static_cast<size_t>(shift * sub_half + (value >> shift));
+	}
+
+	// Highest value counted in the bucket
+	static uint64_t highest(size_t index)
+	{
+		if(index < 2 * sub_half){
+			return index;
+		}
+
+		const unsigned shift = static_cast<unsigned>(index / sub_half - 1);
+		const uint64_t sub = index - shift * sub_half;
+		return ((sub + 1) << shift) - 1;
+	}
+
+	std::array<uint64_t, bucket_count> _counts{};
+	uint64_t _count = 0;
+	uint64_t _sum = 0;
+	uint64_t _min = std::numeric_limits<uint64_t>::max();
+	uint64_t _max = 0;
+};
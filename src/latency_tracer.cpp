@@ -0,0 +1,199 @@
+#include <mutex>
+#include <chrono>
+
+#include "latency_tracer.hpp"
+
+
+struct LatencyTracer::Impl
+{
+	Options options;
+
+	mutable std::mutex mutex;
+	Stats stats;
+
+	// Receive time of the deliveries waiting for ack
+	std::map<uint64_t, int64_t> pending;
+
+	explicit Impl(const Options &o): options(o)
+	{
+
+	}
+
+	// Headers of the envelope with the value set
+	static void set_header(AMQP::Envelope &envelope, const std::string &name, int64_t value)
+	{
+		AMQP::Table headers;
+
+		if(envelope.hasHeaders()){
+			headers = envelope.headers();
+		}
+
+		headers.set(name, AMQP::LongLong(value));
+		envelope.setHeaders(headers);
+	}
+
+	void record(uint64_t deliveryTag, int64_t received)
+	{
+		auto it = pending.find(deliveryTag);
+
+		if(it == pending.end()){
+			return;
+		}
+
+		stats.processing.record(std::chrono::nanoseconds(received - it->second));
+		++stats.acked;
+		pending.erase(it);
+	}
+};
+
+
+LatencyTracer::LatencyTracer(): LatencyTracer(Options())
+{
+
+}
+
+LatencyTracer::LatencyTracer(const Options &options): pimpl(std::make_shared<Impl>(options))
+{
+
+}
+
+LatencyTracer::~LatencyTracer() = default;
+
+int64_t LatencyTracer::now()
+{
+	using namespace std::chrono;
+	return duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+}
+
+void LatencyTracer::stamp(AMQP::Envelope &envelope)
+{
+	Impl::set_header(envelope, pimpl->options.sent_header, LatencyTracer::now());
+
+	std::lock_guard<std::mutex> lock(pimpl->mutex);
+	++pimpl->stats.stamped;
+}
+
+bool LatencyTracer::forward(const AMQP::Table &received, AMQP::Envelope &envelope, const std::string &hop)
+{
+	const Options &opt = pimpl->options;
+
+	if( !received.contains(opt.sent_header) ){
+		return false;
+	}
+
+	AMQP::Table headers;
+
+	if(envelope.hasHeaders()){
+		headers = envelope.headers();
+	}
+
+	// Send time and the hops passed so far
+	for(const auto &key : received.keys()){
+		if(key == opt.sent_header || key.compare(0, opt.hop_prefix.size(), opt.hop_prefix) == 0){
+			headers.set(key, AMQP::LongLong(static_cast<int64_t>(received.get(key))));
+		}
+	}
+
+	if( !hop.empty() ){
+		headers.set(opt.hop_prefix + hop, AMQP::LongLong(LatencyTracer::now()));
+	}
+
+	envelope.setHeaders(headers);
+
+	std::lock_guard<std::mutex> lock(pimpl->mutex);
+	++pimpl->stats.stamped;
+	return true;
+}
+
+int64_t LatencyTracer::received(const AMQP::MetaData &message)
+{
+	const int64_t now = LatencyTracer::now();
+	const Options &opt = pimpl->options;
+
+	std::lock_guard<std::mutex> lock(pimpl->mutex);
+
+	if( !message.hasHeaders() || !message.headers().contains(opt.sent_header) ){
+		++pimpl->stats.untraced;
+		return 0;
+	}
+
+	const AMQP::Table &headers = message.headers();
+	const int64_t sent = headers.get(opt.sent_header);
+
+	pimpl->stats.transit.record(std::chrono::nanoseconds(now - sent));
+	++pimpl->stats.received;
+
+	for(const auto &key : headers.keys()){
+		if(key.size() > opt.hop_prefix.size() && key.compare(0, opt.hop_prefix.size(), opt.hop_prefix) == 0){
+			const int64_t at = headers.get(key);
+			pimpl->stats.hops[key.substr(opt.hop_prefix.size())].record(std::chrono::nanoseconds(at - sent));
+		}
+	}
+
+	return now;
+}
+
+int64_t LatencyTracer::received(const AMQP::MetaData &message, uint64_t deliveryTag)
+{
+	const int64_t now = this->received(message);
+
+	if( !now ){
+		return 0;
+	}
+
+	std::lock_guard<std::mutex> lock(pimpl->mutex);
+	auto &pending = pimpl->pending;
+
+	pending[deliveryTag] = now;
+
+	if(pending.size() > pimpl->options.max_pending){
+		pending.erase(pending.begin());
+	}
+
+	return now;
+}
+
+void LatencyTracer::acked(uint64_t deliveryTag, bool multiple)
+{
+	const int64_t now = LatencyTracer::now();
+
+	std::lock_guard<std::mutex> lock(pimpl->mutex);
+
+	if( !multiple ){
+		pimpl->record(deliveryTag, now);
+		return;
+	}
+
+	auto &pending = pimpl->pending;
+
+	while( !pending.empty() && pending.begin()->first <= deliveryTag ){
+		pimpl->record(pending.begin()->first, now);
+	}
+}
+
+AMQP::MessageCallback LatencyTracer::wrap(AMQP::MessageCallback callback)
+{
+	return [this, callback = std::move(callback)](const AMQP::Message &message, uint64_t deliveryTag, bool redelivered)
+	{
+		this->received(message, deliveryTag);
+		callback(message, deliveryTag, redelivered);
+	};
+}
+
+void LatencyTracer::clear()
+{
+	std::lock_guard<std::mutex> lock(pimpl->mutex);
+	pimpl->pending.clear();
+}
+
+LatencyTracer::Stats LatencyTracer::stats() const
+{
+	std::lock_guard<std::mutex> lock(pimpl->mutex);
+	return pimpl->stats;
+}
+
+void LatencyTracer::reset()
+{
+	std::lock_guard<std::mutex> lock(pimpl->mutex);
+	pimpl->stats = Stats();
+}
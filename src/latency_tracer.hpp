@@ -0,0 +1,126 @@
+#pragma once
+
+#include <string>
+#include <map>
+#include <memory>
+#include <cstdint>
+
+#include <amqpcpp.h>
+
+#include "latency_histogram.hpp"
+
+/*
+	End-to-end latency tracing with timestamp headers (opt-in).
+
+	Publisher stamps messages with the send time, relays (e.g. an RPC server
+	replying to a request) carry the trace over to the messages they publish
+	and add their own hop timestamp. Consumers record:
+
+	* transit     receive time - send time
+	* hops        hop time - send time, per hop name
+	* processing  ack time - receive time (consumers with manual acks)
+
+	Timestamps are nanoseconds of the unix epoch (system clock), so the
+	latencies between hosts include their clock offset - sync the clocks
+	(PTP, chrony) or trace within one host.
+
+	Headers (LongLong):
+		x-trace-sent            send time
+		x-trace-hop-<name>      time the message passed the hop
+
+	Delivery tags of a channel are remembered between received() and acked(),
+	use one tracer per consumer channel. Thread-safe.
+
+	Usage:
+		auto tracer = std::make_shared<LatencyTracer>();
+
+		AMQP::Envelope env(body.data(), body.size());
+		tracer->stamp(env);
+		channel.publish("", "queue", env);
+		...
+		channel.consume("queue").onReceived(tracer->wrap([&](const AMQP::Message &m, uint64_t tag, bool){
+			...
+			channel.ack(tag);
+			tracer->acked(tag);
+		}));
+*/
+
+class LatencyTracer
+{
+public:
+
+	struct Options
+	{
+		std::string sent_header = "x-trace-sent";
+		std::string hop_prefix = "x-trace-hop-";	// followed by the hop name
+		size_t max_pending = 65536;				// received, not yet acked deliveries (oldest are forgotten)
+	};
+
+	struct Stats
+	{
+		uint64_t stamped = 0;			// messages stamped by stamp() and forward()
+		uint64_t received = 0;			// traced messages received
+		uint64_t untraced = 0;			// received messages without the send time
+		uint64_t acked = 0;
+
+		// Nanoseconds
+		LatencyHistogram transit;
+		LatencyHistogram processing;
+		std::map<std::string, LatencyHistogram> hops;
+	};
+
+	LatencyTracer();
+	explicit LatencyTracer(const Options &options);
+	~LatencyTracer();
+
+	// Current time of the traces, ns of the unix epoch
+	static int64_t now();
+
+	// Set the send time header (other headers of the envelope are kept)
+	void stamp(AMQP::Envelope &envelope);
+
+	/**
+	 *  Carry the trace of a received message over to a message published on its behalf
+	 *  @param  received        Headers of the received message
+	 *  @param  envelope        Message to publish
+	 *  @param  hop             Hop name, empty - no hop timestamp
+	 *  @return bool            False if the received message is not traced (envelope is not changed)
+	 */
+	bool forward(const AMQP::Table &received, AMQP::Envelope &envelope, const std::string &hop);
+
+	/**
+	 *  Record transit and hop latencies of a received message
+	 *  @param  message         Message metadata
+	 *  @return int64_t         Receive time, 0 if the message is not traced
+	 */
+	int64_t received(const AMQP::MetaData &message);
+
+	/**
+	 *  Same as above, the delivery is remembered for acked()
+	 *  @param  deliveryTag     Delivery tag of the message
+	 */
+	int64_t received(const AMQP::MetaData &message, uint64_t deliveryTag);
+
+	/**
+	 *  Record processing latency of acked deliveries. Unknown tags are ignored.
+	 *  @param  deliveryTag     Delivery tag
+	 *  @param  multiple        Tag and all the earlier deliveries are acked
+	 */
+	void acked(uint64_t deliveryTag, bool multiple = false);
+
+	// onReceived() callback calling received(message, deliveryTag) first
+	AMQP::MessageCallback wrap(AMQP::MessageCallback callback);
+
+	// Forget remembered deliveries, e.g. when channel is recreated
+	void clear();
+
+	Stats stats() const;
+
+	// Reset the counters and histograms
+	void reset();
+
+private:
+
+	struct Impl;
+	std::shared_ptr<Impl> pimpl;
+};
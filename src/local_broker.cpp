@@ -0,0 +1,2095 @@
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <map>
+#include <unordered_map>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <system_error>
+#include <cstring>
+#include <cerrno>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "logger.hpp"
+#include "local_broker.hpp"
+
+
+namespace
+{
+	using steady_clock = std::chrono::steady_clock;
+
+	// Frame types
+	const uint8_t FRAME_METHOD = 1;
+	const uint8_t FRAME_HEADER = 2;
+	const uint8_t FRAME_BODY = 3;
+	const uint8_t FRAME_HEARTBEAT = 8;
+	const uint8_t FRAME_END = 0xCE;
+
+	// Class IDs
+	const uint16_t CONNECTION = 10;
+	const uint16_t CHANNEL = 20;
+	const uint16_t EXCHANGE = 40;
+	const uint16_t QUEUE = 50;
+	const uint16_t BASIC = 60;
+	const uint16_t CONFIRM = 85;
+
+	// Reply codes
+	const uint16_t NO_ROUTE = 312;
+	const uint16_t ACCESS_REFUSED = 403;
+	const uint16_t NOT_FOUND = 404;
+	const uint16_t RESOURCE_LOCKED = 405;
+	const uint16_t PRECONDITION_FAILED = 406;
+	const uint16_t FRAME_ERROR = 501;
+	const uint16_t SYNTAX_ERROR = 502;
+	const uint16_t COMMAND_INVALID = 503;
+	const uint16_t CHANNEL_ERROR = 504;
+	const uint16_t UNEXPECTED_FRAME = 505;
+	const uint16_t NOT_ALLOWED = 530;
+	const uint16_t NOT_IMPLEMENTED = 540;
+
+	const char PROTOCOL_HEADER[8] = {'A', 'M', 'Q', 'P', 0, 0, 9, 1};
+	const std::string REPLY_TO = "amq.rabbitmq.reply-to";
+
+	// Property flags of basic content header
+	const uint16_t PROP_CONTENT_TYPE = 1 << 15;
+	const uint16_t PROP_CONTENT_ENCODING = 1 << 14;
+	const uint16_t PROP_HEADERS = 1 << 13;
+	const uint16_t PROP_DELIVERY_MODE = 1 << 12;
+	const uint16_t PROP_PRIORITY = 1 << 11;
+	const uint16_t PROP_CORRELATION_ID = 1 << 10;
+	const uint16_t PROP_REPLY_TO = 1 << 9;
+	const uint16_t PROP_EXPIRATION = 1 << 8;
+
+	// Protocol violation: closes the channel (or the connection if connection_level)
+	struct ProtocolError
+	{
+		uint16_t code;
+		std::string text;
+		bool connection_level;
+	};
+
+	[[noreturn]] void channel_error(uint16_t code, const std::string &text)
+	{
+		throw ProtocolError{code, text, false};
+	}
+
+	[[noreturn]] void connection_error(uint16_t code, const std::string &text)
+	{
+		throw ProtocolError{code, text, true};
+	}
+
+
+	// Big-endian reader of frame payloads, throws on truncated data
+	class Decoder
+	{
+	public:
+
+		Decoder(const char *data, size_t size): _pos(reinterpret_cast<const uint8_t *>(data)), _end(_pos + size)
+		{
+
+		}
+
+		uint8_t octet()
+		{
+			this->need(1);
+			return *_pos++;
+		}
+
+		uint16_t short_()
+		{
+			this->need(2);
+			uint16_t v = (uint16_t(_pos[0]) << 8) | _pos[1];
+			_pos += 2;
+			return v;
+		}
+
+		uint32_t long_()
+		{
+			this->need(4);
+			uint32_t v = (uint32_t(_pos[0]) << 24) | (uint32_t(_pos[1]) << 16) | (uint32_t(_pos[2]) << 8) | _pos[3];
+			_pos += 4;
+			return v;
+		}
+
+		uint64_t longlong()
+		{
+			uint64_t hi = this->long_();
+			return (hi << 32) | this->long_();
+		}
+
+		std::string_view shortstr()
+		{
+			const uint8_t size = this->octet();
+			return this->bytes(size);
+		}
+
+		std::string_view longstr()
+		{
+			const uint32_t size = this->long_();
+			return this->bytes(size);
+		}
+
+		// Field tables are not interpreted, only skipped
+		void table()
+		{
+			this->longstr();
+		}
+
+		std::string_view bytes(size_t size)
+		{
+			this->need(size);
+			std::string_view res(reinterpret_cast<const char *>(_pos), size);
+			_pos += size;
+			return res;
+		}
+
+		size_t left() const
+		{
+			return _end - _pos;
+		}
+
+	private:
+
+		void need(size_t size)
+		{
+			if(static_cast<size_t>(_end - _pos) < size){
+				connection_error(SYNTAX_ERROR, "SYNTAX_ERROR - truncated frame");
+			}
+		}
+
+		const uint8_t *_pos;
+		const uint8_t *_end;
+	};
+
+
+	// Big-endian writer appending to the output buffer
+	class Encoder
+	{
+	public:
+
+		explicit Encoder(std::string &out): _out(out)
+		{
+
+		}
+
+		Encoder &octet(uint8_t v)
+		{
+			_out.push_back(static_cast<char>(v));
+			return *this;
+		}
+
+		Encoder &short_(uint16_t v)
+		{
+			char buf[2] = {char(v >> 8), char(v)};
+			_out.append(buf, 2);
+			return *this;
+		}
+
+		Encoder &long_(uint32_t v)
+		{
+			char buf[4] = {char(v >> 24), char(v >> 16), char(v >> 8), char(v)};
+			_out.append(buf, 4);
+			return *this;
+		}
+
+		Encoder &longlong(uint64_t v)
+		{
+			return this->long_(uint32_t(v >> 32)).long_(uint32_t(v));
+		}
+
+		Encoder &shortstr(std::string_view s)
+		{
+			const size_t size = std::min<size_t>(s.size(), 255);
+			this->octet(static_cast<uint8_t>(size));
+			_out.append(s.data(), size);
+			return *this;
+		}
+
+		Encoder &longstr(std::string_view s)
+		{
+			this->long_(static_cast<uint32_t>(s.size()));
+			_out.append(s.data(), s.size());
+			return *this;
+		}
+
+		Encoder &bytes(std::string_view s)
+		{
+			_out.append(s.data(), s.size());
+			return *this;
+		}
+
+		// Frame with the size patched by end()
+		Encoder &begin(uint8_t type, uint16_t channel)
+		{
+			this->octet(type).short_(channel);
+			_frame = _out.size();
+			return this->long_(0);
+		}
+
+		Encoder &method(uint16_t channel, uint16_t class_id, uint16_t method_id)
+		{
+			return this->begin(FRAME_METHOD, channel).short_(class_id).short_(method_id);
+		}
+
+		void end()
+		{
+			const uint32_t size = static_cast<uint32_t>(_out.size() - _frame - 4);
+			char buf[4] = {char(size >> 24), char(size >> 16), char(size >> 8), char(size)};
+			_out.replace(_frame, 4, buf, 4);
+			_out.push_back(static_cast<char>(FRAME_END));
+		}
+
+	private:
+		std::string &_out;
+		size_t _frame = 0;
+	};
+
+	// Table with a single nested 'capabilities' table of true booleans
+	std::string server_properties()
+	{
+		std::string caps;
+		Encoder c(caps);
+
+		for(const char *cap : {"publisher_confirms", "basic.nack", "consumer_cancel_notify", "per_consumer_qos", "direct_reply_to"}){
+			c.shortstr(cap).octet('t').octet(1);
+		}
+
+		std::string props;
+		Encoder p(props);
+		p.shortstr("product").octet('S').longstr("LocalBroker");
+		p.shortstr("capabilities").octet('F').longstr(caps);
+		return props;
+	}
+
+	bool topic_match(std::string_view pattern, std::string_view key)
+	{
+		// Words of the pattern against words of the key, '#' matches zero or more words
+		size_t p = 0;
+		size_t k = 0;
+
+		auto word = [](std::string_view s, size_t pos)
+		{
+			const size_t end = s.find('.', pos);
+			return s.substr(pos, end == std::string_view::npos ? std::string_view::npos : end - pos);
+		};
+
+		while(p <= pattern.size()){
+			const std::string_view pw = word(pattern, p);
+			const size_t next_p = p + pw.size() + 1;
+
+			if(pw == "#"){
+				if(next_p > pattern.size()){
+					return true;
+				}
+
+				// Try to match the rest of the pattern at every word boundary of the key
+				for(size_t pos = k; pos <= key.size(); ){
+					if(topic_match(pattern.substr(next_p), key.substr(pos))){
+						return true;
+					}
+
+					const size_t dot = key.find('.', pos);
+
+					if(dot == std::string_view::npos){
+						break;
+					}
+
+					pos = dot + 1;
+				}
+
+				return false;
+			}
+
+			if(k > key.size()){
+				return false;
+			}
+
+			const std::string_view kw = word(key, k);
+
+			if(pw != "*" && pw != kw){
+				return false;
+			}
+
+			p = next_p;
+			k += kw.size() + 1;
+		}
+
+		return k > key.size();
+	}
+
+
+	struct Message
+	{
+		std::string exchange;
+		std::string routingkey;
+		std::string properties;				// property flags and the property list, as received
+		std::string body;
+		steady_clock::time_point expires = steady_clock::time_point::max();
+	};
+
+	struct Queued
+	{
+		std::shared_ptr<const Message> message;
+		bool redelivered = false;
+	};
+
+	struct Connection;
+	struct Channel;
+	struct Queue;
+
+	struct Consumer
+	{
+		Channel *channel;
+		std::string tag;
+		std::weak_ptr<Queue> queue;
+		bool no_ack = false;
+		uint16_t prefetch = 0;				// 0 - unlimited
+		uint32_t unacked = 0;
+		bool cancelled = false;
+	};
+
+	struct Queue
+	{
+		std::string name;
+		bool exclusive = false;
+		bool auto_delete = false;
+		Connection *owner = nullptr;		// exclusive queues
+
+		std::deque<Queued> messages;
+		std::vector<std::shared_ptr<Consumer>> consumers;
+		size_t next_consumer = 0;
+		bool exclusive_consumer = false;
+		bool had_consumers = false;
+		bool dirty = false;					// waiting for dispatch
+		bool deleted = false;
+	};
+
+	struct Binding
+	{
+		std::weak_ptr<Queue> queue;
+		std::string key;
+	};
+
+	enum class ExchangeType { DIRECT, FANOUT, TOPIC };
+
+	struct Exchange
+	{
+		std::string name;
+		ExchangeType type;
+		std::vector<Binding> bindings;
+	};
+
+	struct Unacked
+	{
+		uint64_t tag;
+		std::weak_ptr<Queue> queue;
+		std::shared_ptr<const Message> message;
+		std::shared_ptr<Consumer> consumer;		// nullptr for basic.get
+		bool settled = false;
+	};
+
+	struct Publishing
+	{
+		std::string exchange;
+		std::string routingkey;
+		bool mandatory = false;
+		bool header = false;				// content header received
+		uint64_t size = 0;
+		std::shared_ptr<Message> message;
+	};
+
+	struct Channel
+	{
+		uint16_t id;
+		Connection *connection;
+		bool closing = false;				// Channel.Close sent, waiting for Close-Ok
+
+		std::unordered_map<std::string, std::shared_ptr<Consumer>> consumers;
+		uint16_t consumer_prefetch = 0;		// basic.qos global=false
+		uint16_t prefetch = 0;				// basic.qos global=true
+		bool flow = true;
+
+		uint64_t next_tag = 0;
+		std::deque<Unacked> unacked;		// by delivery tag
+		uint32_t unacked_count = 0;
+
+		bool confirm = false;
+		uint64_t published = 0;
+		uint64_t confirmed = 0;				// confirms sent up to
+
+		std::string reply_consumer;			// direct reply-to consumer tag
+		Publishing publishing;
+		bool in_publish = false;
+	};
+
+	struct Connection
+	{
+		int fd;
+		uint64_t id;
+
+		std::string in;
+		size_t in_pos = 0;
+		std::string out;
+		size_t out_pos = 0;
+		bool epollout = false;
+
+		bool header = false;				// protocol header received
+		bool closing = false;				// Connection.Close sent
+		bool dead = false;					// to be closed at the end of the loop iteration
+
+		uint32_t frame_max = 131072;
+		uint16_t channel_max = 2047;
+		uint16_t heartbeat = 0;
+		steady_clock::time_point last_read;
+		steady_clock::time_point last_write;
+
+		std::map<uint16_t, std::unique_ptr<Channel>> channels;
+	};
+}
+
+
+struct LocalBroker::Impl
+{
+	Options options;
+
+	int listen_fd = -1;
+	int epoll_fd = -1;
+	int wakeup_fd = -1;
+	uint16_t port = 0;
+
+	std::thread thread;
+	std::atomic<bool> stop{false};
+
+	std::mutex adopt_mutex;
+	std::vector<int> adopted;
+
+	// Broker thread data
+	uint64_t next_connection = 0;
+	uint64_t next_name = 0;
+	std::unordered_map<int, std::unique_ptr<Connection>> connections;
+	std::unordered_map<uint64_t, Connection *> by_id;
+	std::unordered_map<std::string, std::shared_ptr<Queue>> queues;
+	std::unordered_map<std::string, Exchange> exchanges;
+	std::vector<std::shared_ptr<Queue>> dirty;
+
+	// Stats, written by the broker thread
+	struct
+	{
+		std::atomic<uint64_t> connections{0}, channels{0}, queues{0}, published{0}, routed{0}, unroutable{0},
+			delivered{0}, acked{0}, requeued{0}, expired{0};
+	} counters;
+
+	Impl(const Options &o): options(o)
+	{
+		if(options.frame_max < 4096){
+			options.frame_max = 4096;
+		}
+
+		for(auto type : {std::make_pair("amq.direct", ExchangeType::DIRECT), std::make_pair("amq.fanout", ExchangeType::FANOUT), std::make_pair("amq.topic", ExchangeType::TOPIC)}){
+			exchanges[type.first] = Exchange{type.first, type.second, {}};
+		}
+	}
+
+	~Impl()
+	{
+		for(auto &c : connections){
+			::close(c.first);
+		}
+
+		for(int fd : adopted){
+			::close(fd);
+		}
+
+		if(listen_fd > -1) ::close(listen_fd);
+		if(wakeup_fd > -1) ::close(wakeup_fd);
+		if(epoll_fd > -1) ::close(epoll_fd);
+	}
+
+	void listen()
+	{
+		epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+		if(epoll_fd < 0 || wakeup_fd < 0){
+			throw std::system_error(errno, std::generic_category(), "LocalBroker: epoll/eventfd");
+		}
+
+		this->watch(wakeup_fd, EPOLLIN);
+
+		addrinfo hints{};
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+
+		addrinfo *res = nullptr;
+		const std::string service = std::to_string(options.port);
+
+		if(getaddrinfo(options.host.c_str(), service.c_str(), &hints, &res) != 0 || !res){
+			throw std::system_error(EINVAL, std::generic_category(), "LocalBroker: can't resolve " + options.host);
+		}
+
+		listen_fd = socket(res->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+		int on = 1;
+		setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+		if(listen_fd < 0 || bind(listen_fd, res->ai_addr, res->ai_addrlen) < 0 || ::listen(listen_fd, 128) < 0){
+			const int err = errno;
+			freeaddrinfo(res);
+			throw std::system_error(err, std::generic_category(), "LocalBroker: can't listen on " + options.host + ":" + service);
+		}
+
+		freeaddrinfo(res);
+
+		sockaddr_storage addr{};
+		socklen_t len = sizeof(addr);
+		getsockname(listen_fd, reinterpret_cast<sockaddr *>(&addr), &len);
+		port = ntohs(addr.ss_family == AF_INET6 ? reinterpret_cast<sockaddr_in6 *>(&addr)->sin6_port : reinterpret_cast<sockaddr_in *>(&addr)->sin_port);
+
+		this->watch(listen_fd, EPOLLIN);
+	}
+
+	void watch(int fd, uint32_t events)
+	{
+		epoll_event ev{};
+		ev.events = events;
+		ev.data.fd = fd;
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+	}
+
+	void run()
+	{
+		std::vector<epoll_event> events(256);
+
+		while( !stop.load() ){
+			const int n = epoll_wait(epoll_fd, events.data(), static_cast<int>(events.size()), 250);
+
+			if(n < 0 && errno != EINTR){
+				logger.msg(MSG_ERROR, "%s%s\n", excp_method("LocalBroker: epoll_wait failed: "), strerror(errno));
+				return;
+			}
+
+			for(int i = 0; i < n; ++i){
+				const int fd = events[i].data.fd;
+
+				if(fd == listen_fd){
+					this->accept();
+				}
+				else if(fd == wakeup_fd){
+					uint64_t value;
+					while(::read(wakeup_fd, &value, sizeof(value)) > 0){}
+					this->adopt();
+				}
+				else{
+					auto it = connections.find(fd);
+
+					if(it == connections.end() || it->second->dead){
+						continue;
+					}
+
+					if(events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)){
+						this->receive(*it->second);
+					}
+				}
+			}
+
+			this->dispatch();
+			this->heartbeats();
+			this->flush();
+		}
+	}
+
+	void accept()
+	{
+		for(;;){
+			const int fd = ::accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+			if(fd < 0){
+				return;
+			}
+
+			this->add_connection(fd);
+		}
+	}
+
+	void adopt()
+	{
+		std::vector<int> fds;
+
+		{
+			std::lock_guard<std::mutex> lock(adopt_mutex);
+			fds.swap(adopted);
+		}
+
+		for(int fd : fds){
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+			this->add_connection(fd);
+		}
+	}
+
+	void add_connection(int fd)
+	{
+		int on = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+		auto connection = std::make_unique<Connection>();
+		connection->fd = fd;
+		connection->id = ++next_connection;
+		connection->frame_max = options.frame_max;
+		connection->channel_max = options.channel_max;
+		connection->last_read = connection->last_write = steady_clock::now();
+
+		by_id[connection->id] = connection.get();
+		connections[fd] = std::move(connection);
+		this->watch(fd, EPOLLIN);
+		++counters.connections;
+	}
+
+	// Read what is available and process complete frames
+	void receive(Connection &c)
+	{
+		char buf[65536];
+
+		// Bounded per wakeup, so one connection doesn't starve the others
+		for(int i = 0; i < 16; ++i){
+			const ssize_t got = ::read(c.fd, buf, sizeof(buf));
+
+			if(got > 0){
+				c.in.append(buf, got);
+				c.last_read = steady_clock::now();
+
+				if(static_cast<size_t>(got) < sizeof(buf)){
+					break;
+				}
+
+				continue;
+			}
+
+			if(got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+				break;
+			}
+
+			if(got < 0 && errno == EINTR){
+				continue;
+			}
+
+			// EOF or error
+			c.dead = true;
+			return;
+		}
+
+		try{
+			this->process(c);
+		}
+		catch(const ProtocolError &e){
+			this->close_connection(c, e.code, e.text, 0, 0);
+		}
+
+		// Compact consumed input
+		if(c.in_pos == c.in.size()){
+			c.in.clear();
+			c.in_pos = 0;
+		}
+		else if(c.in_pos > 65536){
+			c.in.erase(0, c.in_pos);
+			c.in_pos = 0;
+		}
+
+		this->send_confirms(c);
+	}
+
+	void process(Connection &c)
+	{
+		if( !c.header ){
+			if(c.in.size() < sizeof(PROTOCOL_HEADER)){
+				return;
+			}
+
+			if(std::memcmp(c.in.data(), PROTOCOL_HEADER, sizeof(PROTOCOL_HEADER)) != 0){
+				// Tell the supported protocol version and close
+				c.out.append(PROTOCOL_HEADER, sizeof(PROTOCOL_HEADER));
+				c.closing = true;
+				c.in_pos = c.in.size();
+				return;
+			}
+
+			c.header = true;
+			c.in_pos = sizeof(PROTOCOL_HEADER);
+
+			Encoder(c.out).method(0, CONNECTION, 10).octet(0).octet(9).longstr(server_properties())
+				.longstr("PLAIN AMQPLAIN").longstr("en_US").end();
+		}
+
+		while( !c.dead && c.in.size() - c.in_pos >= 7 ){
+			const uint8_t *p = reinterpret_cast<const uint8_t *>(c.in.data() + c.in_pos);
+			const uint8_t type = p[0];
+			const uint16_t channel = (uint16_t(p[1]) << 8) | p[2];
+			const uint32_t size = (uint32_t(p[3]) << 24) | (uint32_t(p[4]) << 16) | (uint32_t(p[5]) << 8) | p[6];
+
+			// frame_max covers the whole frame: 7 bytes of header and the end octet
+			if(size + 8ul > c.frame_max){
+				connection_error(FRAME_ERROR, "FRAME_ERROR - frame too large");
+			}
+
+			if(c.in.size() - c.in_pos < size + 8ul){
+				return;
+			}
+
+			if(static_cast<uint8_t>(c.in[c.in_pos + 7 + size]) != FRAME_END){
+				connection_error(FRAME_ERROR, "FRAME_ERROR - missing frame end");
+			}
+
+			const char *payload = c.in.data() + c.in_pos + 7;
+			c.in_pos += size + 8;
+
+			// After Connection.Close only Close-Ok matters
+			if(c.closing && !(type == FRAME_METHOD && channel == 0)){
+				continue;
+			}
+
+			this->frame(c, type, channel, payload, size);
+		}
+	}
+
+	void frame(Connection &c, uint8_t type, uint16_t channel_id, const char *payload, uint32_t size)
+	{
+		if(type == FRAME_HEARTBEAT){
+			return;
+		}
+
+		if(channel_id == 0){
+			if(type != FRAME_METHOD){
+				connection_error(UNEXPECTED_FRAME, "UNEXPECTED_FRAME - content on channel 0");
+			}
+
+			Decoder d(payload, size);
+			const uint16_t class_id = d.short_();
+			const uint16_t method_id = d.short_();
+			this->connection_method(c, class_id, method_id, d);
+			return;
+		}
+
+		auto it = c.channels.find(channel_id);
+
+		if(type == FRAME_METHOD){
+			Decoder d(payload, size);
+			const uint16_t class_id = d.short_();
+			const uint16_t method_id = d.short_();
+
+			if(class_id == CHANNEL && method_id == 10){
+				this->channel_open(c, channel_id);
+				return;
+			}
+
+			if(it == c.channels.end()){
+				connection_error(CHANNEL_ERROR, "CHANNEL_ERROR - channel " + std::to_string(channel_id) + " is not open");
+			}
+
+			Channel &ch = *it->second;
+
+			if(ch.closing){
+				// Only the closing handshake is processed
+				if(class_id == CHANNEL && (method_id == 40 || method_id == 41)){
+					if(method_id == 40) Encoder(c.out).method(ch.id, CHANNEL, 41).end();
+					c.channels.erase(it);
+					--counters.channels;
+				}
+
+				return;
+			}
+
+			if(ch.in_publish){
+				connection_error(UNEXPECTED_FRAME, "UNEXPECTED_FRAME - expected content of basic.publish");
+			}
+
+			try{
+				this->channel_method(ch, class_id, method_id, d);
+			}
+			catch(const ProtocolError &e){
+				if(e.connection_level){
+					throw;
+				}
+
+				this->close_channel(ch, e.code, e.text, class_id, method_id);
+			}
+
+			return;
+		}
+
+		if(it == c.channels.end()){
+			connection_error(CHANNEL_ERROR, "CHANNEL_ERROR - channel " + std::to_string(channel_id) + " is not open");
+		}
+
+		Channel &ch = *it->second;
+
+		if(ch.closing){
+			return;
+		}
+
+		if( !ch.in_publish ){
+			connection_error(UNEXPECTED_FRAME, "UNEXPECTED_FRAME - content without basic.publish");
+		}
+
+		if(type == FRAME_HEADER){
+			if(ch.publishing.header){
+				connection_error(UNEXPECTED_FRAME, "UNEXPECTED_FRAME - duplicate content header");
+			}
+
+			Decoder d(payload, size);
+			d.short_();		// class
+			d.short_();		// weight
+			ch.publishing.size = d.longlong();
+			ch.publishing.header = true;
+			ch.publishing.message->properties.assign(d.bytes(d.left()));
+			ch.publishing.message->body.reserve(ch.publishing.size);
+		}
+		else if(type == FRAME_BODY){
+			if( !ch.publishing.header ){
+				connection_error(UNEXPECTED_FRAME, "UNEXPECTED_FRAME - body before content header");
+			}
+
+			ch.publishing.message->body.append(payload, size);
+
+			if(ch.publishing.message->body.size() > ch.publishing.size){
+				connection_error(FRAME_ERROR, "FRAME_ERROR - body larger than declared");
+			}
+		}
+		else{
+			connection_error(FRAME_ERROR, "FRAME_ERROR - unknown frame type");
+		}
+
+		if(ch.publishing.header && ch.publishing.message->body.size() == ch.publishing.size){
+			ch.in_publish = false;
+
+			try{
+				this->publish(ch);
+			}
+			catch(const ProtocolError &e){
+				if(e.connection_level){
+					throw;
+				}
+
+				this->close_channel(ch, e.code, e.text, BASIC, 40);
+			}
+		}
+	}
+
+	void connection_method(Connection &c, uint16_t class_id, uint16_t method_id, Decoder &d)
+	{
+		if(class_id != CONNECTION){
+			connection_error(COMMAND_INVALID, "COMMAND_INVALID - unexpected method on channel 0");
+		}
+
+		switch(method_id){
+		case 11:	// Start-Ok: any credentials are accepted
+			Encoder(c.out).method(0, CONNECTION, 30).short_(c.channel_max).long_(c.frame_max).short_(options.heartbeat).end();
+			break;
+
+		case 31: {	// Tune-Ok
+			const uint16_t channel_max = d.short_();
+			const uint32_t frame_max = d.long_();
+			c.heartbeat = d.short_();
+
+			if(channel_max) c.channel_max = std::min(c.channel_max, channel_max);
+			if(frame_max) c.frame_max = std::max<uint32_t>(std::min(c.frame_max, frame_max), 4096);
+			break;
+		}
+
+		case 40:	// Open
+			Encoder(c.out).method(0, CONNECTION, 41).shortstr("").end();
+			break;
+
+		case 50:	// Close
+			Encoder(c.out).method(0, CONNECTION, 51).end();
+			c.closing = true;
+			this->release(c);
+			break;
+
+		case 51:	// Close-Ok
+			c.dead = true;
+			break;
+
+		default:
+			// blocked/unblocked/update-secret are not used by clients
+			break;
+		}
+	}
+
+	void channel_open(Connection &c, uint16_t id)
+	{
+		if(c.channels.count(id) || id > c.channel_max){
+			connection_error(CHANNEL_ERROR, "CHANNEL_ERROR - channel " + std::to_string(id) + " can't be opened");
+		}
+
+		auto channel = std::make_unique<Channel>();
+		channel->id = id;
+		channel->connection = &c;
+		c.channels[id] = std::move(channel);
+		++counters.channels;
+
+		Encoder(c.out).method(id, CHANNEL, 11).longstr("").end();
+	}
+
+	void channel_method(Channel &ch, uint16_t class_id, uint16_t method_id, Decoder &d)
+	{
+		Connection &c = *ch.connection;
+
+		switch(class_id * 1000 + method_id){
+
+		case CHANNEL * 1000 + 20: {		// Flow
+			ch.flow = d.octet() & 1;
+			Encoder(c.out).method(ch.id, CHANNEL, 21).octet(ch.flow).end();
+			if(ch.flow) this->mark_consumed(ch);
+			break;
+		}
+
+		case CHANNEL * 1000 + 40: {		// Close
+			const uint16_t id = ch.id;
+			this->release(ch);
+			Encoder(c.out).method(id, CHANNEL, 41).end();
+			c.channels.erase(id);
+			--counters.channels;
+			break;
+		}
+
+		case EXCHANGE * 1000 + 10:		// Declare
+			this->exchange_declare(ch, d);
+			break;
+
+		case EXCHANGE * 1000 + 20:		// Delete
+			this->exchange_delete(ch, d);
+			break;
+
+		case QUEUE * 1000 + 10:
+			this->queue_declare(ch, d);
+			break;
+
+		case QUEUE * 1000 + 20:
+			this->queue_bind(ch, d, true);
+			break;
+
+		case QUEUE * 1000 + 50:
+			this->queue_bind(ch, d, false);
+			break;
+
+		case QUEUE * 1000 + 30:
+			this->queue_purge(ch, d);
+			break;
+
+		case QUEUE * 1000 + 40:
+			this->queue_delete(ch, d);
+			break;
+
+		case BASIC * 1000 + 10:
+			this->basic_qos(ch, d);
+			break;
+
+		case BASIC * 1000 + 20:
+			this->basic_consume(ch, d);
+			break;
+
+		case BASIC * 1000 + 30:
+			this->basic_cancel(ch, d);
+			break;
+
+		case BASIC * 1000 + 40:
+			this->basic_publish(ch, d);
+			break;
+
+		case BASIC * 1000 + 70:
+			this->basic_get(ch, d);
+			break;
+
+		case BASIC * 1000 + 80: {		// Ack
+			const uint64_t tag = d.longlong();
+			const bool multiple = d.octet() & 1;
+			this->settle(ch, tag, multiple, true, false);
+			break;
+		}
+
+		case BASIC * 1000 + 90: {		// Reject
+			const uint64_t tag = d.longlong();
+			const bool requeue = d.octet() & 1;
+			this->settle(ch, tag, false, false, requeue);
+			break;
+		}
+
+		case BASIC * 1000 + 120: {		// Nack
+			const uint64_t tag = d.longlong();
+			const uint8_t bits = d.octet();
+			this->settle(ch, tag, bits & 1, false, bits & 2);
+			break;
+		}
+
+		case BASIC * 1000 + 110:		// Recover
+		case BASIC * 1000 + 100:		// Recover-Async
+			this->requeue_unacked(ch);
+			if(method_id == 110) Encoder(c.out).method(ch.id, BASIC, 111).end();
+			break;
+
+		case CONFIRM * 1000 + 10: {		// Select
+			const bool nowait = d.octet() & 1;
+			ch.confirm = true;
+			if( !nowait ) Encoder(c.out).method(ch.id, CONFIRM, 11).end();
+			break;
+		}
+
+		default:
+			connection_error(NOT_IMPLEMENTED, "NOT_IMPLEMENTED - method " + std::to_string(class_id) + "." + std::to_string(method_id));
+		}
+	}
+
+	// Exchanges and queues
+
+	Exchange *find_exchange(const std::string &name)
+	{
+		auto it = exchanges.find(name);
+		return it == exchanges.end() ? nullptr : &it->second;
+	}
+
+	std::shared_ptr<Queue> find_queue(const Channel &ch, const std::string &name)
+	{
+		auto it = queues.find(name);
+
+		if(it == queues.end()){
+			channel_error(NOT_FOUND, "NOT_FOUND - no queue '" + name + "'");
+		}
+
+		if(it->second->exclusive && it->second->owner != ch.connection){
+			channel_error(RESOURCE_LOCKED, "RESOURCE_LOCKED - queue '" + name + "' is exclusive to another connection");
+		}
+
+		return it->second;
+	}
+
+	void exchange_declare(Channel &ch, Decoder &d)
+	{
+		d.short_();
+		const std::string name(d.shortstr());
+		const std::string_view type_name = d.shortstr();
+		const uint8_t bits = d.octet();
+		d.table();
+
+		const bool passive = bits & 1;
+		const bool nowait = bits & 16;
+
+		ExchangeType type;
+
+		if(type_name == "direct") type = ExchangeType::DIRECT;
+		else if(type_name == "fanout") type = ExchangeType::FANOUT;
+		else if(type_name == "topic") type = ExchangeType::TOPIC;
+		else if(passive) type = ExchangeType::DIRECT;
+		else connection_error(COMMAND_INVALID, "COMMAND_INVALID - unsupported exchange type '" + std::string(type_name) + "'");
+
+		Exchange *exchange = this->find_exchange(name);
+
+		if(passive){
+			if( !exchange && !name.empty() ){
+				channel_error(NOT_FOUND, "NOT_FOUND - no exchange '" + name + "'");
+			}
+		}
+		else if(name.empty()){
+			channel_error(ACCESS_REFUSED, "ACCESS_REFUSED - default exchange can't be declared");
+		}
+		else if(exchange){
+			if(exchange->type != type){
+				channel_error(PRECONDITION_FAILED, "PRECONDITION_FAILED - inequivalent arg 'type' for exchange '" + name + "'");
+			}
+		}
+		else{
+			if(name.compare(0, 4, "amq.") == 0){
+				channel_error(ACCESS_REFUSED, "ACCESS_REFUSED - exchange name '" + name + "' contains reserved prefix 'amq.'");
+			}
+
+			exchanges[name] = Exchange{name, type, {}};
+		}
+
+		if( !nowait ){
+			Encoder(ch.connection->out).method(ch.id, EXCHANGE, 11).end();
+		}
+	}
+
+	void exchange_delete(Channel &ch, Decoder &d)
+	{
+		d.short_();
+		const std::string name(d.shortstr());
+		const uint8_t bits = d.octet();
+
+		auto it = exchanges.find(name);
+
+		if(it != exchanges.end()){
+			if(name.compare(0, 4, "amq.") == 0){
+				channel_error(ACCESS_REFUSED, "ACCESS_REFUSED - exchange '" + name + "' can't be deleted");
+			}
+
+			if((bits & 1) && !it->second.bindings.empty()){
+				channel_error(PRECONDITION_FAILED, "PRECONDITION_FAILED - exchange '" + name + "' in use");
+			}
+
+			exchanges.erase(it);
+		}
+
+		if( !(bits & 2) ){
+			Encoder(ch.connection->out).method(ch.id, EXCHANGE, 21).end();
+		}
+	}
+
+	void queue_declare(Channel &ch, Decoder &d)
+	{
+		d.short_();
+		std::string name(d.shortstr());
+		const uint8_t bits = d.octet();
+		d.table();
+
+		const bool passive = bits & 1;
+		const bool exclusive = bits & 4;
+		const bool auto_delete = bits & 8;
+		const bool nowait = bits & 16;
+
+		std::shared_ptr<Queue> queue;
+		auto it = name.empty() ? queues.end() : queues.find(name);
+
+		if(it != queues.end()){
+			queue = this->find_queue(ch, name);
+		}
+		else if(passive){
+			channel_error(NOT_FOUND, "NOT_FOUND - no queue '" + name + "'");
+		}
+		else{
+			if(name.empty()){
+				name = "amq.gen-" + std::to_string(ch.connection->id) + "-" + std::to_string(++next_name);
+			}
+			else if(name.compare(0, 4, "amq.") == 0){
+				channel_error(ACCESS_REFUSED, "ACCESS_REFUSED - queue name '" + name + "' contains reserved prefix 'amq.'");
+			}
+
+			queue = std::make_shared<Queue>();
+			queue->name = name;
+			queue->exclusive = exclusive;
+			queue->auto_delete = auto_delete;
+			queue->owner = exclusive ? ch.connection : nullptr;
+			queues[name] = queue;
+			++counters.queues;
+		}
+
+		if( !nowait ){
+			Encoder(ch.connection->out).method(ch.id, QUEUE, 11).shortstr(queue->name)
+				.long_(static_cast<uint32_t>(queue->messages.size())).long_(static_cast<uint32_t>(queue->consumers.size())).end();
+		}
+	}
+
+	void queue_bind(Channel &ch, Decoder &d, bool bind)
+	{
+		d.short_();
+		const std::string queue_name(d.shortstr());
+		const std::string exchange_name(d.shortstr());
+		const std::string key(d.shortstr());
+		const bool nowait = bind ? (d.octet() & 1) : false;
+		d.table();
+
+		auto queue = this->find_queue(ch, queue_name);
+
+		if(exchange_name.empty()){
+			channel_error(ACCESS_REFUSED, "ACCESS_REFUSED - operation not permitted on the default exchange");
+		}
+
+		Exchange *exchange = this->find_exchange(exchange_name);
+
+		if( !exchange ){
+			channel_error(NOT_FOUND, "NOT_FOUND - no exchange '" + exchange_name + "'");
+		}
+
+		auto &bindings = exchange->bindings;
+		auto found = std::find_if(bindings.begin(), bindings.end(), [&](const Binding &b){ return b.key == key && b.queue.lock() == queue; });
+
+		if(bind){
+			if(found == bindings.end()){
+				bindings.push_back(Binding{queue, key});
+			}
+
+			if( !nowait ) Encoder(ch.connection->out).method(ch.id, QUEUE, 21).end();
+		}
+		else{
+			if(found != bindings.end()){
+				bindings.erase(found);
+			}
+
+			Encoder(ch.connection->out).method(ch.id, QUEUE, 51).end();
+		}
+	}
+
+	void queue_purge(Channel &ch, Decoder &d)
+	{
+		d.short_();
+		auto queue = this->find_queue(ch, std::string(d.shortstr()));
+		const bool nowait = d.octet() & 1;
+
+		const uint32_t count = static_cast<uint32_t>(queue->messages.size());
+		queue->messages.clear();
+
+		if( !nowait ){
+			Encoder(ch.connection->out).method(ch.id, QUEUE, 31).long_(count).end();
+		}
+	}
+
+	void queue_delete(Channel &ch, Decoder &d)
+	{
+		d.short_();
+		const std::string name(d.shortstr());
+		const uint8_t bits = d.octet();
+
+		uint32_t count = 0;
+
+		if(queues.count(name)){
+			auto queue = this->find_queue(ch, name);
+
+			if((bits & 1) && !queue->consumers.empty()){
+				channel_error(PRECONDITION_FAILED, "PRECONDITION_FAILED - queue '" + name + "' in use");
+			}
+
+			if((bits & 2) && !queue->messages.empty()){
+				channel_error(PRECONDITION_FAILED, "PRECONDITION_FAILED - queue '" + name + "' not empty");
+			}
+
+			count = static_cast<uint32_t>(queue->messages.size());
+			this->delete_queue(queue);
+		}
+
+		if( !(bits & 4) ){
+			Encoder(ch.connection->out).method(ch.id, QUEUE, 41).long_(count).end();
+		}
+	}
+
+	void delete_queue(const std::shared_ptr<Queue> &queue)
+	{
+		if(queue->deleted){
+			return;
+		}
+
+		queue->deleted = true;
+		queue->messages.clear();
+
+		// Consumers of other channels are notified (consumer_cancel_notify)
+		for(auto &consumer : queue->consumers){
+			consumer->cancelled = true;
+			Channel &ch = *consumer->channel;
+
+			if( !ch.closing && !ch.connection->closing ){
+				Encoder(ch.connection->out).method(ch.id, BASIC, 30).shortstr(consumer->tag).octet(1).end();
+			}
+
+			ch.consumers.erase(consumer->tag);
+		}
+
+		queue->consumers.clear();
+
+		for(auto &e : exchanges){
+			auto &bindings = e.second.bindings;
+			bindings.erase(std::remove_if(bindings.begin(), bindings.end(), [&](const Binding &b){
+				auto bound = b.queue.lock();
+				return !bound || bound == queue;
+			}), bindings.end());
+		}
+
+		queues.erase(queue->name);
+		--counters.queues;
+	}
+
+	// Basic class
+
+	void basic_qos(Channel &ch, Decoder &d)
+	{
+		d.long_();		// prefetch size is not supported by RabbitMQ either
+		const uint16_t count = d.short_();
+		const bool global = d.octet() & 1;
+
+		if(global){
+			ch.prefetch = count;
+		}
+		else{
+			ch.consumer_prefetch = count;
+		}
+
+		Encoder(ch.connection->out).method(ch.id, BASIC, 11).end();
+		this->mark_consumed(ch);
+	}
+
+	void basic_consume(Channel &ch, Decoder &d)
+	{
+		d.short_();
+		const std::string queue_name(d.shortstr());
+		std::string tag(d.shortstr());
+		const uint8_t bits = d.octet();
+		d.table();
+
+		const bool no_ack = bits & 2;
+		const bool exclusive = bits & 4;
+		const bool nowait = bits & 8;
+
+		if(tag.empty()){
+			tag = "amq.ctag-" + std::to_string(ch.connection->id) + "-" + std::to_string(++next_name);
+		}
+
+		if(ch.consumers.count(tag) || tag == ch.reply_consumer){
+			connection_error(NOT_ALLOWED, "NOT_ALLOWED - attempt to reuse consumer tag '" + tag + "'");
+		}
+
+		if(queue_name == REPLY_TO){
+			if( !no_ack ){
+				channel_error(PRECONDITION_FAILED, "PRECONDITION_FAILED - reply consumer cannot acknowledge");
+			}
+
+			ch.reply_consumer = tag;
+			if( !nowait ) Encoder(ch.connection->out).method(ch.id, BASIC, 21).shortstr(tag).end();
+			return;
+		}
+
+		auto queue = this->find_queue(ch, queue_name);
+
+		if(queue->exclusive_consumer || (exclusive && !queue->consumers.empty())){
+			channel_error(ACCESS_REFUSED, "ACCESS_REFUSED - queue '" + queue_name + "' in exclusive use");
+		}
+
+		auto consumer = std::make_shared<Consumer>();
+		consumer->channel = &ch;
+		consumer->tag = tag;
+		consumer->queue = queue;
+		consumer->no_ack = no_ack;
+		consumer->prefetch = ch.consumer_prefetch;
+
+		ch.consumers[tag] = consumer;
+		queue->consumers.push_back(consumer);
+		queue->exclusive_consumer = exclusive;
+		queue->had_consumers = true;
+
+		if( !nowait ) Encoder(ch.connection->out).method(ch.id, BASIC, 21).shortstr(tag).end();
+		this->mark(queue);
+	}
+
+	void basic_cancel(Channel &ch, Decoder &d)
+	{
+		const std::string tag(d.shortstr());
+		const bool nowait = d.octet() & 1;
+
+		if(tag == ch.reply_consumer){
+			ch.reply_consumer.clear();
+		}
+		else{
+			this->cancel(ch, tag);
+		}
+
+		if( !nowait ) Encoder(ch.connection->out).method(ch.id, BASIC, 31).shortstr(tag).end();
+	}
+
+	void cancel(Channel &ch, const std::string &tag)
+	{
+		auto it = ch.consumers.find(tag);
+
+		if(it == ch.consumers.end()){
+			return;
+		}
+
+		auto consumer = it->second;
+		ch.consumers.erase(it);
+		consumer->cancelled = true;
+
+		if(auto queue = consumer->queue.lock()){
+			auto &list = queue->consumers;
+			list.erase(std::remove(list.begin(), list.end(), consumer), list.end());
+			queue->exclusive_consumer = false;
+
+			if(queue->auto_delete && queue->had_consumers && list.empty()){
+				this->delete_queue(queue);
+			}
+		}
+	}
+
+	void basic_publish(Channel &ch, Decoder &d)
+	{
+		d.short_();
+		ch.publishing.exchange.assign(d.shortstr());
+		ch.publishing.routingkey.assign(d.shortstr());
+		ch.publishing.mandatory = d.octet() & 1;
+		ch.publishing.header = false;
+		ch.publishing.size = 0;
+		ch.publishing.message = std::make_shared<Message>();
+		ch.in_publish = true;
+
+		if(ch.confirm){
+			++ch.published;
+		}
+	}
+
+	// Complete message received: route it to the queues
+	void publish(Channel &ch)
+	{
+		Publishing &p = ch.publishing;
+		std::shared_ptr<Message> message = std::move(p.message);
+		message->exchange = p.exchange;
+		message->routingkey = p.routingkey;
+
+		++counters.published;
+
+		this->parse_properties(ch, *message);
+
+		// Direct reply-to: straight to the consumer of the requesting channel
+		if(p.exchange.empty() && p.routingkey.compare(0, REPLY_TO.size() + 1, REPLY_TO + ".") == 0){
+			if( !this->reply(*message) ){
+				this->unroutable(ch, *message, p.mandatory);
+			}
+
+			return;
+		}
+
+		// Queues are collected first: a queue bound with several matching keys gets one copy
+		std::vector<std::shared_ptr<Queue>> targets;
+
+		if(p.exchange.empty()){
+			auto it = queues.find(p.routingkey);
+			if(it != queues.end()) targets.push_back(it->second);
+		}
+		else{
+			Exchange *exchange = this->find_exchange(p.exchange);
+
+			if( !exchange ){
+				channel_error(NOT_FOUND, "NOT_FOUND - no exchange '" + p.exchange + "'");
+			}
+
+			for(const auto &binding : exchange->bindings){
+				bool match = false;
+
+				switch(exchange->type){
+				case ExchangeType::DIRECT: match = binding.key == p.routingkey; break;
+				case ExchangeType::FANOUT: match = true; break;
+				case ExchangeType::TOPIC: match = topic_match(binding.key, p.routingkey); break;
+				}
+
+				if(match){
+					if(auto queue = binding.queue.lock()){
+						if(std::find(targets.begin(), targets.end(), queue) == targets.end()){
+							targets.push_back(std::move(queue));
+						}
+					}
+				}
+			}
+		}
+
+		if(targets.empty()){
+			this->unroutable(ch, *message, p.mandatory);
+			return;
+		}
+
+		for(auto &queue : targets){
+			queue->messages.push_back(Queued{message, false});
+			this->mark(queue);
+		}
+
+		counters.routed += targets.size();
+	}
+
+	// Rewrites reply-to of direct reply-to requests, reads expiration
+	void parse_properties(Channel &ch, Message &message)
+	{
+		if(message.properties.size() < 2){
+			return;
+		}
+
+		Decoder d(message.properties.data(), message.properties.size());
+		const uint16_t flags = d.short_();
+
+		if(flags & PROP_CONTENT_TYPE) d.shortstr();
+		if(flags & PROP_CONTENT_ENCODING) d.shortstr();
+		if(flags & PROP_HEADERS) d.table();
+		if(flags & PROP_DELIVERY_MODE) d.octet();
+		if(flags & PROP_PRIORITY) d.octet();
+		if(flags & PROP_CORRELATION_ID) d.shortstr();
+
+		if(flags & PROP_REPLY_TO){
+			const size_t offset = message.properties.size() - d.left();
+			const std::string_view reply_to = d.shortstr();
+
+			if(reply_to == REPLY_TO){
+				if(ch.reply_consumer.empty()){
+					channel_error(PRECONDITION_FAILED, "PRECONDITION_FAILED - fast reply consumer does not exist");
+				}
+
+				const std::string address = REPLY_TO + "." + std::to_string(ch.connection->id) + "." + std::to_string(ch.id);
+				std::string replaced;
+				Encoder(replaced).shortstr(address);
+				message.properties.replace(offset, 1 + reply_to.size(), replaced);
+
+				d = Decoder(message.properties.data() + offset + replaced.size(), message.properties.size() - offset - replaced.size());
+			}
+		}
+
+		if(flags & PROP_EXPIRATION){
+			const std::string expiration(d.shortstr());
+			char *end = nullptr;
+			const unsigned long long ms = std::strtoull(expiration.c_str(), &end, 10);
+
+			if(end && *end == '\0' && !expiration.empty()){
+				message.expires = steady_clock::now() + std::chrono::milliseconds(ms);
+			}
+		}
+	}
+
+	bool reply(const Message &message)
+	{
+		// amq.rabbitmq.reply-to.<connection>.<channel>
+		const char *p = message.routingkey.c_str() + REPLY_TO.size() + 1;
+		char *end = nullptr;
+		const uint64_t connection_id = std::strtoull(p, &end, 10);
+
+		if( !end || *end != '.' ){
+			return false;
+		}
+
+		const unsigned long channel_id = std::strtoul(end + 1, nullptr, 10);
+
+		auto c = by_id.find(connection_id);
+		if(c == by_id.end() || c->second->closing || c->second->dead) return false;
+
+		auto ch = c->second->channels.find(static_cast<uint16_t>(channel_id));
+		if(ch == c->second->channels.end() || ch->second->closing || ch->second->reply_consumer.empty()) return false;
+
+		Channel &target = *ch->second;
+		this->deliver(target, target.reply_consumer, ++target.next_tag, false, message);
+		return true;
+	}
+
+	void unroutable(Channel &ch, const Message &message, bool mandatory)
+	{
+		++counters.unroutable;
+
+		if( !mandatory ){
+			return;
+		}
+
+		std::string &out = ch.connection->out;
+		Encoder(out).method(ch.id, BASIC, 50).short_(NO_ROUTE).shortstr("NO_ROUTE").shortstr(message.exchange).shortstr(message.routingkey).end();
+		this->content(ch, message);
+	}
+
+	// Content header and body frames
+	void content(Channel &ch, const Message &message)
+	{
+		std::string &out = ch.connection->out;
+		Encoder e(out);
+
+		e.begin(FRAME_HEADER, ch.id).short_(BASIC).short_(0).longlong(message.body.size());
+
+		if(message.properties.empty()){
+			e.short_(0);
+		}
+		else{
+			e.bytes(message.properties);
+		}
+
+		e.end();
+
+		const size_t max = ch.connection->frame_max - 8;
+
+		for(size_t pos = 0; pos < message.body.size(); pos += max){
+			const size_t size = std::min(max, message.body.size() - pos);
+			e.begin(FRAME_BODY, ch.id).bytes(std::string_view(message.body).substr(pos, size)).end();
+		}
+	}
+
+	void deliver(Channel &ch, const std::string &consumer_tag, uint64_t tag, bool redelivered, const Message &message)
+	{
+		Encoder(ch.connection->out).method(ch.id, BASIC, 60).shortstr(consumer_tag).longlong(tag)
+			.octet(redelivered).shortstr(message.exchange).shortstr(message.routingkey).end();
+		this->content(ch, message);
+		++counters.delivered;
+	}
+
+	void basic_get(Channel &ch, Decoder &d)
+	{
+		d.short_();
+		auto queue = this->find_queue(ch, std::string(d.shortstr()));
+		const bool no_ack = d.octet() & 1;
+
+		this->drop_expired(*queue);
+
+		if(queue->messages.empty()){
+			Encoder(ch.connection->out).method(ch.id, BASIC, 72).shortstr("").end();
+			return;
+		}
+
+		Queued queued = std::move(queue->messages.front());
+		queue->messages.pop_front();
+
+		const uint64_t tag = ++ch.next_tag;
+		const Message &message = *queued.message;
+
+		Encoder(ch.connection->out).method(ch.id, BASIC, 71).longlong(tag).octet(queued.redelivered)
+			.shortstr(message.exchange).shortstr(message.routingkey).long_(static_cast<uint32_t>(queue->messages.size())).end();
+		this->content(ch, message);
+		++counters.delivered;
+
+		if( !no_ack ){
+			ch.unacked.push_back(Unacked{tag, queue, queued.message, nullptr, false});
+			++ch.unacked_count;
+		}
+	}
+
+	void settle(Channel &ch, uint64_t tag, bool multiple, bool ack, bool requeue)
+	{
+		auto &unacked = ch.unacked;
+
+		// Tags are increasing, settled entries are removed from the front lazily
+		auto first = std::lower_bound(unacked.begin(), unacked.end(), tag, [](const Unacked &u, uint64_t t){ return u.tag < t; });
+
+		if(tag != 0 && (first == unacked.end() || first->tag != tag || first->settled)){
+			channel_error(PRECONDITION_FAILED, "PRECONDITION_FAILED - unknown delivery tag " + std::to_string(tag));
+		}
+
+		auto begin = multiple || tag == 0 ? unacked.begin() : first;
+		auto end = tag == 0 ? unacked.end() : first + 1;
+
+		// Requeued in the original order
+		std::vector<Unacked *> requeued;
+
+		for(auto it = begin; it != end; ++it){
+			if(it->settled){
+				continue;
+			}
+
+			it->settled = true;
+			--ch.unacked_count;
+
+			if(it->consumer){
+				--it->consumer->unacked;
+			}
+
+			if(ack){
+				++counters.acked;
+			}
+			else if(requeue){
+				requeued.push_back(&*it);
+			}
+		}
+
+		for(auto it = requeued.rbegin(); it != requeued.rend(); ++it){
+			this->requeue(**it);
+		}
+
+		while( !unacked.empty() && unacked.front().settled ){
+			unacked.pop_front();
+		}
+
+		this->mark_consumed(ch);
+	}
+
+	void requeue(Unacked &u)
+	{
+		auto queue = u.queue.lock();
+
+		if( !queue || queue->deleted ){
+			return;
+		}
+
+		queue->messages.push_front(Queued{std::move(u.message), true});
+		++counters.requeued;
+		this->mark(queue);
+	}
+
+	void requeue_unacked(Channel &ch)
+	{
+		for(auto it = ch.unacked.rbegin(); it != ch.unacked.rend(); ++it){
+			if( !it->settled ){
+				if(it->consumer) --it->consumer->unacked;
+				this->requeue(*it);
+			}
+		}
+
+		ch.unacked.clear();
+		ch.unacked_count = 0;
+	}
+
+	// Dispatch
+
+	void mark(const std::shared_ptr<Queue> &queue)
+	{
+		if( !queue->dirty ){
+			queue->dirty = true;
+			dirty.push_back(queue);
+		}
+	}
+
+	// Channel capacity changed: its queues may have something to deliver
+	void mark_consumed(Channel &ch)
+	{
+		for(auto &c : ch.consumers){
+			if(auto queue = c.second->queue.lock()){
+				this->mark(queue);
+			}
+		}
+	}
+
+	bool can_deliver(const Consumer &consumer) const
+	{
+		const Channel &ch = *consumer.channel;
+
+		if(consumer.cancelled || ch.closing || !ch.flow || ch.connection->closing || ch.connection->dead){
+			return false;
+		}
+
+		if(consumer.no_ack){
+			return true;
+		}
+
+		return (!consumer.prefetch || consumer.unacked < consumer.prefetch) && (!ch.prefetch || ch.unacked_count < ch.prefetch);
+	}
+
+	void drop_expired(Queue &queue)
+	{
+		if(queue.messages.empty() || queue.messages.front().message->expires == steady_clock::time_point::max()){
+			return;
+		}
+
+		const auto now = steady_clock::now();
+
+		while( !queue.messages.empty() && queue.messages.front().message->expires < now ){
+			queue.messages.pop_front();
+			++counters.expired;
+		}
+	}
+
+	void dispatch()
+	{
+		std::vector<std::shared_ptr<Queue>> batch;
+		batch.swap(dirty);
+
+		for(auto &queue : batch){
+			queue->dirty = false;
+
+			if( !queue->deleted ){
+				this->dispatch(*queue);
+			}
+		}
+	}
+
+	// Round robin over the consumers with free capacity
+	void dispatch(Queue &queue)
+	{
+		auto &consumers = queue.consumers;
+
+		while( !queue.messages.empty() && !consumers.empty() ){
+			this->drop_expired(queue);
+
+			if(queue.messages.empty()){
+				return;
+			}
+
+			std::shared_ptr<Consumer> consumer;
+
+			for(size_t i = 0; i < consumers.size(); ++i){
+				const auto &candidate = consumers[(queue.next_consumer + i) % consumers.size()];
+
+				if(this->can_deliver(*candidate)){
+					consumer = candidate;
+					queue.next_consumer = (queue.next_consumer + i + 1) % consumers.size();
+					break;
+				}
+			}
+
+			if( !consumer ){
+				return;
+			}
+
+			Queued queued = std::move(queue.messages.front());
+			queue.messages.pop_front();
+
+			Channel &ch = *consumer->channel;
+			const uint64_t tag = ++ch.next_tag;
+
+			this->deliver(ch, consumer->tag, tag, queued.redelivered, *queued.message);
+
+			if( !consumer->no_ack ){
+				ch.unacked.push_back(Unacked{tag, consumer->queue, std::move(queued.message), consumer, false});
+				++ch.unacked_count;
+				++consumer->unacked;
+			}
+		}
+	}
+
+	// Publisher confirms of the messages processed in this batch, one 'multiple' ack per channel
+	void send_confirms(Connection &c)
+	{
+		for(auto &p : c.channels){
+			Channel &ch = *p.second;
+
+			if(ch.confirm && !ch.in_publish && ch.published > ch.confirmed){
+				Encoder(c.out).method(ch.id, BASIC, 80).longlong(ch.published).octet(ch.published - ch.confirmed > 1).end();
+				ch.confirmed = ch.published;
+			}
+			else if(ch.confirm && ch.in_publish && ch.published - 1 > ch.confirmed){
+				// The last publish is not complete yet
+				Encoder(c.out).method(ch.id, BASIC, 80).longlong(ch.published - 1).octet(ch.published - 1 - ch.confirmed > 1).end();
+				ch.confirmed = ch.published - 1;
+			}
+		}
+	}
+
+	// Closing
+
+	void close_channel(Channel &ch, uint16_t code, const std::string &text, uint16_t class_id, uint16_t method_id)
+	{
+		logger.msg(MSG_TRACE, "LocalBroker: closing channel %d: %s\n", ch.id, text);
+
+		this->release(ch);
+		ch.closing = true;
+		ch.in_publish = false;
+
+		Encoder(ch.connection->out).method(ch.id, CHANNEL, 40).short_(code).shortstr(text).short_(class_id).short_(method_id).end();
+	}
+
+	void close_connection(Connection &c, uint16_t code, const std::string &text, uint16_t class_id, uint16_t method_id)
+	{
+		logger.msg(MSG_TRACE, "LocalBroker: closing connection %lu: %s\n", static_cast<unsigned long>(c.id), text);
+
+		if( !c.header ){
+			c.dead = true;
+			return;
+		}
+
+		Encoder(c.out).method(0, CONNECTION, 50).short_(code).shortstr(text).short_(class_id).short_(method_id).end();
+		c.closing = true;
+		this->release(c);
+	}
+
+	// Consumers are cancelled, unacked messages requeued
+	void release(Channel &ch)
+	{
+		std::vector<std::string> tags;
+
+		for(auto &c : ch.consumers){
+			tags.push_back(c.first);
+		}
+
+		for(auto &tag : tags){
+			this->cancel(ch, tag);
+		}
+
+		ch.reply_consumer.clear();
+		this->requeue_unacked(ch);
+	}
+
+	void release(Connection &c)
+	{
+		for(auto &p : c.channels){
+			if( !p.second->closing ){
+				this->release(*p.second);
+			}
+		}
+
+		counters.channels -= c.channels.size();
+		c.channels.clear();
+
+		// Exclusive queues are owned by the connection
+		std::vector<std::shared_ptr<Queue>> owned;
+
+		for(auto &q : queues){
+			if(q.second->owner == &c){
+				owned.push_back(q.second);
+			}
+		}
+
+		for(auto &queue : owned){
+			this->delete_queue(queue);
+		}
+	}
+
+	// Heartbeats and dead peers
+
+	void heartbeats()
+	{
+		const auto now = steady_clock::now();
+
+		for(auto &p : connections){
+			Connection &c = *p.second;
+
+			if( !c.heartbeat || c.dead ){
+				continue;
+			}
+
+			const auto interval = std::chrono::seconds(c.heartbeat);
+
+			if(now - c.last_read > 2 * interval){
+				logger.msg(MSG_DEBUG, "LocalBroker: missed heartbeats from connection %lu\n", static_cast<unsigned long>(c.id));
+				c.dead = true;
+				continue;
+			}
+
+			if(now - c.last_write >= interval / 2 && c.out.size() == c.out_pos){
+				Encoder(c.out).begin(FRAME_HEARTBEAT, 0).end();
+			}
+		}
+	}
+
+	void flush()
+	{
+		std::vector<int> closed;
+
+		for(auto &p : connections){
+			Connection &c = *p.second;
+
+			if( !c.dead && c.out_pos < c.out.size() ){
+				this->write(c);
+			}
+
+			// Closed after the close handshake (or an error) is flushed
+			if(c.dead || (c.closing && !c.header && c.out_pos == c.out.size())){
+				closed.push_back(p.first);
+			}
+		}
+
+		for(int fd : closed){
+			this->remove_connection(fd);
+		}
+	}
+
+	void write(Connection &c)
+	{
+		while(c.out_pos < c.out.size()){
+			const ssize_t sent = ::send(c.fd, c.out.data() + c.out_pos, c.out.size() - c.out_pos, MSG_NOSIGNAL);
+
+			if(sent > 0){
+				c.out_pos += sent;
+				c.last_write = steady_clock::now();
+				continue;
+			}
+
+			if(sent < 0 && errno == EINTR){
+				continue;
+			}
+
+			if(sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+				break;
+			}
+
+			c.dead = true;
+			return;
+		}
+
+		if(c.out_pos == c.out.size()){
+			c.out.clear();
+			c.out_pos = 0;
+		}
+
+		// Wait for the socket to become writable only while there is something to write
+		const bool want = c.out_pos < c.out.size();
+
+		if(want != c.epollout){
+			epoll_event ev{};
+			ev.events = want ? EPOLLIN | EPOLLOUT : EPOLLIN;
+			ev.data.fd = c.fd;
+			epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c.fd, &ev);
+			c.epollout = want;
+		}
+	}
+
+	void remove_connection(int fd)
+	{
+		auto it = connections.find(fd);
+
+		if(it == connections.end()){
+			return;
+		}
+
+		Connection &c = *it->second;
+
+		if( !c.closing ){
+			this->release(c);
+		}
+
+		by_id.erase(c.id);
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+		::close(fd);
+		connections.erase(it);
+		--counters.connections;
+	}
+};
+
+
+LocalBroker::LocalBroker():
+	LocalBroker(Options())
+{
+
+}
+
+LocalBroker::LocalBroker(const Options &options): pimpl(new Impl(options))
+{
+	pimpl->listen();
+
+	pimpl->thread = std::thread([this]{ pimpl->run(); });
+}
+
+LocalBroker::~LocalBroker()
+{
+	pimpl->stop.store(true);
+
+	uint64_t one = 1;
+	if(::write(pimpl->wakeup_fd, &one, sizeof(one)) < 0){
+		// epoll_wait timeout stops it anyway
+	}
+
+	pimpl->thread.join();
+}
+
+uint16_t LocalBroker::port() const
+{
+	return pimpl->port;
+}
+
+std::string LocalBroker::url() const
+{
+	const std::string &host = pimpl->options.host;
+	const bool ipv6 = host.find(':') != std::string::npos;
+	return "amqp://guest:guest@" + (ipv6 ? "[" + host + "]" : host) + ":" + std::to_string(pimpl->port) + "/";
+}
+
+void LocalBroker::serve(int fd)
+{
+	{
+		std::lock_guard<std::mutex> lock(pimpl->adopt_mutex);
+		pimpl->adopted.push_back(fd);
+	}
+
+	uint64_t one = 1;
+	if(::write(pimpl->wakeup_fd, &one, sizeof(one)) < 0){
+		logger.msg(MSG_ERROR, "%s%s\n", excp_method("LocalBroker: wakeup failed: "), strerror(errno));
+	}
+}
+
+LocalBroker::Stats LocalBroker::stats() const
+{
+	const auto &c = pimpl->counters;
+
+	Stats res;
+	res.connections = c.connections.load();
+	res.channels = c.channels.load();
+	res.queues = c.queues.load();
+	res.published = c.published.load();
+	res.routed = c.routed.load();
+	res.unroutable = c.unroutable.load();
+	res.delivered = c.delivered.load();
+	res.acked = c.acked.load();
+	res.requeued = c.requeued.load();
+	res.expired = c.expired.load();
+	return res;
+}
@@ -0,0 +1,44 @@
+#include <iostream>
+#include <string>
+#include <csignal>
+#include <pthread.h>
+
+#include "logger.hpp"
+#include "local_broker.hpp"
+
+/*
+	Stand-in AMQP broker for running the tutorials without RabbitMQ.
+
+	Usage:
+		local_broker_server [port]          (default 5672)
+
+	Stopped by SIGINT / SIGTERM.
+*/
+
+int main(int argc, char* argv[])
+{
+	logger.init(MSG_DEBUG);
+
+	LocalBroker::Options options;
+	options.port = argc > 1 ? static_cast<uint16_t>(std::stoi(argv[1])) : 5672;
+
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+
+	// Blocked before the broker thread starts, so it inherits the mask
+	pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+	LocalBroker broker(options);
+	logger.msg(MSG_DEBUG, "Listening on %s\n", broker.url());
+
+	int signal = 0;
+	sigwait(&signals, &signal);
+
+	const auto stats = broker.stats();
+	logger.msg(MSG_DEBUG, "Stopped: published %lu, delivered %lu, acked %lu\n",
+		static_cast<unsigned long>(stats.published), static_cast<unsigned long>(stats.delivered), static_cast<unsigned long>(stats.acked));
+
+	return 0;
+}
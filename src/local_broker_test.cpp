@@ -0,0 +1,412 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <algorithm>
+#include <cstdio>
+
+#include <amqpcpp.h>
+#include <amqpcpp/linux_tcp.h>
+
+#include "logger.hpp"
+#include "my_handler.hpp"
+#include "local_broker.hpp"
+#include "dedup_filter.hpp"
+
+/*
+	Smoke test of LocalBroker driven by AMQP-CPP through MyTcpHandler, the
+	client side the benchmarks (rpc_bench, micro_bench, perf_test) use.
+	Steps run in order on one connection, each has 5 s to pass:
+
+	* handshake   - connection.start/tune/open, channel open
+	* declare     - topic exchange, exclusive queue, binding
+	* confirms    - publishes (one body spans several frames) are all acked
+	                by publisher confirms, an unroutable one included
+	* consume     - basic.qos prefetch is filled but never exceeded, messages
+	                arrive in order and intact, acks release the next ones
+	* reply-to    - RPC round trip over direct reply-to (amq.rabbitmq.reply-to)
+	* dedup       - DedupFilter: a message rejected with requeue reaches the
+	                callback again when redelivered, a later copy with the
+	                same message-id after it was processed is dropped
+	* heartbeats  - idle for longer than two heartbeat intervals (1 s), the
+	                connection must not be reported lost
+
+	Prints "ok" or "FAIL" per step, the exit code is 0 when all passed.
+	Runs as a test: ctest -R local_broker_test
+
+	Usage:
+		local_broker_test [--url URL]		(default: in-process LocalBroker)
+*/
+
+namespace
+{
+	const char *exchange = "smoke.topic";
+	const char *queue = "smoke.queue";
+	const char *rpc_queue = "smoke.rpc";
+	const char *dedup_queue = "smoke.dedup";
+	const char *reply_to = "amq.rabbitmq.reply-to";
+
+	const uint16_t prefetch = 3;
+	const size_t messages = 20;
+
+	// Larger than the default frame_max (128 KiB), sent in several body frames
+	const size_t large_size = 3 * 131072 + 17;
+
+	class Smoke
+	{
+	public:
+
+		Smoke(MyTcpHandler &handler, AMQP::TcpConnection &connection):
+			_handler(handler), _connection(connection)
+		{
+			_steps = {
+				{"handshake", &Smoke::handshake},
+				{"declare", &Smoke::declare},
+				{"confirms", &Smoke::confirms},
+				{"consume", &Smoke::consume},
+				{"reply-to", &Smoke::reply},
+				{"dedup", &Smoke::dedup},
+				{"heartbeats", &Smoke::heartbeats}
+			};
+		}
+
+		// Runs the event loop until all steps passed or one failed
+		bool run()
+		{
+			this->start();
+			_handler.loop(&_connection);
+
+			if( !_failed && _step < _steps.size() ){
+				this->fail(_handler.connection_was_lost() ? "connection lost" : "event loop ended");
+			}
+
+			return !_failed;
+		}
+
+	private:
+
+		struct Step
+		{
+			const char *name;
+			void (Smoke::*run)();
+		};
+
+		static std::string body(size_t seq)
+		{
+			return seq == messages ? std::string(large_size, 'L') : "message " + std::to_string(seq);
+		}
+
+		void start()
+		{
+			if(_step == _steps.size()){
+				this->finish();
+				return;
+			}
+
+			// Callbacks of a finished step check it is still current
+			const size_t step = _step;
+
+			_handler.add_timer(std::chrono::seconds(5), [this, step]
+			{
+				if(step == _step) this->fail("timeout");
+			});
+
+			(this->*_steps[_step].run)();
+		}
+
+		void pass()
+		{
+			printf("ok - %s\n", _steps[_step].name);
+			++_step;
+
+			// Next step outside of the AMQP-CPP callback
+			_handler.add_timer(std::chrono::milliseconds(0), [this]{ this->start(); });
+		}
+
+		void fail(const std::string &reason)
+		{
+			if(_failed){
+				return;
+			}
+
+			printf("FAIL - %s: %s\n", _step < _steps.size() ? _steps[_step].name : "close", reason.c_str());
+			_failed = true;
+			_step = _steps.size();
+
+			_connection.close();
+			_handler.add_timer(std::chrono::seconds(1), [this]{ _handler.quit(); });
+		}
+
+		void finish()
+		{
+			_connection.close();
+			_handler.add_timer(std::chrono::seconds(1), [this]{ _handler.quit(); });
+		}
+
+		std::unique_ptr<AMQP::TcpChannel> channel()
+		{
+			auto channel = std::make_unique<AMQP::TcpChannel>(&_connection);
+
+			channel->onError([this](const char *message)
+			{
+				this->fail(std::string("channel error: ") + message);
+			});
+
+			return channel;
+		}
+
+		void handshake()
+		{
+			_channel = this->channel();
+			_channel->onReady([this]{ this->pass(); });
+		}
+
+		void declare()
+		{
+			_channel->declareExchange(exchange, AMQP::topic);
+			_channel->declareQueue(queue, AMQP::exclusive);
+			_channel->bindQueue(exchange, queue, "smoke.*").onSuccess([this]{ this->pass(); });
+		}
+
+		void confirms()
+		{
+			_publisher = this->channel();
+
+			_publisher->confirmSelect()
+				.onSuccess([this]
+				{
+					for(size_t seq = 1; seq <= messages; ++seq){
+						_publisher->publish(exchange, "smoke.data", Smoke::body(seq));
+					}
+
+					// Unroutable: confirmed as well
+					_publisher->publish(exchange, "other.data", "nowhere");
+				})
+				.onAck([this](uint64_t deliveryTag, bool multiple)
+				{
+					if(deliveryTag <= _confirmed || (!multiple && deliveryTag != _confirmed + 1)){
+						this->fail("unexpected ack " + std::to_string(deliveryTag));
+						return;
+					}
+
+					_confirmed = deliveryTag;
+
+					if(_confirmed == messages + 1){
+						this->pass();
+					}
+				})
+				.onNack([this](uint64_t deliveryTag, bool multiple, bool requeue)
+				{
+					this->fail("nack " + std::to_string(deliveryTag));
+				});
+		}
+
+		void consume()
+		{
+			_consumer = this->channel();
+			_consumer->setQos(prefetch);
+
+			_consumer->consume(queue).onReceived([this](const AMQP::Message &message, uint64_t deliveryTag, bool redelivered)
+			{
+				const std::string expected = Smoke::body(++_received);
+
+				if(std::string(message.body(), message.bodySize()) != expected){
+					this->fail("message " + std::to_string(_received) + ": unexpected body of " + std::to_string(message.bodySize()) + " bytes");
+					return;
+				}
+
+				if(++_unacked > prefetch){
+					this->fail("prefetch exceeded: " + std::to_string(_unacked) + " unacked");
+					return;
+				}
+
+				_max_unacked = std::max(_max_unacked, _unacked);
+
+				// Held for a while, so the prefetch window fills up
+				_handler.add_timer(std::chrono::milliseconds(5), [this, deliveryTag]
+				{
+					_consumer->ack(deliveryTag);
+					--_unacked;
+					++_acked;
+
+					if(_acked < messages){
+						return;
+					}
+
+					if(_max_unacked != prefetch){
+						this->fail("prefetch not filled: at most " + std::to_string(_max_unacked) + " unacked");
+						return;
+					}
+
+					this->pass();
+				});
+			});
+		}
+
+		void reply()
+		{
+			_server = this->channel();
+
+			_server->declareQueue(rpc_queue, AMQP::exclusive);
+			_server->consume(rpc_queue).onReceived([this](const AMQP::Message &message, uint64_t deliveryTag, bool redelivered)
+			{
+				const std::string response = "re: " + std::string(message.body(), message.bodySize());
+
+				AMQP::Envelope envelope(response.data(), response.size());
+				envelope.setCorrelationID(message.correlationID());
+
+				_server->publish("", message.replyTo(), envelope);
+				_server->ack(deliveryTag);
+			});
+
+			_client = this->channel();
+
+			// Direct reply-to requires noack
+			_client->consume(reply_to, AMQP::noack)
+				.onSuccess([this](const std::string &consumer_tag)
+				{
+					const std::string request = "ping";
+
+					AMQP::Envelope envelope(request.data(), request.size());
+					envelope.setReplyTo(reply_to);
+					envelope.setCorrelationID("42");
+
+					_client->publish("", rpc_queue, envelope);
+				})
+				.onReceived([this](const AMQP::Message &message, uint64_t deliveryTag, bool redelivered)
+				{
+					if(message.correlationID() != "42" || std::string(message.body(), message.bodySize()) != "re: ping"){
+						this->fail("unexpected reply");
+						return;
+					}
+
+					this->pass();
+				});
+		}
+
+		void dedup()
+		{
+			_deduped = this->channel();
+			_deduped->setQos(1);
+			// Published by another channel: only after the queue exists
+			_deduped->declareQueue(dedup_queue, AMQP::exclusive).onSuccess([this](const std::string &name, int msgcount, int consumercount)
+			{
+				this->publish_duplicate();
+			});
+
+			_deduped->consume(dedup_queue).onReceived(_dedup.wrap(*_deduped, [this](const AMQP::Message &message, uint64_t deliveryTag, bool redelivered)
+			{
+				switch(++_dedup_calls){
+				case 1:
+					// Asked for a retry: must not be remembered
+					_deduped->reject(deliveryTag, AMQP::requeue);
+					return false;
+
+				case 2:
+					if( !redelivered ){
+						this->fail("requeued message not redelivered");
+						return false;
+					}
+
+					_deduped->ack(deliveryTag);
+
+					// The same message again, now it is a duplicate
+					this->publish_duplicate();
+
+					_handler.add_timer(std::chrono::milliseconds(200), [this]
+					{
+						const auto stats = _dedup.stats();
+
+						if(stats.duplicates != 1){
+							this->fail("duplicate not dropped: " + std::to_string(stats.duplicates) + " duplicates");
+							return;
+						}
+
+						if(_dedup_calls == 2){
+							this->pass();
+						}
+					});
+
+					return true;
+
+				default:
+					this->fail("duplicate reached the callback");
+					return true;
+				}
+			}));
+		}
+
+		void publish_duplicate()
+		{
+			const std::string body = "once";
+
+			AMQP::Envelope envelope(body.data(), body.size());
+			envelope.setMessageID("smoke-1");
+
+			_channel->publish("", dedup_queue, envelope);
+		}
+
+		void heartbeats()
+		{
+			// Silence for two intervals would end the loop with the connection lost
+			_handler.add_timer(std::chrono::milliseconds(2500), [this]{ this->pass(); });
+		}
+
+		MyTcpHandler &_handler;
+		AMQP::TcpConnection &_connection;
+
+		std::vector<Step> _steps;
+		size_t _step = 0;
+		bool _failed = false;
+
+		std::unique_ptr<AMQP::TcpChannel> _channel;
+		std::unique_ptr<AMQP::TcpChannel> _publisher;
+		std::unique_ptr<AMQP::TcpChannel> _consumer;
+		std::unique_ptr<AMQP::TcpChannel> _server;
+		std::unique_ptr<AMQP::TcpChannel> _client;
+		std::unique_ptr<AMQP::TcpChannel> _deduped;
+
+		uint64_t _confirmed = 0;
+		size_t _received = 0;
+		size_t _acked = 0;
+		uint16_t _unacked = 0;
+		uint16_t _max_unacked = 0;
+
+		DedupFilter _dedup;
+		size_t _dedup_calls = 0;
+	};
+}
+
+
+int main(int argc, char* argv[])
+{
+	logger.init(MSG_ERROR);
+
+	std::string url;
+
+	if(argc == 3 && std::string(argv[1]) == "--url"){
+		url = argv[2];
+	}
+	else if(argc != 1){
+		std::cerr << "Usage: " << argv[0] << " [--url URL]" << std::endl;
+		return 1;
+	}
+
+	std::unique_ptr<LocalBroker> broker;
+
+	if(url.empty()){
+		broker = std::make_unique<LocalBroker>();
+		url = broker->url();
+	}
+
+	MyTcpHandler handler;
+
+	// Short interval, so the 'heartbeats' step sees them both ways
+	handler.set_heartbeat(1);
+
+	AMQP::TcpConnection connection(&handler, AMQP::Address(url));
+	Smoke smoke(handler, connection);
+
+	return smoke.run() ? 0 : 1;
+}
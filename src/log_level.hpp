@@ -0,0 +1,34 @@
+#pragma once
+
+#include "async_log.hpp"
+
+/*
+	Compile-time log level.
+
+	LOG_MSG(level, format, ...) is AsyncLog::msg() for the levels up to
+	LOG_LEVEL, the more verbose ones compile to nothing: the arguments are
+	not evaluated and no call is made. The runtime level (AsyncLog::Options,
+	logger.init()) still filters the compiled ones.
+
+	LOG_LEVEL is set by CMake (-DLOG_LEVEL=MSG_DEBUG), MSG_DEBUG by default
+	in Release builds, everything is compiled otherwise.
+
+	Usage:
+		LOG_MSG(MSG_TRACE, "monitor: fd: %d, flags: %d\n", fd, flags);
+*/
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL MSG_TRACE
+#endif
+
+constexpr bool log_compiled(int level)
+{
+	return level <= LOG_LEVEL;
+}
+
+#define LOG_MSG(level, ...) \
+	do{ \
+		if constexpr(log_compiled(level)){ \
+			AsyncLog::msg(level, __VA_ARGS__); \
+		} \
+	}while(0)
@@ -0,0 +1,184 @@
+#pragma once
+
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include <cstdint>
+#include <cstddef>
+
+// Fixed capacity LRU map.
+//
+// Entries live in a preallocated vector and are linked by indexes, so there are 
+// no allocations per entry except of the index hash map nodes.
+// Not thread-safe.
+
+template<typename Key, typename Value, typename Hash = std::hash<Key>>
+class LruCache
+{
+public:
+
+	explicit LruCache(size_t capacity): _capacity(capacity ? capacity : 1)
+	{
+		_nodes.reserve(_capacity);
+		_index.reserve(_capacity);
+	}
+
+	// Find entry and mark it as most recently used
+	Value* find(const Key &key)
+	{
+		auto it = _index.find(key);
+
+		if(it == _index.end()){
+			return nullptr;
+		}
+
+		this->unlink(it->second);
+		this->push_front(it->second);
+		return &_nodes[it->second].value;
+	}
+
+	// Find entry without touching its position
+	const Value* peek(const Key &key) const
+	{
+		auto it = _index.find(key);
+		return it == _index.end() ? nullptr : &_nodes[it->second].value;
+	}
+
+	// Insert or overwrite entry. The least recently used one is evicted if cache is full.
+	// Evicted entry is passed to on_evict callback (if any) before it is overwritten.
+	Value& insert(const Key &key, Value value)
+	{
+		auto it = _index.find(key);
+
+		if(it != _index.end()){
+			Node &node = _nodes[it->second];
+			node.value = std::move(value);
+			this->unlink(it->second);
+			this->push_front(it->second);
+			return node.value;
+		}
+
+		uint32_t idx;
+
+		if(_nodes.size() < _capacity){
+			idx = static_cast<uint32_t>(_nodes.size());
+			_nodes.push_back(Node{key, std::move(value), npos, npos});
+		}
+		else if(_free != npos){
+			idx = _free;
+			_free = _nodes[idx].next;
+			_nodes[idx].key = key;
+			_nodes[idx].value = std::move(value);
+		}
+		else{
+			// Reuse the least recently used node
+			idx = _tail;
+			this->unlink(idx);
+			_index.erase(_nodes[idx].key);
+
+			if(on_evict){
+				on_evict(_nodes[idx].key, _nodes[idx].value);
+			}
+
+			_nodes[idx].key = key;
+			_nodes[idx].value = std::move(value);
+		}
+
+		this->push_front(idx);
+		_index.emplace(key, idx);
+		return _nodes[idx].value;
+	}
+
+	bool erase(const Key &key)
+	{
+		auto it = _index.find(key);
+
+		if(it == _index.end()){
+			return false;
+		}
+
+		uint32_t idx = it->second;
+		_index.erase(it);
+		this->unlink(idx);
+
+		// Keep the node for reuse
+		_nodes[idx].value = Value();
+		_nodes[idx].next = _free;
+		_free = idx;
+		return true;
+	}
+
+	// Least recently used entry (nullptr if empty)
+	const Key* oldest() const
+	{
+		return _tail == npos ? nullptr : &_nodes[_tail].key;
+	}
+
+	void clear()
+	{
+		_nodes.clear();
+		_index.clear();
+		_head = _tail = _free = npos;
+	}
+
+	size_t size() const { return _index.size(); }
+	size_t capacity() const { return _capacity; }
+
+	// Approximate memory used by the cache structures (excluding memory owned by keys and values)
+	size_t memory_usage() const
+	{
+		// unordered_map node: key, value index, next pointer and cached hash
+		constexpr size_t index_node = sizeof(Key) + sizeof(uint32_t) + 2 * sizeof(void*);
+
+		return _nodes.capacity() * sizeof(Node) 
+			+ _index.bucket_count() * sizeof(void*) 
+			+ _index.size() * index_node;
+	}
+
+	std::function<void(const Key&, Value&)> on_evict;
+
+private:
+
+	static constexpr uint32_t npos = UINT32_MAX;
+
+	struct Node
+	{
+		Key key;
+		Value value;
+		uint32_t prev;
+		uint32_t next;
+	};
+
+	size_t _capacity;
+	std::vector<Node> _nodes;
+	std::unordered_map<Key, uint32_t, Hash> _index;
+
+	uint32_t _head = npos;		// most recently used
+	uint32_t _tail = npos;		// least recently used
+	uint32_t _free = npos;		// list of erased nodes
+
+	void unlink(uint32_t idx)
+	{
+		Node &node = _nodes[idx];
+
+		if(node.prev != npos) _nodes[node.prev].next = node.next;
+		else _head = node.next;
+
+		if(node.next != npos) _nodes[node.next].prev = node.prev;
+		else _tail = node.prev;
+
+		node.prev = node.next = npos;
+	}
+
+	void push_front(uint32_t idx)
+	{
+		Node &node = _nodes[idx];
+		node.prev = npos;
+		node.next = _head;
+
+		if(_head != npos) _nodes[_head].prev = idx;
+		_head = idx;
+
+		if(_tail == npos) _tail = idx;
+	}
+};
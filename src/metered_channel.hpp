@@ -0,0 +1,115 @@
+#pragma once
+
+#include <string>
+#include <cstring>
+#include <cstdint>
+
+#include <amqpcpp.h>
+#include <amqpcpp/linux_tcp.h>
+
+#include "metrics.hpp"
+#include "probes.hpp"
+
+// TcpChannel counting its traffic in Metrics.
+//
+// Publishes, acks and rejects made through MeteredChannel are counted (the
+// methods hide the ones of AMQP::Channel, so call them on MeteredChannel).
+// Deliveries and confirms are counted by the wrapped callbacks (publish,
+// deliver, ack and reject are USDT probes too, see probes.hpp):
+//
+//     channel.consume(queue).onReceived(channel.wrap_received(callback));
+//     channel.confirmSelect().onAck(channel.wrap_ack(on_ack)).onNack(channel.wrap_nack(on_nack));
+//
+// The channel counts as open for the lifetime of the object.
+
+class MeteredChannel : public AMQP::TcpChannel
+{
+public:
+
+	explicit MeteredChannel(AMQP::TcpConnection *connection): AMQP::TcpChannel(connection)
+	{
+		Metrics::add(Metrics::CHANNELS_OPENED);
+	}
+
+	~MeteredChannel()
+	{
+		Metrics::add(Metrics::CHANNELS_CLOSED);
+	}
+
+	bool publish(const std::string &exchange, const std::string &routingKey, const AMQP::Envelope &envelope, int flags = 0)
+	{
+		published(envelope.bodySize());
+		return AMQP::TcpChannel::publish(exchange, routingKey, envelope, flags);
+	}
+
+	bool publish(const std::string &exchange, const std::string &routingKey, const std::string &message, int flags = 0)
+	{
+		published(message.size());
+		return AMQP::TcpChannel::publish(exchange, routingKey, message, flags);
+	}
+
+	bool publish(const std::string &exchange, const std::string &routingKey, const char *message, size_t size, int flags = 0)
+	{
+		published(size);
+		return AMQP::TcpChannel::publish(exchange, routingKey, message, size, flags);
+	}
+
+	bool publish(const std::string &exchange, const std::string &routingKey, const char *message, int flags = 0)
+	{
+		return this->publish(exchange, routingKey, message, strlen(message), flags);
+	}
+
+	bool ack(uint64_t deliveryTag, int flags = 0)
+	{
+		PROBE1(ack, deliveryTag);
+		Metrics::add(Metrics::ACKS);
+		return AMQP::TcpChannel::ack(deliveryTag, flags);
+	}
+
+	bool reject(uint64_t deliveryTag, int flags = 0)
+	{
+		PROBE1(reject, deliveryTag);
+		Metrics::add(Metrics::REJECTS);
+		return AMQP::TcpChannel::reject(deliveryTag, flags);
+	}
+
+	// onReceived() callback counting deliveries
+	static AMQP::MessageCallback wrap_received(AMQP::MessageCallback callback)
+	{
+		return [callback = std::move(callback)](const AMQP::Message &message, uint64_t deliveryTag, bool redelivered)
+		{
+			PROBE2(deliver, deliveryTag, message.bodySize());
+			Metrics::add(Metrics::DELIVERIES);
+			Metrics::add(Metrics::DELIVERED_BYTES, message.bodySize());
+			callback(message, deliveryTag, redelivered);
+		};
+	}
+
+	// Publisher confirms callbacks counting acks and nacks
+	static AMQP::AckCallback wrap_ack(AMQP::AckCallback callback)
+	{
+		return [callback = std::move(callback)](uint64_t deliveryTag, bool multiple)
+		{
+			Metrics::add(Metrics::CONFIRMS_ACKED);
+			callback(deliveryTag, multiple);
+		};
+	}
+
+	static AMQP::NackCallback wrap_nack(AMQP::NackCallback callback)
+	{
+		return [callback = std::move(callback)](uint64_t deliveryTag, bool multiple, bool requeue)
+		{
+			Metrics::add(Metrics::CONFIRMS_NACKED);
+			callback(deliveryTag, multiple, requeue);
+		};
+	}
+
+private:
+
+	static void published(uint64_t bytes)
+	{
+		PROBE1(publish, bytes);
+		Metrics::add(Metrics::PUBLISHED);
+		Metrics::add(Metrics::PUBLISHED_BYTES, bytes);
+	}
+};
@@ -0,0 +1,373 @@
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+
+extern "C"{
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+}
+
+#include <atomic>
+#include <thread>
+#include <system_error>
+
+#include "logger.hpp"
+#include "metrics.hpp"
+
+
+namespace
+{
+	struct Description
+	{
+		const char *name;
+		const char *help;
+	};
+
+	const Description descriptions[Metrics::COUNTERS] = {
+		{"connections_total", "TCP connections established"},
+		{"connections_lost_total", "TCP connections closed or lost"},
+		{"connection_errors_total", "Fatal connection errors"},
+		{"reconnects_total", "Connections attached to a handler after its first one"},
+		{"channels_opened_total", "Channels opened"},
+		{"channels_closed_total", "Channels closed"},
+		{"published_total", "Messages published"},
+		{"published_bytes_total", "Body bytes published"},
+		{"confirms_acked_total", "Publisher confirm acks received"},
+		{"confirms_nacked_total", "Publisher confirm nacks received"},
+		{"deliveries_total", "Messages delivered to consumers"},
+		{"delivered_bytes_total", "Body bytes delivered to consumers"},
+		{"acks_total", "Acks sent by consumers"},
+		{"rejects_total", "Rejects and nacks sent by consumers"},
+		{"heartbeats_received_total", "Heartbeats received from the broker"},
+		{"heartbeats_sent_total", "Heartbeats sent to the broker"},
+		{"heartbeat_failures_total", "Heartbeats that could not be sent"},
+	};
+
+	// Counters of a thread, written by the owner only
+	struct alignas(64) Block
+	{
+		std::atomic<uint64_t> counts[Metrics::COUNTERS];
+		std::atomic<bool> in_use{true};
+		Block *next = nullptr;
+
+		Block()
+		{
+			for(auto &count : counts){
+				count.store(0, std::memory_order_relaxed);
+			}
+		}
+	};
+
+	std::atomic<Block *> blocks{nullptr};
+
+	// Free block of an exited thread or a new one
+	Block *acquire()
+	{
+		for(Block *block = blocks.load(std::memory_order_acquire); block; block = block->next){
+			bool in_use = false;
+
+			if( !block->in_use.load(std::memory_order_relaxed) && block->in_use.compare_exchange_strong(in_use, true, std::memory_order_acquire) ){
+				return block;
+			}
+		}
+
+		// Never freed: the sums include counts of exited threads
+		Block *block = new Block;
+		block->next = blocks.load(std::memory_order_relaxed);
+
+		while( !blocks.compare_exchange_weak(block->next, block, std::memory_order_release, std::memory_order_relaxed) ){
+
+		}
+
+		return block;
+	}
+
+	struct ThreadBlock
+	{
+		Block *block = nullptr;
+
+		~ThreadBlock()
+		{
+			if(block){
+				block->in_use.store(false, std::memory_order_release);
+			}
+		}
+	};
+
+	thread_local ThreadBlock thread_block;
+}
+
+
+void Metrics::add(Counter counter, uint64_t n)
+{
+	Block *block = thread_block.block;
+
+	if( !block ){
+		block = thread_block.block = acquire();
+	}
+
+	// Single writer: no read-modify-write needed
+	std::atomic<uint64_t> &count = block->counts[counter];
+	count.store(count.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+Metrics::Totals Metrics::totals()
+{
+	Totals res{};
+
+	for(Block *block = blocks.load(std::memory_order_acquire); block; block = block->next){
+		for(unsigned i = 0; i < COUNTERS; ++i){
+			res[i] += block->counts[i].load(std::memory_order_relaxed);
+		}
+	}
+
+	return res;
+}
+
+std::string Metrics::format(const std::string &prefix)
+{
+	const Totals t = Metrics::totals();
+	std::string res;
+	char line[128];
+
+	auto metric = [&](const char *name, const char *help, const char *type, uint64_t value)
+	{
+		res.append("# HELP ").append(prefix).append(name).append(" ").append(help).append("\n");
+		res.append("# TYPE ").append(prefix).append(name).append(" ").append(type).append("\n");
+
+		snprintf(line, sizeof(line), " %llu\n", static_cast<unsigned long long>(value));
+		res.append(prefix).append(name).append(line);
+	};
+
+	for(unsigned i = 0; i < COUNTERS; ++i){
+		metric(descriptions[i].name, descriptions[i].help, "counter", t[i]);
+	}
+
+	// Counters of other threads are read a bit later, so a difference may be negative for a moment
+	auto difference = [](uint64_t a, uint64_t b){ return a > b ? a - b : 0; };
+
+	metric("connections_open", "Connections established and not lost", "gauge", difference(t[CONNECTIONS], t[CONNECTIONS_LOST]));
+	metric("channels_open", "Channels opened and not closed", "gauge", difference(t[CHANNELS_OPENED], t[CHANNELS_CLOSED]));
+
+	return res;
+}
+
+
+struct MetricsExporter::Impl
+{
+	Options options;
+
+	int listen_fd = -1;
+	int wakeup_fd = -1;
+	uint16_t port = 0;
+
+	std::atomic<bool> stop{false};
+	std::atomic<uint64_t> scrapes{0};
+	std::thread thread;
+
+	explicit Impl(const Options &o): options(o)
+	{
+
+	}
+
+	~Impl()
+	{
+		if(listen_fd > -1) ::close(listen_fd);
+		if(wakeup_fd > -1) ::close(wakeup_fd);
+	}
+
+	void listen()
+	{
+		wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+		if(wakeup_fd < 0){
+			throw std::system_error(errno, std::generic_category(), "MetricsExporter: eventfd");
+		}
+
+		if(options.port < 0){
+			return;
+		}
+
+		addrinfo hints{};
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+
+		addrinfo *res = nullptr;
+		const std::string service = std::to_string(options.port);
+
+		if(getaddrinfo(options.host.c_str(), service.c_str(), &hints, &res) != 0 || !res){
+			throw std::system_error(EINVAL, std::generic_category(), "MetricsExporter: can't resolve " + options.host);
+		}
+
+		listen_fd = socket(res->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+		int on = 1;
+		setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+		if(listen_fd < 0 || bind(listen_fd, res->ai_addr, res->ai_addrlen) < 0 || ::listen(listen_fd, 16) < 0){
+			const int err = errno;
+			freeaddrinfo(res);
+			throw std::system_error(err, std::generic_category(), "MetricsExporter: can't listen on " + options.host + ":" + service);
+		}
+
+		freeaddrinfo(res);
+
+		sockaddr_storage addr{};
+		socklen_t len = sizeof(addr);
+		getsockname(listen_fd, reinterpret_cast<sockaddr *>(&addr), &len);
+		port = ntohs(addr.ss_family == AF_INET6 ? reinterpret_cast<sockaddr_in6 *>(&addr)->sin6_port : reinterpret_cast<sockaddr_in *>(&addr)->sin_port);
+	}
+
+	void run()
+	{
+		using steady_clock = std::chrono::steady_clock;
+		auto next_snapshot = steady_clock::now() + options.interval;
+
+		pollfd fds[2] = {{wakeup_fd, POLLIN, 0}, {listen_fd, POLLIN, 0}};
+		const nfds_t nfds = listen_fd > -1 ? 2 : 1;
+
+		while( !stop.load() ){
+			int timeout = -1;
+
+			if( !options.file.empty() ){
+				const auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(next_snapshot - steady_clock::now());
+				timeout = static_cast<int>(std::max<int64_t>(wait.count(), 0));
+			}
+
+			if(poll(fds, nfds, timeout) < 0 && errno != EINTR){
+				logger.msg(MSG_ERROR, "MetricsExporter: poll failed: %s\n", strerror(errno));
+				break;
+			}
+
+			if(nfds > 1 && (fds[1].revents & POLLIN)){
+				this->serve();
+			}
+
+			if( !options.file.empty() && steady_clock::now() >= next_snapshot ){
+				this->write_file();
+				next_snapshot = steady_clock::now() + options.interval;
+			}
+		}
+
+		if( !options.file.empty() ){
+			this->write_file();
+		}
+	}
+
+	// One request per connection, served on the exporter thread
+	void serve()
+	{
+		int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+
+		if(fd < 0){
+			return;
+		}
+
+		// A stuck client must not block the exporter for long
+		timeval timeout{1, 0};
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+		std::string request;
+		char buf[1024];
+
+		while(request.find("\r\n\r\n") == std::string::npos && request.size() < 8192){
+			ssize_t res = ::read(fd, buf, sizeof(buf));
+
+			if(res <= 0){
+				break;
+			}
+
+			request.append(buf, res);
+		}
+
+		const size_t end = request.find(' ', 4);
+		const std::string path = request.compare(0, 4, "GET ") == 0 && end != std::string::npos ? request.substr(4, end - 4) : "";
+
+		std::string status = "200 OK";
+		std::string body;
+
+		if(path == "/metrics" || path == "/"){
+			body = Metrics::format(options.prefix);
+			++scrapes;
+		}
+		else{
+			status = "404 Not Found";
+			body = "Not found, try /metrics\n";
+		}
+
+		std::string response = "HTTP/1.1 " + status + "\r\n"
+			"Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+			"Content-Length: " + std::to_string(body.size()) + "\r\n"
+			"Connection: close\r\n\r\n" + body;
+
+		size_t sent = 0;
+
+		while(sent < response.size()){
+			ssize_t res = ::send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+
+			if(res <= 0){
+				break;
+			}
+
+			sent += res;
+		}
+
+		::close(fd);
+	}
+
+	// Readers never see a partial file
+	void write_file()
+	{
+		const std::string tmp = options.file + ".tmp";
+		const std::string body = Metrics::format(options.prefix);
+
+		FILE *file = fopen(tmp.c_str(), "w");
+
+		if( !file ){
+			logger.msg(MSG_ERROR, "MetricsExporter: can't open '%s': %s\n", tmp, strerror(errno));
+			return;
+		}
+
+		const bool written = fwrite(body.data(), 1, body.size(), file) == body.size();
+
+		if(fclose(file) != 0 || !written || rename(tmp.c_str(), options.file.c_str()) != 0){
+			logger.msg(MSG_ERROR, "MetricsExporter: can't write '%s': %s\n", options.file, strerror(errno));
+		}
+	}
+};
+
+
+MetricsExporter::MetricsExporter(const Options &options): pimpl(new Impl(options))
+{
+	pimpl->listen();
+
+	pimpl->thread = std::thread([this]{ pimpl->run(); });
+}
+
+MetricsExporter::~MetricsExporter()
+{
+	pimpl->stop.store(true);
+
+	uint64_t one = 1;
+	if(::write(pimpl->wakeup_fd, &one, sizeof(one)) < 0){
+		// The counter is non-zero already
+	}
+
+	pimpl->thread.join();
+}
+
+uint16_t MetricsExporter::port() const
+{
+	return pimpl->port;
+}
+
+uint64_t MetricsExporter::scrapes() const
+{
+	return pimpl->scrapes.load();
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <string>
+#include <array>
+#include <memory>
+#include <chrono>
+#include <cstdint>
+
+/*
+	Client metrics in Prometheus text format.
+
+	Counters are process-wide and fed by MyTcpHandler callbacks (connections,
+	reconnects, errors, heartbeats) and MeteredChannel (channels, publishes,
+	confirms, deliveries, acks). Every thread counts into its own block of
+	counters (relaxed atomics written by the owner only), blocks are summed on
+	scrape, so counting on the hot path never contends. Blocks of exited
+	threads are reused by new ones, counts are never lost.
+
+	MetricsExporter serves the counters over HTTP (GET /metrics) on a local
+	port and/or writes them to a file every interval (atomically, via rename),
+	e.g. for node_exporter textfile collector.
+
+	Usage:
+		MetricsExporter::Options options;
+		options.port = 9419;
+		MetricsExporter exporter(options);	// curl http://127.0.0.1:9419/metrics
+*/
+
+class Metrics
+{
+public:
+
+	enum Counter : unsigned
+	{
+		CONNECTIONS,			// TCP connections established
+		CONNECTIONS_LOST,
+		CONNECTION_ERRORS,
+		RECONNECTS,				// connections attached to a handler after its first one
+		CHANNELS_OPENED,
+		CHANNELS_CLOSED,
+		PUBLISHED,
+		PUBLISHED_BYTES,
+		CONFIRMS_ACKED,			// basic.ack frames of publisher confirms
+		CONFIRMS_NACKED,
+		DELIVERIES,
+		DELIVERED_BYTES,
+		ACKS,					// basic.ack frames sent by consumers
+		REJECTS,				// basic.reject/nack frames sent by consumers
+		HEARTBEATS_RECEIVED,
+		HEARTBEATS_SENT,
+		HEARTBEAT_FAILURES,
+		COUNTERS
+	};
+
+	using Totals = std::array<uint64_t, COUNTERS>;
+
+	// Count on the calling thread. Lock-free, thread-safe.
+	static void add(Counter counter, uint64_t n = 1);
+
+	// Sum of all the threads
+	static Totals totals();
+
+	/**
+	 *  Prometheus text exposition format (version 0.0.4)
+	 *  @param  prefix          Prefix of the metric names
+	 */
+	static std::string format(const std::string &prefix = "amqp_client_");
+};
+
+
+class MetricsExporter
+{
+public:
+
+	struct Options
+	{
+		std::string host = "127.0.0.1";
+		int port = -1;							// HTTP port, 0 - ephemeral, -1 - no HTTP
+		std::string file;						// snapshot file, empty - none
+		std::chrono::milliseconds interval{10000};	// snapshot period
+		std::string prefix = "amqp_client_";
+	};
+
+	// Listens (throws std::system_error if it can't) and starts the exporter thread
+	explicit MetricsExporter(const Options &options);
+
+	// Stops the thread, the last snapshot is written
+	~MetricsExporter();
+
+	MetricsExporter(const MetricsExporter &) = delete;
+	MetricsExporter &operator=(const MetricsExporter &) = delete;
+
+	// HTTP port, 0 if not listening
+	uint16_t port() const;
+
+	// Scrapes served
+	uint64_t scrapes() const;
+
+private:
+
+	struct Impl;
+	std::unique_ptr<Impl> pimpl;
+};
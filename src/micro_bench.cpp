@@ -0,0 +1,531 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <chrono>
+#include <algorithm>
+#include <new>
+#include <cstdio>
+#include <cstdlib>
+
+#include <amqpcpp.h>
+#include <amqpcpp/linux_tcp.h>
+
+#include "logger.hpp"
+#include "log_level.hpp"
+#include "my_handler.hpp"
+#include "local_broker.hpp"
+#include "alloc_tracker.hpp"
+
+/*
+	Microbenchmarks of the client hot paths (cmake --build . --target bench).
+
+	Every benchmark reports the best ns/op of a few runs and allocations
+	(count and bytes) per op made on the benchmark thread. The client is
+	connected to the in-process LocalBroker, whose thread is not counted.
+
+		loop_idle           MyTcpHandler::loop() iteration, socket idle (select + timers)
+		loop_busy           loop() iteration while the socket delivers a flood of messages
+		publish_16b         channel.publish() of a small message, flushed to the broker
+		publish_64k         the same with a 64 KiB body
+		consume_ack         delivery of a queued message and its ack (prefetch 256)
+		heartbeat           server heartbeat handling (reply frame is sent)
+		logger_filtered     logger.msg() below the runtime level
+		logger_filtered_str the same with a std::string argument built per call
+		log_msg_trace       LOG_MSG(MSG_TRACE, ...) with the std::string argument: compiled out
+		                    with -DLOG_LEVEL=MSG_DEBUG, filtered at runtime otherwise
+
+	Usage:
+		micro_bench [--repeat 5] [--scale 1.0] [name ...]
+*/
+
+namespace
+{
+	using steady_clock = std::chrono::steady_clock;
+}
+
+#ifndef ALLOC_TRACKER
+
+// Allocations made by the benchmark thread (AllocTracker counts them when enabled)
+namespace
+{
+	thread_local uint64_t allocations = 0;
+	thread_local uint64_t allocated_bytes = 0;
+}
+
+void *operator new(size_t size)
+{
+	++allocations;
+	allocated_bytes += size;
+
+	if(void *ptr = std::malloc(size ? size : 1)){
+		return ptr;
+	}
+
+	throw std::bad_alloc();
+}
+
+void *operator new[](size_t size)
+{
+	return ::operator new(size);
+}
+
+void operator delete(void *ptr) noexcept
+{
+	std::free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+	std::free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+	std::free(ptr);
+}
+
+void operator delete[](void *ptr, size_t) noexcept
+{
+	std::free(ptr);
+}
+
+#endif
+
+namespace
+{
+	AllocTracker::ThreadCounters thread_allocations()
+	{
+#ifdef ALLOC_TRACKER
+		return AllocTracker::this_thread();
+#else
+		AllocTracker::ThreadCounters res;
+		res.allocations = allocations;
+		res.bytes = allocated_bytes;
+		return res;
+#endif
+	}
+
+	struct Result
+	{
+		uint64_t ops = 0;
+		steady_clock::duration elapsed{};
+		uint64_t allocations = 0;
+		uint64_t bytes = 0;
+
+		double ns_per_op() const
+		{
+			return ops ? std::chrono::duration<double, std::nano>(elapsed).count() / ops : 0;
+		}
+	};
+
+	// Measures the time and the allocations between start() and stop()
+	class Meter
+	{
+	public:
+
+		void start()
+		{
+			_start_allocations = thread_allocations();
+			_start = steady_clock::now();
+		}
+
+		void stop(uint64_t ops)
+		{
+			_result.elapsed = steady_clock::now() - _start;
+
+			const auto allocated = thread_allocations();
+			_result.ops = ops;
+			_result.allocations = allocated.allocations - _start_allocations.allocations;
+			_result.bytes = allocated.bytes - _start_allocations.bytes;
+		}
+
+		const Result &result() const
+		{
+			return _result;
+		}
+
+	private:
+		steady_clock::time_point _start;
+		AllocTracker::ThreadCounters _start_allocations;
+		Result _result;
+	};
+
+	// Client connected to the in-process broker
+	class Fixture
+	{
+	public:
+
+		Fixture():
+			_connection(&_handler, AMQP::Address(_broker.url())), _channel(&_connection)
+		{
+			_channel.onError([](const char *message)
+			{
+				logger.msg(MSG_ERROR, "micro_bench: channel error: %s\n", message);
+			});
+
+			_channel.declareQueue(queue).onSuccess([this]{ _handler.quit(); });
+			_handler.loop(&_connection);
+		}
+
+		~Fixture()
+		{
+			_connection.close();
+			_handler.loop(&_connection);
+		}
+
+		MyTcpHandler &handler()
+		{
+			return _handler;
+		}
+
+		AMQP::TcpConnection &connection()
+		{
+			return _connection;
+		}
+
+		AMQP::TcpChannel &channel()
+		{
+			return _channel;
+		}
+
+		// Run the event loop until quit()
+		void run()
+		{
+			_handler.loop(&_connection);
+		}
+
+		// Round trip to the broker: everything sent before has been processed
+		void sync(std::function<void()> then)
+		{
+			_channel.declareQueue(queue, AMQP::passive).onSuccess([then = std::move(then)]{ then(); });
+		}
+
+		// Fill the queue (not measured)
+		void fill(uint64_t count, size_t size)
+		{
+			const std::string body(size, 'x');
+
+			for(uint64_t i = 0; i < count; ++i){
+				_channel.publish("", queue, body);
+			}
+
+			this->sync([this]{ _handler.quit(); });
+			this->run();
+		}
+
+		static constexpr const char *queue = "micro_bench";
+
+	private:
+		LocalBroker _broker;
+		MyTcpHandler _handler;
+		AMQP::TcpConnection _connection;
+		AMQP::TcpChannel _channel;
+	};
+
+	// Timer re-armed on every loop iteration
+	class Ticker
+	{
+	public:
+
+		Ticker(MyTcpHandler &handler, std::function<bool()> more): _handler(handler), _more(std::move(more))
+		{
+
+		}
+
+		void start()
+		{
+			_handler.add_timer(std::chrono::milliseconds(0), [this]{ this->tick(); });
+		}
+
+		uint64_t ticks() const
+		{
+			return _ticks;
+		}
+
+	private:
+
+		void tick()
+		{
+			++_ticks;
+
+			if(_more()){
+				this->start();
+			}
+		}
+
+		MyTcpHandler &_handler;
+		std::function<bool()> _more;
+		uint64_t _ticks = 0;
+	};
+
+	Result loop_idle(Fixture &fixture, uint64_t n)
+	{
+		Meter meter;
+		uint64_t left = n;
+
+		Ticker ticker(fixture.handler(), [&]
+		{
+			if(--left){
+				return true;
+			}
+
+			meter.stop(n);
+			fixture.handler().quit();
+			return false;
+		});
+
+		meter.start();
+		ticker.start();
+		fixture.run();
+		return meter.result();
+	}
+
+	Result loop_busy(Fixture &fixture, uint64_t n)
+	{
+		fixture.fill(n, 16);
+
+		Meter meter;
+		uint64_t received = 0;
+		std::string tag;
+
+		Ticker ticker(fixture.handler(), [&]{ return received < n; });
+
+		fixture.channel().consume(Fixture::queue, AMQP::noack)
+			.onSuccess([&](const std::string &consumer)
+			{
+				tag = consumer;
+				meter.start();
+				ticker.start();
+			})
+			.onReceived([&](const AMQP::Message &, uint64_t, bool)
+			{
+				if(++received == n){
+					meter.stop(ticker.ticks());
+					fixture.channel().cancel(tag);
+					fixture.sync([&]{ fixture.handler().quit(); });
+				}
+			});
+
+		fixture.run();
+		return meter.result();
+	}
+
+	Result publish(Fixture &fixture, uint64_t n, size_t size)
+	{
+		constexpr uint64_t batch = 256;
+
+		const std::string body(size, 'x');
+		Meter meter;
+		uint64_t sent = 0;
+
+		// Batches are flushed and processed by the broker before the next one
+		std::function<void()> next = [&]
+		{
+			if(sent >= n){
+				meter.stop(sent);
+				fixture.handler().quit();
+				return;
+			}
+
+			for(uint64_t i = 0; i < batch; ++i, ++sent){
+				// Unroutable, dropped by the broker
+				fixture.channel().publish("", "micro_bench.null", body.data(), body.size());
+			}
+
+			fixture.sync(next);
+		};
+
+		meter.start();
+		next();
+		fixture.run();
+		return meter.result();
+	}
+
+	Result consume_ack(Fixture &fixture, uint64_t n)
+	{
+		fixture.fill(n, 16);
+
+		Meter meter;
+		uint64_t received = 0;
+		std::string tag;
+
+		fixture.channel().setQos(256);
+
+		fixture.channel().consume(Fixture::queue)
+			.onSuccess([&](const std::string &consumer)
+			{
+				tag = consumer;
+				meter.start();
+			})
+			.onReceived([&](const AMQP::Message &, uint64_t delivery_tag, bool)
+			{
+				fixture.channel().ack(delivery_tag);
+
+				if(++received == n){
+					fixture.channel().cancel(tag);
+					fixture.sync([&]
+					{
+						meter.stop(n);
+						fixture.handler().quit();
+					});
+				}
+			});
+
+		fixture.run();
+		fixture.channel().setQos(0);
+		return meter.result();
+	}
+
+	Result heartbeat(Fixture &fixture, uint64_t n)
+	{
+		constexpr uint64_t batch = 256;
+
+		// As if received from the broker (the override in MyTcpHandler is private)
+		AMQP::TcpHandler &handler = fixture.handler();
+
+		Meter meter;
+		uint64_t done = 0;
+
+		std::function<void()> next = [&]
+		{
+			if(done >= n){
+				meter.stop(done);
+				fixture.handler().quit();
+				return;
+			}
+
+			for(uint64_t i = 0; i < batch; ++i, ++done){
+				handler.onHeartbeat(&fixture.connection());
+			}
+
+			fixture.sync(next);
+		};
+
+		meter.start();
+		next();
+		fixture.run();
+		return meter.result();
+	}
+
+	Result logger_filtered(Fixture &, uint64_t n)
+	{
+		Meter meter;
+		meter.start();
+
+		for(uint64_t i = 0; i < n; ++i){
+			logger.msg(MSG_TRACE, "monitor: fd: %d, flags: %d\n", static_cast<int>(i), 1);
+		}
+
+		meter.stop(n);
+		return meter.result();
+	}
+
+	Result logger_filtered_str(Fixture &, uint64_t n)
+	{
+		Meter meter;
+		meter.start();
+
+		for(uint64_t i = 0; i < n; ++i){
+			logger.msg(MSG_TRACE, "delivery %s\n", "tag-" + std::to_string(i));
+		}
+
+		meter.stop(n);
+		return meter.result();
+	}
+
+	Result log_msg_trace(Fixture &, uint64_t n)
+	{
+		Meter meter;
+		meter.start();
+
+		for(uint64_t i = 0; i < n; ++i){
+			LOG_MSG(MSG_TRACE, "delivery %s\n", "tag-" + std::to_string(i));
+		}
+
+		meter.stop(n);
+		return meter.result();
+	}
+
+	struct Benchmark
+	{
+		const char *name;
+		uint64_t ops;
+		std::function<Result(Fixture &, uint64_t)> run;
+	};
+
+	const std::vector<Benchmark> &benchmarks()
+	{
+		static const std::vector<Benchmark> list{
+			{"loop_idle", 200000, loop_idle},
+			{"loop_busy", 100000, loop_busy},
+			{"publish_16b", 200000, [](Fixture &f, uint64_t n){ return publish(f, n, 16); }},
+			{"publish_64k", 5000, [](Fixture &f, uint64_t n){ return publish(f, n, 65536); }},
+			{"consume_ack", 100000, consume_ack},
+			{"heartbeat", 200000, heartbeat},
+			{"logger_filtered", 10000000, logger_filtered},
+			{"logger_filtered_str", 2000000, logger_filtered_str},
+			{"log_msg_trace", 2000000, log_msg_trace},
+		};
+
+		return list;
+	}
+}
+
+
+int main(int argc, char* argv[])
+{
+	logger.init(MSG_ERROR);
+
+	size_t repeat = 5;
+	double scale = 1.0;
+	std::vector<std::string> names;
+
+	for(int i = 1; i < argc; ++i){
+		const std::string arg = argv[i];
+
+		if(arg == "--repeat" && i + 1 < argc){
+			repeat = std::max(1ul, std::stoul(argv[++i]));
+		}
+		else if(arg == "--scale" && i + 1 < argc){
+			scale = std::stod(argv[++i]);
+		}
+		else if(arg[0] == '-'){
+			std::cerr << "Usage: " << argv[0] << " [--repeat N] [--scale X] [name ...]" << std::endl;
+			return 1;
+		}
+		else{
+			names.push_back(arg);
+		}
+	}
+
+	Fixture fixture;
+
+	printf("%-20s %10s %12s %12s %12s\n", "benchmark", "ops", "ns/op", "allocs/op", "bytes/op");
+
+	for(const auto &benchmark : benchmarks()){
+		if( !names.empty() && std::find(names.begin(), names.end(), benchmark.name) == names.end() ){
+			continue;
+		}
+
+		const uint64_t ops = std::max<uint64_t>(1, static_cast<uint64_t>(benchmark.ops * scale));
+		Result best;
+
+		for(size_t i = 0; i < repeat; ++i){
+			Result r = benchmark.run(fixture, ops);
+
+			if( !best.ops || (r.ops && r.ns_per_op() < best.ns_per_op()) ){
+				best = r;
+			}
+		}
+
+		const double per_op = best.ops ? 1.0 / best.ops : 0;
+
+		printf("%-20s %10lu %12.1f %12.2f %12.1f\n", benchmark.name, static_cast<unsigned long>(best.ops),
+			best.ns_per_op(), best.allocations * per_op, best.bytes * per_op);
+		fflush(stdout);
+	}
+
+	return 0;
+}
@@ -5,12 +5,24 @@
 extern "C"{
 #include <sys/select.h>
 #include <sys/time.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 }
 
 #include <thread>
 #include <atomic>
+#include <mutex>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <chrono>
+#include <algorithm>
 
 #include "logger.hpp"
+#include "log_level.hpp"
+#include "alloc_tracker.hpp"
+#include "metrics.hpp"
+#include "probes.hpp"
 #include "my_handler.hpp"
 
 
@@ -23,20 +35,55 @@ struct MyTcpHandler::Impl
 
 	int fd = -1;
 	int flags = 0;
+	bool want_write = false;
 	std::atomic<bool> quit{false}; 			// break event loop flag
 	std::atomic<bool> connected{false};		// connection is active flag
 
 	// Heartbeats data
+	uint16_t heartbeat = 0;					// interval set by set_heartbeat(), 0 - server suggestion
+	uint16_t heartbeat_interval = 0;		// negotiated, 0 - not yet
+	std::chrono::steady_clock::time_point last_received;	// server silence detection
 	uint16_t heartbeat_period = 30;			// (interval \ 2)
 	std::atomic<uint16_t> heartbeats_timer{0};	//
 	uint8_t heartbeat_fails = 0;			//
 	static constexpr uint8_t heartbeat_max_fails = 2;
+
+	// Tasks posted from other threads (see post())
+	int wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	std::mutex posted_mutex;
+	std::vector<std::function<void()>> posted;
+
+	// Timers ordered by expiration time (ID makes the key unique)
+	using clock = std::chrono::steady_clock;
+	std::map<std::pair<clock::time_point, uint64_t>, std::function<void()>> timers;
+	std::unordered_map<uint64_t, clock::time_point> timer_expiration;
+	uint64_t last_timer_id = 0;
+
+	// Allocation accounting of the connection (see alloc_tracker.hpp)
+	unsigned alloc_connection = 0;
+
+	// A connection was attached before - next ones are reconnects
+	bool attached = false;
+
+	~Impl()
+	{
+		if(wakeup_fd > -1){
+			close(wakeup_fd);
+		}
+	}
 };
 
 
 MyTcpHandler::MyTcpHandler(): AMQP::TcpHandler(), pimpl(new MyTcpHandler::Impl)
 {
+	if(pimpl->wakeup_fd < 0){
+		LOG_MSG(MSG_ERROR, "%s%s\n", excp_method("eventfd failed: "), strerror(errno));
+	}
 
+	if(AllocTracker::enabled){
+		static std::atomic<unsigned> handlers{0};
+		pimpl->alloc_connection = AllocTracker::connection("connection " + std::to_string(++handlers));
+	}
 }
 
 // Definition of desctuctor in place where MyTcpHandlerImpl is a complete type.
@@ -70,9 +117,18 @@ void MyTcpHandler::monitor(AMQP::TcpConnection *connection, int fd, int flags)
 	//  library that the filedescriptor is active by calling the
 	//  connection->process(fd, flags) method.
 
-	logger.msg(MSG_TRACE, "monitor: fd: %d, flags: %d\n", fd, flags);
+	LOG_MSG(MSG_TRACE, "monitor: fd: %d, flags: %d\n", fd, flags);
+	PROBE2(monitor, fd, flags);
+
+	// Library has buffered output data and waits for the socket to become writable
+	pimpl->want_write = flags & AMQP::writable;
 
 	if( !flags ){
+		// Socket is being closed - don't select() it after a reconnection
+		if(fd == pimpl->fd){
+			pimpl->fd = -1;
+		}
+
 		return;
 	}
 
@@ -94,7 +150,11 @@ uint16_t MyTcpHandler::onNegotiate(AMQP::TcpConnection *connection, uint16_t int
 {
 	// we accept the suggestion from the server, but if the interval is smaller
 	// that one minute, we will use a one minute interval instead
-	if(interval < 60){
+	// (unless it is set explicitly)
+	if(pimpl->heartbeat){
+		interval = pimpl->heartbeat;
+	}
+	else if(interval < 60){
 		interval = 60;
 	} 
 
@@ -104,8 +164,10 @@ uint16_t MyTcpHandler::onNegotiate(AMQP::TcpConnection *connection, uint16_t int
 	//  instruction was sent in that period.
 
 	pimpl->heartbeat_period = interval > 1 ? interval / 2 : interval;
+	pimpl->heartbeat_interval = interval;
+	pimpl->last_received = std::chrono::steady_clock::now();
 
-	log_msg(MSG_DEBUG, "Heartbeat interval: %u, period: %u\n", interval, pimpl->heartbeat_period);
+	LOG_MSG(MSG_DEBUG, "Heartbeat interval: %u, period: %u\n", interval, pimpl->heartbeat_period);
 
 	// return the interval that we want to use
 	return interval;
@@ -118,14 +180,25 @@ uint16_t MyTcpHandler::onNegotiate(AMQP::TcpConnection *connection, uint16_t int
  */
 void MyTcpHandler::onHeartbeat(AMQP::TcpConnection *connection)
 {
-	logger.msg(MSG_DEBUG, "heartbeat received from server\n");
-	connection->heartbeat();
+	LOG_MSG(MSG_DEBUG, "heartbeat received from server\n");
+	PROBE0(heartbeat_received);
+	Metrics::add(Metrics::HEARTBEATS_RECEIVED);
+
+	if(connection->heartbeat()){
+		PROBE0(heartbeat_sent);
+		Metrics::add(Metrics::HEARTBEATS_SENT);
+	}
 
 	// Server send us heartbeat frame, so 
 	// no need to request heartbeat at current period 
 	this->reset_heartbeats();
 }
 
+void MyTcpHandler::set_heartbeat(uint16_t interval)
+{
+	pimpl->heartbeat = interval;
+}
+
 void MyTcpHandler::reset_heartbeats()
 {
 	pimpl->heartbeats_timer.store(0);
@@ -144,12 +217,16 @@ void MyTcpHandler::process_heartbeats(AMQP::TcpConnection *connection)
 	// Heartbeats timer period elapsed
 
 	if(connection->heartbeat()){
-		logger.msg(MSG_DEBUG, "heartbeat sent to server\n");
+		LOG_MSG(MSG_DEBUG, "heartbeat sent to server\n");
+		PROBE0(heartbeat_sent);
+		Metrics::add(Metrics::HEARTBEATS_SENT);
 		this->reset_heartbeats();
 	}
 	else{
 		++pimpl->heartbeat_fails;
-		logger.msg(MSG_DEBUG, "heartbeat to server failed (%d)\n", pimpl->heartbeat_fails);
+		PROBE1(heartbeat_failed, pimpl->heartbeat_fails);
+		Metrics::add(Metrics::HEARTBEAT_FAILURES);
+		LOG_MSG(MSG_DEBUG, "heartbeat to server failed (%d)\n", pimpl->heartbeat_fails);
 
 		if(pimpl->heartbeat_fails >= Impl::heartbeat_max_fails){
 			// Connection lost 
@@ -162,35 +239,135 @@ void MyTcpHandler::process_heartbeats(AMQP::TcpConnection *connection)
 
 }
 
+void MyTcpHandler::post(std::function<void()> task)
+{
+	bool was_empty = false;
+
+	{
+		std::lock_guard<std::mutex> lock(pimpl->posted_mutex);
+		was_empty = pimpl->posted.empty();
+		pimpl->posted.push_back(std::move(task));
+	}
+
+	// Wake up the loop only once per batch of posted tasks
+	if(was_empty && pimpl->wakeup_fd > -1){
+		uint64_t one = 1;
+		ssize_t res = write(pimpl->wakeup_fd, &one, sizeof(one));
+		(void)res;	// EAGAIN means counter is already non-zero - loop is awake
+	}
+}
+
+void MyTcpHandler::process_posted()
+{
+	uint64_t counter = 0;
+	ssize_t res = read(pimpl->wakeup_fd, &counter, sizeof(counter));
+	(void)res;
+
+	std::vector<std::function<void()>> tasks;
+
+	{
+		std::lock_guard<std::mutex> lock(pimpl->posted_mutex);
+		tasks.swap(pimpl->posted);
+	}
+
+	for(auto &task : tasks){
+		task();
+	}
+}
+
+uint64_t MyTcpHandler::add_timer(std::chrono::milliseconds delay, std::function<void()> callback)
+{
+	const uint64_t id = ++pimpl->last_timer_id;
+	const auto expiration = Impl::clock::now() + delay;
+
+	pimpl->timers.emplace(std::make_pair(expiration, id), std::move(callback));
+	pimpl->timer_expiration.emplace(id, expiration);
+	return id;
+}
+
+bool MyTcpHandler::cancel_timer(uint64_t id)
+{
+	auto it = pimpl->timer_expiration.find(id);
+
+	if(it == pimpl->timer_expiration.end()){
+		return false;
+	}
+
+	pimpl->timers.erase(std::make_pair(it->second, id));
+	pimpl->timer_expiration.erase(it);
+	return true;
+}
+
+void MyTcpHandler::process_timers()
+{
+	const auto now = Impl::clock::now();
+
+	// Callbacks may add and cancel timers, so take them one by one
+	while( !pimpl->timers.empty() && pimpl->timers.begin()->first.first <= now ){
+		auto node = pimpl->timers.extract(pimpl->timers.begin());
+		pimpl->timer_expiration.erase(node.key().second);
+		node.mapped()();
+	}
+}
+
 // Event loop reports that the descriptor becomes readable and/or writable 
 // and informs the AMQP-CPP library that the filedescriptor is active 
 // by calling the connection->process(fd, flags) method.
 void MyTcpHandler::loop(AMQP::TcpConnection *connection)
 {
+	using clock = std::chrono::steady_clock;
+
 	struct timeval timeout;
 	int max_fd = 1;
 
-	constexpr int tmout_sec = 1;	// 1 s
-	constexpr int tmout_ms = 0;
+	constexpr auto tick = std::chrono::seconds(1);	// heartbeats timer resolution
+	auto next_tick = clock::now() + tick;
 
 	pimpl->quit.store(false);
 	pimpl->connected.store(false);
+	pimpl->heartbeat_interval = 0;
 	this->reset_heartbeats();
 
+	// Allocations of the loop thread are counted against the connection
+	static const unsigned event_loop = AllocTracker::subsystem("event_loop");
+	AllocTracker::ConnectionScope connection_scope(pimpl->alloc_connection);
+	AllocTracker::Scope scope(event_loop);
+
 	for(;;){
 
 		FD_ZERO(&pimpl->readfds);
 		FD_ZERO(&pimpl->writefds);
-		FD_SET(pimpl->fd, &pimpl->readfds);
-		
-		timeout.tv_sec = tmout_sec;
-		timeout.tv_usec = tmout_ms;
 
 		if(pimpl->fd > -1){
-			max_fd = pimpl->fd + 1;
+			FD_SET(pimpl->fd, &pimpl->readfds);
+
+			// Library has buffered data which could not be sent at once
+			if(pimpl->want_write){
+				FD_SET(pimpl->fd, &pimpl->writefds);
+			}
 		}
 
+		if(pimpl->wakeup_fd > -1){
+			FD_SET(pimpl->wakeup_fd, &pimpl->readfds);
+		}
+
+		// Wait until next heartbeats timer tick or the first timer expiration at most
+		auto now = clock::now();
+		auto wake = next_tick;
+
+		if( !pimpl->timers.empty() ){
+			wake = std::min(wake, pimpl->timers.begin()->first.first);
+		}
+
+		auto wait = std::max(clock::duration::zero(), wake - now);
+		auto wait_us = std::chrono::duration_cast<std::chrono::microseconds>(wait).count();
+		timeout.tv_sec = wait_us / 1000000;
+		timeout.tv_usec = wait_us % 1000000;
+
+		max_fd = std::max(pimpl->fd, pimpl->wakeup_fd) + 1;
+
 		int res = select(max_fd, &pimpl->readfds, &pimpl->writefds, nullptr, &timeout);
+		PROBE2(loop_wakeup, res, wait_us);
 		
 		if(res < 0){
 
@@ -201,39 +378,71 @@ void MyTcpHandler::loop(AMQP::TcpConnection *connection)
 			}
 
 			if( !this->connection_was_lost() ){
-				logger.msg(MSG_ERROR, "%s%s\n", excp_method("select failed(" + std::to_string(res) + "): "), strerror(errno));
+				LOG_MSG(MSG_ERROR, "%s%s\n", excp_method("select failed(" + std::to_string(res) + "): "), strerror(errno));
 			}
 
 			return;
 		}
 		else{ 	
 			// Timeout or Filedescriptor is ready for I\O
+			bool fd_readable = pimpl->fd > -1 && FD_ISSET(pimpl->fd, &pimpl->readfds);
+			bool fd_writable = pimpl->fd > -1 && FD_ISSET(pimpl->fd, &pimpl->writefds);
 
 			// Process I\O operations
-			if(FD_ISSET(pimpl->fd, &pimpl->readfds)){
+			if(fd_readable){
+				pimpl->last_received = clock::now();
+
 				// logger.msg(MSG_VERBOSE, "connection->process readable (fd: %d, flags: %d)\n", pimpl->fd, pimpl->flags);
+				PROBE2(process_start, pimpl->fd, pimpl->flags);
 				connection->process(pimpl->fd, pimpl->flags);
+				PROBE2(process_end, pimpl->fd, pimpl->flags);
 			}
 			
-			if(FD_ISSET(pimpl->fd, &pimpl->writefds)){
+			if(fd_writable){
 				// logger.msg(MSG_VERBOSE, "connection->process writable (fd: %d, flags: %d)\n", pimpl->fd, pimpl->flags);
+				PROBE2(process_start, pimpl->fd, pimpl->flags);
 				connection->process(pimpl->fd, pimpl->flags);
+				PROBE2(process_end, pimpl->fd, pimpl->flags);
 
 				// Any traffic (e.g. protocol operations, published messages, 
 				// acknowledgements) counts for a valid heartbeat.
 				pimpl->heartbeats_timer.store(0);
 			}
 
+			// Tasks posted from other threads
+			if(pimpl->wakeup_fd > -1 && FD_ISSET(pimpl->wakeup_fd, &pimpl->readfds)){
+				this->process_posted();
+			}
+
+			this->process_timers();
+
+			// Nothing from the server (not even heartbeats) for two intervals: peer is
+			// gone without closing the connection (crash, network partition)
+			if(pimpl->heartbeat_interval && pimpl->connected.load() &&
+				clock::now() - pimpl->last_received > 2 * std::chrono::seconds(pimpl->heartbeat_interval))
+			{
+				LOG_MSG(MSG_DEBUG, "nothing received from server for %u s\n", 2u * pimpl->heartbeat_interval);
+				PROBE1(silent, pimpl->heartbeat_interval);
+				Metrics::add(Metrics::HEARTBEAT_FAILURES);
+				this->onLost(connection);
+			}
+
 			// Check if loop break signal was catched
 			if(pimpl->quit.load()){
 				return;
 			}
 
-			// Hearbeats timer implementation - when select timeouts,increment timer counter. 
-			if( !FD_ISSET(pimpl->fd, &pimpl->readfds) && !FD_ISSET(pimpl->fd, &pimpl->writefds) ){
+			// Hearbeats timer implementation - when connection is idle for a tick, 
+			// increment timer counter. Wakeups by posted tasks do not count.
+			if(fd_readable || fd_writable){
+				continue;
+			}
+
+			now = clock::now();
+			if(now >= next_tick){
+				next_tick = now + tick;
 				this->process_heartbeats(connection);
 			}
-			
 		}
 	}
 }
@@ -263,8 +472,14 @@ void MyTcpHandler::onAttached(AMQP::TcpConnection *connection)
 	// @todo
 	//  add your own implementation, for example initialize things
 	//  to handle the connection.
-	logger.msg(MSG_VERBOSE, "onAttached\n");
+	LOG_MSG(MSG_VERBOSE, "onAttached\n");
 	pimpl->connection_ptr = connection;
+
+	if(pimpl->attached){
+		Metrics::add(Metrics::RECONNECTS);
+	}
+
+	pimpl->attached = true;
 }
 
 
@@ -280,8 +495,9 @@ void MyTcpHandler::onConnected(AMQP::TcpConnection *connection)
 {
 	// @todo
 	//  add your own implementation (probably not needed)
-	logger.msg(MSG_DEBUG, "onConnected\n");
+	LOG_MSG(MSG_DEBUG, "onConnected\n");
 	pimpl->connected.store(true);
+	Metrics::add(Metrics::CONNECTIONS);
 }
 
 /**
@@ -299,7 +515,7 @@ bool MyTcpHandler::onSecured(AMQP::TcpConnection *connection, const SSL *ssl)
 	// @todo
 	//  add your own implementation, for example by reading out the
 	//  certificate and check if it is indeed yours
-	logger.msg(MSG_DEBUG, "onSecured\n");
+	LOG_MSG(MSG_DEBUG, "onSecured\n");
 	return true;
 }
 
@@ -313,7 +529,7 @@ void MyTcpHandler::onReady(AMQP::TcpConnection *connection)
 	// @todo
 	//  add your own implementation, for example by creating a channel
 	//  instance, and start publishing or consuming
-	logger.msg(MSG_DEBUG, "onReady\n");
+	LOG_MSG(MSG_DEBUG, "onReady\n");
 }
 
 
@@ -325,7 +541,9 @@ void MyTcpHandler::onError(AMQP::TcpConnection *connection, const char *message)
 	// @todo
 	//  add your own implementation, for example by reporting the error
 	//  to the user of your program and logging the error
-	logger.msg(MSG_ERROR, "onError: %s\n", message);
+	LOG_MSG(MSG_ERROR, "onError: %s\n", message);
+	PROBE1(error, message);
+	Metrics::add(Metrics::CONNECTION_ERRORS);
 }
 
 /**
@@ -343,7 +561,7 @@ void MyTcpHandler::onClosed(AMQP::TcpConnection *connection)
     //  be useful if you want to do some something immediately after the
     //  amqp connection is over, but do not want to wait for the tcp 
     //  connection to shut down
-    logger.msg(MSG_DEBUG, "onClosed\n");
+    LOG_MSG(MSG_DEBUG, "onClosed\n");
 }
 
 /**
@@ -355,8 +573,10 @@ void MyTcpHandler::onLost(AMQP::TcpConnection *connection)
 {
 	// @todo
 	//  add your own implementation (probably not necessary)
-	logger.msg(MSG_DEBUG, "onLost\n");
+	LOG_MSG(MSG_DEBUG, "onLost\n");
+	PROBE0(lost);
 	pimpl->connected.store(false);
+	Metrics::add(Metrics::CONNECTIONS_LOST);
 
 	// We've been connected already, stop running event gently.
 	this->quit();
@@ -371,5 +591,5 @@ void MyTcpHandler::onDetached(AMQP::TcpConnection *connection)
 {
 	// @todo
 	//  add your own implementation, like cleanup resources or exit the application
-	logger.msg(MSG_TRACE, "onDetached\n");
+	LOG_MSG(MSG_TRACE, "onDetached\n");
 } 
\ No newline at end of file
@@ -2,6 +2,8 @@
 
 #include <iostream>
 #include <memory>
+#include <functional>
+#include <chrono>
 #include <amqpcpp.h>
 #include <amqpcpp/linux_tcp.h>
 
@@ -11,6 +13,9 @@
  * If you construct channels or call methods from one thread, while the event loop 
  * is running in a different thread, unexpected things can and will happen.
  *
+ * The only exception is MyTcpHandler::post() - use it to hand work (e.g. acks of
+ * messages processed by a thread pool) back to the event loop thread.
+ *
 */
 
 class MyTcpHandler : public AMQP::TcpHandler
@@ -36,6 +41,40 @@ public:
 	//
 	void reset_heartbeats();
 
+	/**
+	 *  Heartbeat interval to negotiate instead of the server suggestion (which
+	 *  is raised to one minute at least). Takes effect on the next connection.
+	 *  The connection is reported lost when nothing is received from the server
+	 *  for two intervals, so a short one (e.g. 2 s) detects half-open connections
+	 *  quickly - keep it above the longest expected stall.
+	 *  @param  interval        Seconds, 0 - server suggestion (default)
+	 */
+	void set_heartbeat(uint16_t interval);
+
+	/**
+	 *  Schedule a task to be executed on the event loop thread (the one running 
+	 *  loop()). Thread-safe: wakes up the loop if it is waiting in select().
+	 *  Tasks are executed in the order they were posted.
+	 *  @param  task            Callable to be executed by the event loop
+	 */
+	void post(std::function<void()> task);
+
+	/**
+	 *  Schedule a callback to be executed on the event loop thread after 
+	 *  the delay. Must be called on the event loop thread.
+	 *  @param  delay           Time to wait
+	 *  @param  callback        Callable to be executed
+	 *  @return uint64_t        Timer ID (never 0)
+	 */
+	uint64_t add_timer(std::chrono::milliseconds delay, std::function<void()> callback);
+
+	/**
+	 *  Cancel a timer which has not fired yet. Must be called on the event loop thread.
+	 *  @param  id              Timer ID returned by add_timer()
+	 *  @return bool            Whether the timer was pending
+	 */
+	bool cancel_timer(uint64_t id);
+
 private:
 
 	// IMPL forward declaration
@@ -47,6 +86,10 @@ private:
 
 	void process_heartbeats(AMQP::TcpConnection *connection);
 
+	void process_posted();
+
+	void process_timers();
+
 	/**
 	 *  Method that is called by the AMQP library when a new connection
 	 *  is associated with the handler. This is the first call to your handler
@@ -1,5 +1,6 @@
 #include <iostream>
 #include <string>
+#include <ctime>
 #include <amqpcpp.h>
 #include <amqpcpp/linux_tcp.h>
 
@@ -52,6 +53,9 @@ int main(int argc, char* argv[])
 		// Delivery mode (non-persistent (1) or persistent (2))
 		env.setDeliveryMode(2);
 
+		// Send time (seconds), workers skip tasks queued for too long
+		env.setTimestamp(std::time(nullptr));
+
 		// 			(exchange, rounting_key, body, flags)
 		channel.publish("", "task_queue", env);
 		logger.msg(MSG_DEBUG,  "[x] Sent '%s' to 'task_queue'", env.body());
@@ -0,0 +1,57 @@
+#pragma once
+
+/*
+	Static tracepoints (USDT) of the client, provider 'amqp_client'.
+
+	With <sys/sdt.h> (systemtap-sdt-dev) a probe is a single nop in the code
+	plus a note in the ELF, perf and bpftrace attach to it at run time; the
+	arguments are evaluated only for the probe operands (registers or stack).
+	Without the header (or with -DENABLE_USDT=OFF) the macros are empty.
+
+	MyTcpHandler:
+		loop_wakeup(res, wait_us)          select() returned
+		process_start(fd, flags)           before connection->process()
+		process_end(fd, flags)             after it
+		monitor(fd, flags)                 library changed the descriptor flags
+		heartbeat_received()
+		heartbeat_sent()
+		heartbeat_failed(fails)
+		silent(interval)                   nothing received for two heartbeat intervals
+		error(message)                     onError()
+		lost()                             onLost()
+
+	MeteredChannel:
+		publish(bytes)
+		deliver(delivery_tag, bytes)
+		ack(delivery_tag)
+		reject(delivery_tag)
+
+	Usage:
+		bpftrace -l 'usdt:./perf_test:amqp_client:*'
+		bpftrace -e 'usdt:./perf_test:amqp_client:process_start { @s[tid] = nsecs; }
+			usdt:./perf_test:amqp_client:process_end /@s[tid]/ { @us = hist((nsecs - @s[tid]) / 1000); delete(@s[tid]); }'
+
+		perf buildid-cache --add ./perf_test
+		perf record -e sdt_amqp_client:heartbeat_failed -e sdt_amqp_client:lost -a
+*/
+
+#if !defined(DISABLE_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define USDT_ENABLED 1
+#endif
+#endif
+
+#ifdef USDT_ENABLED
+
+#define PROBE0(name) DTRACE_PROBE(amqp_client, name)
+#define PROBE1(name, a1) DTRACE_PROBE1(amqp_client, name, a1)
+#define PROBE2(name, a1, a2) DTRACE_PROBE2(amqp_client, name, a1, a2)
+
+#else
+
+#define PROBE0(name) do{ }while(0)
+#define PROBE1(name, a1) do{ }while(0)
+#define PROBE2(name, a1, a2) do{ }while(0)
+
+#endif
@@ -47,7 +47,11 @@ int main(int argc, char* argv[])
 
 	AMQP::QueueCallback callback = [&](const std::string &name, int msgcount, int consumercount){
 		// 			(exchange, rounting_key, body, flags)
-		channel.publish("", "hello", payload);
+		// message-id lets consumers drop redelivered duplicates (see reconnection)
+		AMQP::Envelope envelope(payload.data(), payload.size());
+		envelope.setMessageID(utils::unique_id());
+
+		channel.publish("", "hello", envelope);
 		logger.msg(MSG_DEBUG, "[x] Sent '%s' to 'hello' queue\n", payload);
 		
 		// Gentle closing
@@ -15,6 +15,7 @@ extern "C"{
 
 #include "logger.hpp"
 #include "my_handler.hpp"
+#include "dedup_filter.hpp"
 
 using namespace std;
 
@@ -86,6 +87,12 @@ int main(int argc, char* argv[])
 
 	AMQP::Address address(addr);
 
+	// Messages processed before connection loss, whose acks were lost with 
+	// the connection, are redelivered after reconnection. Filter survives
+	// reconnections and drops such duplicates (keyed by message-id, which
+	// the 'hello' producers - send and publish - set).
+	DedupFilter dedup;
+
 	for(;;){
 		logger.msg(MSG_DEBUG, "Connecting to '%s'\n", addr);
 
@@ -104,15 +111,19 @@ int main(int argc, char* argv[])
 
 		// Callback after queue declaration
 		AMQP::QueueCallback qcb = [&](const std::string &name, int msgcount, int consumercount){
-			// noack	- 	if set, consumed messages do not have to be acked, this happens automatically
-			// Server will see that the message was acked and can delete it from the queue.
-			channel_ptr->consume("hello", AMQP::noack)
-				.onReceived([](const AMQP::Message &message, uint64_t deliveryTag, bool redelivered)
+			// Messages are acked manually, so the ones not acked before connection 
+			// loss are redelivered with 'redelivered' flag set.
+			channel_ptr->consume("hello")
+				.onReceived(dedup.wrap(*channel_ptr, [](const AMQP::Message &message, uint64_t deliveryTag, bool redelivered)
 				{
 					std::string_view body(message.body(), message.bodySize());
 				    logger.msg(MSG_DEBUG, " [x] Received '%s' (%lu bytes)\n", body.data(), message.bodySize());
+				    channel_ptr->ack(deliveryTag);
+
+				    // Processed: the key is remembered, redeliveries are dropped
+				    return true;
 				}
-			);
+			));
 
 			logger.msg(MSG_DEBUG, "Waiting for messages\n");
 		};
@@ -134,6 +145,10 @@ int main(int argc, char* argv[])
 		if(myHandler.connection_was_lost()){
 			logger.msg(MSG_DEBUG, "Connection was lost\n");
 
+			auto stats = dedup.stats();
+			logger.msg(MSG_DEBUG, "Duplicates dropped: %lu of %lu (hit rate %.3f), memory: %zu bytes\n",
+				stats.duplicates, stats.checked, stats.hit_rate(), stats.memory_bytes);
+
 			// Current connection  closing 
 			connection_ptr->close();
 			connection_ptr.reset();
@@ -0,0 +1,114 @@
+#include "utils.hpp"
+#include "lru_cache.hpp"
+#include "reply_cache.hpp"
+
+
+namespace
+{
+	struct Entry
+	{
+		std::string request;
+		std::string reply;
+		std::chrono::steady_clock::time_point expires;
+	};
+
+	struct NoHash
+	{
+		// keys are hashes already
+		size_t operator()(uint64_t key) const { return key; }
+	};
+
+	size_t entry_bytes(const Entry &entry)
+	{
+		return sizeof(Entry) + entry.request.size() + entry.reply.size();
+	}
+}
+
+
+struct ReplyCache::Impl
+{
+	Options options;
+	LruCache<uint64_t, Entry, NoHash> lru;
+	Stats stats;
+
+	explicit Impl(const Options &o): options(o), lru(o.max_entries)
+	{
+		lru.on_evict = [this](const uint64_t&, Entry &entry)
+		{
+			stats.bytes -= entry_bytes(entry);
+			++stats.evictions;
+		};
+	}
+
+	void erase(uint64_t key, const Entry &entry)
+	{
+		stats.bytes -= entry_bytes(entry);
+		lru.erase(key);
+	}
+};
+
+
+ReplyCache::ReplyCache(const Options &options): pimpl(new ReplyCache::Impl(options))
+{
+
+}
+
+ReplyCache::~ReplyCache() = default;
+
+const std::string* ReplyCache::find(const std::string &request)
+{
+	const uint64_t key = utils::hash(request);
+	Entry *entry = pimpl->lru.find(key);
+
+	if( !entry || entry->request != request ){
+		++pimpl->stats.misses;
+		return nullptr;
+	}
+
+	if(pimpl->options.ttl.count() > 0 && std::chrono::steady_clock::now() >= entry->expires){
+		++pimpl->stats.expired;
+		++pimpl->stats.misses;
+		pimpl->erase(key, *entry);
+		return nullptr;
+	}
+
+	++pimpl->stats.hits;
+	return &entry->reply;
+}
+
+void ReplyCache::insert(const std::string &request, const std::string &reply)
+{
+	Entry entry{request, reply, std::chrono::steady_clock::now() + pimpl->options.ttl};
+	const size_t bytes = entry_bytes(entry);
+
+	if(bytes > pimpl->options.max_bytes){
+		return;
+	}
+
+	const uint64_t key = utils::hash(request);
+
+	// Overwritten entry (same key) is not evicted, account it here
+	if(const Entry *old = pimpl->lru.peek(key)){
+		pimpl->erase(key, *old);
+	}
+
+	// Make room in bytes budget
+	while(pimpl->stats.bytes + bytes > pimpl->options.max_bytes){
+		const uint64_t *oldest = pimpl->lru.oldest();
+		if( !oldest ) break;
+
+		const uint64_t oldest_key = *oldest;
+		pimpl->erase(oldest_key, *pimpl->lru.peek(oldest_key));
+		++pimpl->stats.evictions;
+	}
+
+	pimpl->stats.bytes += bytes;
+	pimpl->lru.insert(key, std::move(entry));
+}
+
+ReplyCache::Stats ReplyCache::stats() const
+{
+	Stats res = pimpl->stats;
+	res.entries = pimpl->lru.size();
+	return res;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <chrono>
+#include <cstdint>
+
+// Memoization cache of RPC replies for idempotent handlers.
+//
+// Reply is keyed by the request body (hash plus exact comparison, so hash 
+// collisions never return a wrong reply). Bounded both by the number of 
+// entries and by the bytes of cached requests and replies, least recently 
+// used entries are evicted first. Entries expire after TTL.
+// Not thread-safe.
+
+class ReplyCache
+{
+public:
+
+	struct Options
+	{
+		size_t max_entries = 10000;
+		size_t max_bytes = 16 * 1024 * 1024;
+		std::chrono::milliseconds ttl{60000};	// 0 - entries don't expire
+	};
+
+	struct Stats
+	{
+		uint64_t hits = 0;
+		uint64_t misses = 0;
+		uint64_t expired = 0;
+		uint64_t evictions = 0;
+		size_t entries = 0;
+		size_t bytes = 0;
+
+		double hit_rate() const { return hits + misses ? double(hits) / (hits + misses) : 0.0; }
+	};
+
+	explicit ReplyCache(const Options &options);
+	~ReplyCache();
+
+	// Cached reply to the request, nullptr if there is none
+	const std::string* find(const std::string &request);
+
+	void insert(const std::string &request, const std::string &reply);
+
+	Stats stats() const;
+
+private:
+
+	struct Impl;
+	std::unique_ptr<Impl> pimpl;
+};
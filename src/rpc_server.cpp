@@ -6,6 +6,9 @@
 
 #include "logger.hpp"
 #include "my_handler.hpp"
+#include "async_rpc_server.hpp"
+#include "codec_rpc.hpp"
+#include "fib_messages.hpp"
 
 using namespace std;
 
@@ -53,48 +56,39 @@ int main(int argc, char* argv[])
 	// * _reply_to_ and    -  Commonly used to name a callback queue.
 	// * _correlation_id_  -  Useful to correlate RPC responses with requests.
 	// message properties. 
-
-	AMQP::QueueCallback callback = [&](const std::string &name, int msgcount, int consumercount){
-
-		// Waiting for requests		
-		channel.consume("rpc_queue").onReceived(
-			[&channel](const AMQP::Message &message,
-				uint64_t deliveryTag,
-				bool redelivered)
-			{
-				std::string body(message.body(), message.bodySize());
-				// logger.msg(MSG_DEBUG, "[x] Sent '%s' as response\n", res);
-
-				std::string res = std::to_string( fib(std::stoi(body)) );
-				AMQP::Envelope response(res.c_str(), res.size());
-
-				// Set correlation_id property 
-				response.setCorrelationID(message.correlationID());
-				
-				// Sending response to callback queue using default exchange "" (direct)
-				const std::string &callback_queue = message.replyTo();
-				channel.publish("", callback_queue, response);
-
-				// Message fully processed and can be acked to be removed from the queue.
-				channel.ack(deliveryTag);
-
-				logger.msg(MSG_DEBUG, "[x] Sent '%s' as response to '%s' callback queue\n", res, callback_queue);
-			}
-		);
-
-	};
-
-	// Setting prefetchCount = 1 
+	//
+	// AsyncRpcServer computes responses on a worker pool and publishes them 
+	// (with correlation_id set, to the reply_to queue) from the event loop.
+	//
 	// We might want to run more than one server process. In order to spread 
-	// the load equally over multiple servers we need to set the prefetch_count setting.
-	channel.setQos(1);	
+	// the load equally over multiple servers prefetch_count is set to the number
+	// of requests the server processes concurrently (2 per worker thread by default).
+	AsyncRpcServer server(myHandler, channel);
 
-	channel.onReady([&]()
-	{
-		logger.msg(MSG_DEBUG, "Channel is ready, declaring rpc_queue\n");
-		channel.declareQueue("rpc_queue").onSuccess(callback);
-	});
+	// fib() is a pure function of the request, so repeated requests are 
+	// answered from the reply cache without computing them again.
+	ReplyCache::Options cache;
+	cache.max_entries = 1000;
 
+	server.add("rpc_queue", [](const Delivery &request)
+	{
+		// Our rpc_client sends binary requests, clients of the other tutorials - text
+		if(request.content_type == codec::content_type){
+			return codec::serve<FibRequest>(request, [&request](const FibRequest &fib_request)
+			{
+				FibReply reply;
+				reply.value = fib(fib_request.n);
+				logger.msg(MSG_DEBUG, "[x] Sending %d as response to '%s' callback queue\n", reply.value, request.reply_to);
+				return reply;
+			});
+		}
+
+		std::string res = std::to_string( fib(std::stoi(request.body)) );
+		logger.msg(MSG_DEBUG, "[x] Sending '%s' as response to '%s' callback queue\n", res, request.reply_to);
+		return res;
+	}, cache);
+
+	logger.msg(MSG_DEBUG, " [x] Awaiting RPC requests\n");
 	myHandler.loop(&connection);	
 	return 0;
 }
\ No newline at end of file
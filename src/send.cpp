@@ -3,6 +3,7 @@
 #include <amqpcpp.h>
 #include <amqpcpp/linux_tcp.h>
 
+#include "utils.hpp"
 #include "logger.hpp"
 #include "my_handler.hpp"
 
@@ -34,7 +35,11 @@ int main(int argc, char* argv[])
 
 	AMQP::QueueCallback callback = [&](const std::string &name, int msgcount, int consumercount){
 		// 			(exchange, rounting_key, body, flags)
-		channel.publish("", "hello", "Hello World!");
+		// message-id lets consumers drop redelivered duplicates (see reconnection)
+		AMQP::Envelope envelope("Hello World!", 12);
+		envelope.setMessageID(utils::unique_id());
+
+		channel.publish("", "hello", envelope);
 		logger.msg(MSG_DEBUG, "[x] Sent '%s' to 'hello' queue\n", "Hello World!");
 		
 		// Gentle closing
@@ -0,0 +1,147 @@
+#include <cstdlib>
+
+#include "logger.hpp"
+#include "stale_filter.hpp"
+
+
+struct StaleFilter::Impl : public std::enable_shared_from_this<StaleFilter::Impl>
+{
+	MyTcpHandler &handler;
+	Options options;
+	Stats stats;
+
+	// Options::multiple - last tag of not yet settled run of stale deliveries
+	AMQP::Channel *channel = nullptr;
+	uint64_t pending_tag = 0;
+	bool flush_posted = false;
+
+	Impl(MyTcpHandler &h, const Options &o): handler(h), options(o)
+	{
+
+	}
+
+	void settle(uint64_t deliveryTag, int flags)
+	{
+		if(options.action == Action::ACK){
+			channel->ack(deliveryTag, flags);
+		}
+		else{
+			channel->reject(deliveryTag, flags);
+		}
+
+		++stats.frames;
+	}
+
+	void flush()
+	{
+		if(pending_tag && channel){
+			this->settle(pending_tag, AMQP::multiple);
+		}
+
+		pending_tag = 0;
+	}
+
+	// Flush the run when current I/O batch is processed
+	void post_flush()
+	{
+		if(flush_posted){
+			return;
+		}
+
+		flush_posted = true;
+		std::weak_ptr<Impl> weak = this->shared_from_this();
+
+		handler.post([weak]{
+			if(auto self = weak.lock()){
+				self->flush_posted = false;
+				self->flush();
+			}
+		});
+	}
+};
+
+
+StaleFilter::StaleFilter(MyTcpHandler &handler, const Options &options):
+	pimpl(std::make_shared<Impl>(handler, options))
+{
+
+}
+
+StaleFilter::~StaleFilter() = default;
+
+bool StaleFilter::stale(const AMQP::Message &message, uint64_t now_ms)
+{
+	const Options &opt = pimpl->options;
+
+	if(message.hasTimestamp()){
+		const uint64_t sent_ms = opt.timestamp_ms ? message.timestamp() : message.timestamp() * 1000;
+
+		if(opt.max_age.count() > 0 && now_ms > sent_ms + static_cast<uint64_t>(opt.max_age.count())){
+			++pimpl->stats.stale_age;
+			return true;
+		}
+
+		if(opt.use_expiration && message.hasExpiration()){
+			// Per-message TTL is a string with integer number of ms
+			const uint64_t ttl_ms = std::strtoull(message.expiration().c_str(), nullptr, 10);
+
+			if(now_ms > sent_ms + ttl_ms){
+				++pimpl->stats.stale_expiration;
+				return true;
+			}
+		}
+	}
+
+	if( !opt.deadline_header.empty() && message.hasHeaders() && message.headers().contains(opt.deadline_header) ){
+		const uint64_t deadline_ms = message.headers().get(opt.deadline_header);
+
+		if(deadline_ms && now_ms > deadline_ms){
+			++pimpl->stats.stale_deadline;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+AMQP::MessageCallback StaleFilter::wrap(AMQP::Channel &channel, AMQP::MessageCallback callback)
+{
+	// Tags of previous channel are invalid
+	pimpl->channel = &channel;
+	pimpl->pending_tag = 0;
+
+	return [this, &channel, callback = std::move(callback)](const AMQP::Message &message, uint64_t deliveryTag, bool redelivered)
+	{
+		using namespace std::chrono;
+		const uint64_t now_ms = duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+
+		if(this->stale(message, now_ms)){
+
+			if(pimpl->options.multiple){
+				pimpl->pending_tag = deliveryTag;
+				pimpl->post_flush();
+			}
+			else{
+				pimpl->settle(deliveryTag, 0);
+			}
+
+			return;
+		}
+
+		// Run of stale messages is over, user callback may use 'multiple' too
+		pimpl->flush();
+
+		++pimpl->stats.passed;
+		callback(message, deliveryTag, redelivered);
+	};
+}
+
+void StaleFilter::flush()
+{
+	pimpl->flush();
+}
+
+StaleFilter::Stats StaleFilter::stats() const
+{
+	return pimpl->stats;
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <chrono>
+#include <cstdint>
+
+#include <amqpcpp.h>
+
+#include "my_handler.hpp"
+
+/*
+	Consumer-side load shedding of stale messages.
+
+	When a consumer falls behind, messages whose usefulness has expired are 
+	rejected (or acked and dropped) before they reach the user callback, so
+	the backlog is drained at wire speed instead of processing speed.
+
+	Message is stale if one of the enabled checks fails:
+	* 'timestamp' property is older than max_age
+	* 'timestamp' + 'expiration' (ms) is in the past
+	* deadline header (absolute unix time in ms) is in the past
+
+	Rejected messages are dead-lettered by the broker if the queue has a 
+	dead letter exchange configured, and dropped otherwise.
+
+	With Options::multiple set, consecutive stale deliveries are settled by one
+	basic.nack/basic.ack with 'multiple' flag. Use it only when the user callback
+	settles every message before it returns (like worker.cpp does), because
+	'multiple' covers all the earlier deliveries of the channel.
+
+	Not thread-safe - use it on the event loop thread.
+*/
+
+class StaleFilter
+{
+public:
+
+	enum class Action
+	{
+		REJECT,		// reject without requeue (dead-letter)
+		ACK			// ack and drop
+	};
+
+	struct Options
+	{
+		std::chrono::milliseconds max_age{0};		// 0 - timestamp age is not checked
+		bool timestamp_ms = false;					// 'timestamp' is in ms instead of seconds (AMQP default)
+		bool use_expiration = true;					// check 'timestamp' + 'expiration'
+		std::string deadline_header = "x-deadline";	// empty - no deadline header check
+		Action action = Action::REJECT;
+		bool multiple = false;						// settle runs of stale messages with one frame
+	};
+
+	struct Stats
+	{
+		uint64_t passed = 0;
+		uint64_t stale_age = 0;			// timestamp older than max_age
+		uint64_t stale_expiration = 0;	// timestamp + expiration passed
+		uint64_t stale_deadline = 0;	// deadline header passed
+		uint64_t frames = 0;			// ack/reject frames sent for stale messages
+
+		uint64_t stale() const { return stale_age + stale_expiration + stale_deadline; }
+	};
+
+	StaleFilter(MyTcpHandler &handler, const Options &options);
+	~StaleFilter();
+
+	/**
+	 *  Wrap onReceived() callback of a consumer with manual acks
+	 *  @param  channel         Channel used to settle stale messages
+	 *  @param  callback        User callback, called for fresh messages only
+	 */
+	AMQP::MessageCallback wrap(AMQP::Channel &channel, AMQP::MessageCallback callback);
+
+	/**
+	 *  Check if message is stale
+	 *  @param  message         Message to check
+	 *  @param  now_ms          Current unix time in ms
+	 */
+	bool stale(const AMQP::Message &message, uint64_t now_ms);
+
+	// Settle pending run of stale messages (Options::multiple)
+	void flush();
+
+	Stats stats() const;
+
+private:
+
+	struct Impl;
+	std::shared_ptr<Impl> pimpl;
+};
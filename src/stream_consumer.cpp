@@ -0,0 +1,327 @@
+#include <cstring>
+#include <cerrno>
+#include <unordered_set>
+
+extern "C"{
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+}
+
+#include "logger.hpp"
+#include "stream_consumer.hpp"
+
+
+// FileSink
+
+struct FileSink::Impl
+{
+	std::string directory;
+
+	int fd = -1;
+	std::string path;			// final file path
+	std::string stream;			// stream id of the open file, empty - standalone message
+	std::string chunk;			// stream id of the current message
+	uint64_t next = 0;			// expected chunk number of the open stream
+	bool last = true;			// last chunk of a stream (or a standalone message)
+	bool failed = false;		// current message write failed
+	bool duplicate = false;		// current chunk is written already
+
+	// Last completed stream, its redelivered chunks are skipped
+	std::string finished;
+	uint64_t finished_chunks = 0;
+
+	// Aborted streams, the rest of their chunks is rejected
+	std::unordered_set<std::string> aborted;
+
+	uint64_t counter = 0;
+	uint64_t files = 0;
+	uint64_t bytes = 0;
+
+	~Impl()
+	{
+		if(fd > -1){
+			close(fd);
+		}
+	}
+
+	static std::string sanitize(const std::string &name)
+	{
+		std::string res = name;
+
+		for(auto &c : res){
+			if(c == '/' || c == '\0'){
+				c = '_';
+			}
+		}
+
+		return res == "." || res == ".." ? "_" : res;
+	}
+
+	void open_file(const std::string &name)
+	{
+		path = directory + "/" + sanitize(name);
+		const std::string part = path + ".part";
+
+		fd = open(part.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | O_TRUNC, 0644);
+
+		if(fd < 0){
+			logger.msg(MSG_ERROR, "FileSink: open '%s' failed: %s\n", part, strerror(errno));
+			failed = true;
+		}
+	}
+
+	// Drop the open file, its stream won't be completed
+	void abort()
+	{
+		if(fd < 0){
+			return;
+		}
+
+		close(fd);
+		fd = -1;
+
+		const std::string part = path + ".part";
+		unlink(part.c_str());
+
+		if( !stream.empty() ){
+			logger.msg(MSG_ERROR, "FileSink: stream '%s' aborted\n", stream);
+			aborted.insert(stream);
+			stream.clear();
+		}
+	}
+};
+
+
+FileSink::FileSink(const std::string &directory): pimpl(new FileSink::Impl)
+{
+	pimpl->directory = directory;
+}
+
+FileSink::~FileSink() = default;
+
+void FileSink::begin(const Header &header)
+{
+	pimpl->failed = false;
+	pimpl->duplicate = false;
+	pimpl->last = true;
+	pimpl->chunk.clear();
+
+	const AMQP::MetaData &meta = header.meta;
+
+	if(meta.hasHeaders() && meta.headers().contains("x-stream-id")){
+		const AMQP::Table &headers = meta.headers();
+		const std::string &id = static_cast<const std::string&>(headers.get("x-stream-id"));
+		const uint64_t seq = headers.get("x-stream-seq");
+
+		pimpl->chunk = id;
+		pimpl->last = static_cast<uint64_t>(headers.get("x-stream-last")) != 0;
+
+		// Stream starts over (republished)
+		if(seq == 0){
+			pimpl->aborted.erase(id);
+		}
+
+		if(pimpl->aborted.count(id)){
+			pimpl->failed = true;
+			return;
+		}
+
+		// Redelivered after the ack was lost - written already
+		if((pimpl->fd > -1 && pimpl->stream == id && seq < pimpl->next) ||
+			(pimpl->finished == id && seq > 0 && seq < pimpl->finished_chunks)){
+			pimpl->duplicate = true;
+			return;
+		}
+
+		// Chunks of one stream are consumed in order - first one creates the file,
+		// the rest are appended unless another stream is open
+		if(pimpl->fd > -1 && (seq == 0 || pimpl->stream != id)){
+			pimpl->abort();
+		}
+
+		if(pimpl->fd < 0){
+			if(seq != 0){
+				// Beginning of the stream was missed (another consumer, started mid-stream)
+				logger.msg(MSG_ERROR, "FileSink: stream '%s' starts with chunk %lu\n", id, static_cast<unsigned long>(seq));
+				pimpl->aborted.insert(id);
+				pimpl->failed = true;
+				return;
+			}
+
+			pimpl->open_file(id);
+			pimpl->stream = id;
+			pimpl->next = 0;
+
+			if(pimpl->finished == id){
+				pimpl->finished.clear();
+			}
+
+			if(pimpl->failed){
+				pimpl->stream.clear();
+				pimpl->aborted.insert(id);
+			}
+
+			return;
+		}
+
+		if(seq != pimpl->next){
+			// Chunks are missing, the file would have a hole
+			logger.msg(MSG_ERROR, "FileSink: stream '%s' chunk %lu, expected %lu\n", id, 
+				static_cast<unsigned long>(seq), static_cast<unsigned long>(pimpl->next));
+			pimpl->abort();
+			pimpl->failed = true;
+		}
+
+		return;
+	}
+
+	// Open stream is interrupted
+	pimpl->abort();
+
+	std::string name = meta.hasMessageID() && !meta.messageID().empty() ? 
+		meta.messageID() : "message-" + std::to_string(++pimpl->counter);
+
+	pimpl->open_file(name);
+	pimpl->stream.clear();
+}
+
+void FileSink::data(const char *data, size_t size)
+{
+	while(size && !pimpl->failed && !pimpl->duplicate){
+		ssize_t res = write(pimpl->fd, data, size);
+
+		if(res < 0){
+			if(errno == EINTR){
+				continue;
+			}
+
+			logger.msg(MSG_ERROR, "FileSink: write '%s' failed: %s\n", pimpl->path, strerror(errno));
+			pimpl->failed = true;
+
+			// File has a hole now: never renamed, the rest of the stream is rejected
+			pimpl->abort();
+			return;
+		}
+
+		data += res;
+		size -= res;
+		pimpl->bytes += res;
+	}
+}
+
+bool FileSink::complete(uint64_t deliveryTag, bool redelivered)
+{
+	if(pimpl->failed){
+		// Nothing more of the stream is expected
+		if(pimpl->last){
+			pimpl->aborted.erase(pimpl->chunk);
+		}
+
+		return false;
+	}
+
+	if(pimpl->duplicate){
+		// Acked again; a chunk of a completed stream not redelivered is a republished
+		// stream without its beginning
+		return redelivered || pimpl->chunk == pimpl->stream;
+	}
+
+	if( !pimpl->last ){
+		// Stream continues, keep file open
+		++pimpl->next;
+		return true;
+	}
+
+	if( !pimpl->chunk.empty() ){
+		pimpl->finished = pimpl->chunk;
+		pimpl->finished_chunks = pimpl->next + 1;
+	}
+
+	close(pimpl->fd);
+	pimpl->fd = -1;
+	pimpl->stream.clear();
+
+	const std::string part = pimpl->path + ".part";
+
+	if(rename(part.c_str(), pimpl->path.c_str()) < 0){
+		logger.msg(MSG_ERROR, "FileSink: rename '%s' failed: %s\n", part, strerror(errno));
+		return false;
+	}
+
+	++pimpl->files;
+	logger.msg(MSG_DEBUG, "FileSink: '%s' written\n", pimpl->path);
+	return true;
+}
+
+uint64_t FileSink::files_written() const
+{
+	return pimpl->files;
+}
+
+uint64_t FileSink::bytes_written() const
+{
+	return pimpl->bytes;
+}
+
+
+// StreamConsumer
+
+struct StreamConsumer::Impl
+{
+	AMQP::Channel &channel;
+	StreamSink &sink;
+
+	// Message being received
+	std::string exchange;
+	std::string routingkey;
+	uint64_t body_size = 0;
+
+	Impl(AMQP::Channel &c, StreamSink &s): channel(c), sink(s)
+	{
+
+	}
+};
+
+
+StreamConsumer::StreamConsumer(AMQP::Channel &channel, StreamSink &sink):
+	pimpl(new StreamConsumer::Impl(channel, sink))
+{
+
+}
+
+StreamConsumer::~StreamConsumer() = default;
+
+AMQP::DeferredConsumer& StreamConsumer::consume(const std::string &queue)
+{
+	Impl *impl = pimpl.get();
+
+	// No onReceived() callback - library doesn't assemble message body
+	return impl->channel.consume(queue)
+		.onBegin([impl](const std::string &exchange, const std::string &routingkey)
+		{
+			impl->exchange = exchange;
+			impl->routingkey = routingkey;
+		})
+		.onSize([impl](uint64_t size)
+		{
+			impl->body_size = size;
+		})
+		.onHeaders([impl](const AMQP::MetaData &meta)
+		{
+			impl->sink.begin(StreamSink::Header{impl->exchange, impl->routingkey, meta, impl->body_size});
+		})
+		.onData([impl](const char *data, size_t size)
+		{
+			impl->sink.data(data, size);
+		})
+		.onComplete([impl](uint64_t deliveryTag, bool redelivered)
+		{
+			if(impl->sink.complete(deliveryTag, redelivered)){
+				impl->channel.ack(deliveryTag);
+			}
+			else{
+				impl->channel.reject(deliveryTag);
+			}
+		});
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <cstdint>
+
+#include <amqpcpp.h>
+
+/*
+	Streaming consumer of large messages.
+
+	onReceived() callback is called when the whole message body is assembled 
+	in memory. StreamConsumer installs the low level callbacks of the consumer 
+	instead (onBegin, onSize, onHeaders, onData, onComplete), so the body is 
+	passed to a sink frame by frame, as it arrives. Peak memory is bounded by
+	the frame size, not by the message size.
+
+	Message is acked when sink completes it successfully and rejected otherwise.
+*/
+
+class StreamSink
+{
+public:
+
+	struct Header
+	{
+		const std::string &exchange;
+		const std::string &routingkey;
+		const AMQP::MetaData &meta;		// valid during begin() only
+		uint64_t body_size;
+	};
+
+	virtual ~StreamSink() = default;
+
+	// Message header arrived, body follows
+	virtual void begin(const Header &header) = 0;
+
+	// Next chunk of the body (at most one frame)
+	virtual void data(const char *data, size_t size) = 0;
+
+	// Whole body was passed. Returning false rejects the message.
+	virtual bool complete(uint64_t deliveryTag, bool redelivered) = 0;
+};
+
+
+// Writes every message to a file in the directory. 
+//
+// Messages of a stream published by ChunkedPublisher ('x-stream-id' header) are 
+// appended to one file named by the stream id. File is written as '<name>.part' 
+// and renamed when the last chunk is received. Other messages are named by 
+// message-id (or by a counter if message-id is not set).
+//
+// Chunks of one stream are expected in order and not interleaved with other
+// messages. The next 'x-stream-seq' of the open stream is tracked: a chunk
+// written already (redelivered after a lost ack, also of the last completed
+// stream) is acked without writing. A stream interrupted (by another stream
+// or message), with missing chunks or a failed write is aborted - '.part'
+// file removed, the rest of its chunks rejected.
+class FileSink : public StreamSink
+{
+public:
+
+	explicit FileSink(const std::string &directory);
+	~FileSink();
+
+	void begin(const Header &header) override;
+	void data(const char *data, size_t size) override;
+	bool complete(uint64_t deliveryTag, bool redelivered) override;
+
+	uint64_t files_written() const;
+	uint64_t bytes_written() const;
+
+private:
+
+	struct Impl;
+	std::unique_ptr<Impl> pimpl;
+};
+
+
+class StreamConsumer
+{
+public:
+
+	StreamConsumer(AMQP::Channel &channel, StreamSink &sink);
+	~StreamConsumer();
+
+	/**
+	 *  Start consuming the queue with manual acks
+	 *  @return                 Deferred consumer to install other callbacks (onSuccess, onError)
+	 */
+	AMQP::DeferredConsumer& consume(const std::string &queue);
+
+private:
+
+	struct Impl;
+	std::unique_ptr<Impl> pimpl;
+};
@@ -0,0 +1,95 @@
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+
+#include "thread_pool.hpp"
+
+
+struct ThreadPool::Impl
+{
+	std::vector<std::thread> threads;
+
+	mutable std::mutex mutex;
+	std::condition_variable cv;
+	std::deque<std::function<void()>> tasks;
+	bool stop = false;
+
+	void run()
+	{
+		for(;;){
+			std::function<void()> task;
+
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				cv.wait(lock, [this]{ return stop || !tasks.empty(); });
+
+				if(tasks.empty()){
+					// stop requested and nothing left to do
+					return;
+				}
+
+				task = std::move(tasks.front());
+				tasks.pop_front();
+			}
+
+			task();
+		}
+	}
+};
+
+
+ThreadPool::ThreadPool(size_t threads): pimpl(new ThreadPool::Impl)
+{
+	// hardware_concurrency() may return 0 if the value is not computable
+	threads = std::max<size_t>(threads, 1);
+
+	pimpl->threads.reserve(threads);
+
+	for(size_t i = 0; i < threads; ++i){
+		pimpl->threads.emplace_back([this]{ pimpl->run(); });
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	this->shutdown();
+}
+
+void ThreadPool::shutdown()
+{
+	{
+		std::lock_guard<std::mutex> lock(pimpl->mutex);
+		pimpl->stop = true;
+	}
+
+	pimpl->cv.notify_all();
+
+	for(auto &thread : pimpl->threads){
+		if(thread.joinable()){
+			thread.join();
+		}
+	}
+}
+
+void ThreadPool::submit(std::function<void()> task)
+{
+	{
+		std::lock_guard<std::mutex> lock(pimpl->mutex);
+		pimpl->tasks.push_back(std::move(task));
+	}
+
+	pimpl->cv.notify_one();
+}
+
+size_t ThreadPool::size() const
+{
+	return pimpl->threads.size();
+}
+
+size_t ThreadPool::queued() const
+{
+	std::lock_guard<std::mutex> lock(pimpl->mutex);
+	return pimpl->tasks.size();
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <memory>
+#include <functional>
+#include <thread>
+
+// Fixed size pool of worker threads executing submitted tasks in FIFO order.
+//
+// Watch out: tasks are executed outside of the event loop thread, so they must 
+// not touch AMQP-CPP objects. Use MyTcpHandler::post() to get back to the loop.
+
+class ThreadPool
+{
+public:
+
+	explicit ThreadPool(size_t threads = std::thread::hardware_concurrency());
+
+	// Already submitted tasks are completed before the threads are joined
+	~ThreadPool();
+
+	// The same as the destructor, tasks submitted afterwards are not executed.
+	// Not to be called from a pool thread.
+	void shutdown();
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	/**
+	 *  Queue a task for execution by one of the pool threads. Thread-safe.
+	 *  @param  task            Callable to be executed
+	 */
+	void submit(std::function<void()> task);
+
+	// Number of worker threads
+	size_t size() const;
+
+	// Number of tasks waiting for a free worker
+	size_t queued() const;
+
+private:
+
+	struct Impl;
+	std::unique_ptr<Impl> pimpl;
+};
@@ -1,6 +1,15 @@
 #pragma once
 
 #include <string>
+#include <string_view>
+#include <functional>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+extern "C"{
+#include <unistd.h>
+}
 
 // Helpful Utilities
 
@@ -24,5 +33,32 @@ namespace utils
 		return res;
 	}
 
+	// Final mixer of splitmix64 - spreads bits of weak hashes (e.g. identity std::hash of integers)
+	inline uint64_t mix(uint64_t x)
+	{
+		x ^= x >> 30;
+		x *= 0xbf58476d1ce4e5b9ULL;
+		x ^= x >> 27;
+		x *= 0x94d049bb133111ebULL;
+		x ^= x >> 31;
+		return x;
+	}
+
+	// 64-bit hash of a byte string (message body, id, ...)
+	inline uint64_t hash(std::string_view data)
+	{
+		return mix( std::hash<std::string_view>{}(data) );
+	}
+
+	// Message ID unique across processes and restarts: <pid>-<start time>-<counter>
+	inline std::string unique_id()
+	{
+		static const std::string prefix = std::to_string(getpid()) + "-" +
+			std::to_string(std::chrono::system_clock::now().time_since_epoch().count()) + "-";
+		static std::atomic<uint64_t> counter{0};
+
+		return prefix + std::to_string(++counter);
+	}
+
 
 }
\ No newline at end of file
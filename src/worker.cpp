@@ -10,6 +10,7 @@
 
 #include "logger.hpp"
 #include "my_handler.hpp"
+#include "stale_filter.hpp"
 
 /*
 	Tutorial #2: Task queue
@@ -85,7 +86,18 @@ int main(int argc, char* argv[])
 	// then quickly redeliver it to another consumer. That way you can be 
 	// sure that no message is lost, even if the workers occasionally die.
 
-	channel.consume("task_queue").onReceived(
+	// When worker falls behind, tasks which are too old to be useful (by the 
+	// timestamp new_task sets, or whose 'expiration' or 'x-deadline' header has 
+	// passed) are rejected without being processed. Prefetch stays 1 for fair dispatch between the workers (the 
+	// point of this tutorial), so there is never a run of stale tasks to reject 
+	// with a single 'multiple' frame - each one is rejected on its own. Consumers 
+	// with a larger prefetch get bulk shedding with StaleFilter::Options::multiple.
+	StaleFilter::Options stale_options;
+	stale_options.max_age = 10min;
+
+	StaleFilter stale_filter(myHandler, stale_options);
+
+	channel.consume("task_queue").onReceived(stale_filter.wrap(channel,
 		[&channel](const AMQP::Message &message,
 			uint64_t deliveryTag,
 			bool redelivered)
@@ -104,10 +116,13 @@ int main(int argc, char* argv[])
 			logger.msg(MSG_DEBUG, " [x] Done\n");
 			channel.ack(deliveryTag);
 		}
-	);
+	));
 
 	// for debug unacked messages can be seen with
 	// sudo rabbitmqctl list_queues name messages_ready messages_unacknowledged
 
+	logger.msg(MSG_DEBUG, " [*] Waiting for messages. To exit press CTRL-C\n");
+	myHandler.loop(&connection);
+
 	return 0;
 }
\ No newline at end of file